@@ -0,0 +1,116 @@
+/*---------------------------------------------------------------------
+ * Description: bash loadable builtin running utfout without fork/exec.
+ *
+ * Author: James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * License: GPLv3. See below...
+ *---------------------------------------------------------------------
+ *
+ * Copyright © 2012-2015 James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *---------------------------------------------------------------------
+ */
+
+/* Load with:
+ *
+ *   enable -f /path/to/utfout.so utfout
+ *
+ * 'enable -d utfout' unloads it again.
+ */
+
+/* bash's configuration, which its headers depend on */
+#include <config.h>
+
+#include <stddef.h>
+
+#include "loadables.h"
+
+#include "builtin.h"
+
+/* everything else is hidden when built with -fvisibility=hidden */
+#define BUILTIN_EXPORT __attribute__ ((visibility ("default")))
+
+static char  utfout_name[] = "utfout";
+
+/**
+ * utfout_builtin:
+ *
+ * @list: arguments.
+ *
+ * Run utfout with the arguments in @list.
+ *
+ * Returns: exit status of utfout.
+ **/
+static int
+utfout_builtin (WORD_LIST *list)
+{
+    WORD_LIST   *l;
+    char       **argv;
+    int          argc = 1;
+    int          ret;
+
+    for (l = list; l; l = l->next)
+        argc++;
+
+    argv = xmalloc ((argc + 1) * sizeof (char *));
+
+    argc = 0;
+    argv[argc++] = utfout_name;
+
+    for (l = list; l; l = l->next)
+        argv[argc++] = l->word->word;
+
+    argv[argc] = NULL;
+
+    ret = utfout_builtin_run (argc, argv);
+
+    xfree (argv);
+
+    return ret;
+}
+
+/**
+ * utfout_builtin_load:
+ *
+ * @name: name the builtin is being loaded as.
+ *
+ * Called by bash when the builtin is loaded.
+ *
+ * Returns: TRUE if the builtin can be used.
+ **/
+BUILTIN_EXPORT int
+utfout_builtin_load (char *name)
+{
+    return utfout_builtin_init () == 0;
+}
+
+BUILTIN_EXPORT char *utfout_doc[] = {
+    "Echo strings to specified output stream(s).",
+    "",
+    "Runs utfout(1) within the shell rather than as a separate process,",
+    "accepting the same options (except '--pipeline'). Options affect",
+    "only the run they are given to. Errors, '\\c' and '-x' end the run",
+    "with an exit status rather than exiting the shell.",
+    (char *)NULL
+};
+
+BUILTIN_EXPORT struct builtin utfout_struct = {
+    utfout_name,
+    utfout_builtin,
+    BUILTIN_ENABLED,
+    utfout_doc,
+    "utfout [options] [string]...",
+    0
+};
@@ -0,0 +1,32 @@
+/*---------------------------------------------------------------------
+ * Description: Interface between utfout and its bash loadable builtin.
+ *
+ * Author: James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * License: GPLv3. See below...
+ *---------------------------------------------------------------------
+ *
+ * Copyright © 2012-2015 James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *---------------------------------------------------------------------
+ */
+
+#ifndef UTFOUT_BUILTIN_H
+#define UTFOUT_BUILTIN_H
+
+int  utfout_builtin_init (void);
+int  utfout_builtin_run  (int argc, char *argv[]);
+
+#endif /* UTFOUT_BUILTIN_H */
@@ -0,0 +1,929 @@
+/*---------------------------------------------------------------------
+ * Description: Streaming checksums of utfout output.
+ *
+ * Implements XXH3 (64-bit), CRC32C and SHA-256 such that output can be
+ * hashed incrementally as it is written. Each uses hardware support
+ * where the CPU provides it: SSE2 for the XXH3 accumulators, SSE4.2
+ * for CRC32C and the SHA extensions for SHA-256.
+ *
+ * Author: James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * License: GPLv3. See below...
+ *---------------------------------------------------------------------
+ *
+ * Copyright © 2012-2015 James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *---------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "checksum.h"
+
+/* XXH3 constants */
+#define PRIME32_1         0x9E3779B1U
+#define PRIME32_2         0x85EBCA77U
+#define PRIME32_3         0xC2B2AE3DU
+#define PRIME64_1         0x9E3779B185EBCA87ULL
+#define PRIME64_2         0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3         0x165667B19E3779F9ULL
+#define PRIME64_4         0x85EBCA77C2B2AE63ULL
+#define PRIME64_5         0x27D4EB2F165667C5ULL
+#define PRIME_MX1         0x165667919E3779F9ULL
+#define PRIME_MX2         0x9FB21C651E98DF25ULL
+
+#define XXH3_STRIPE_LEN       64
+#define XXH3_SECRET_SIZE      192
+#define XXH3_STRIPES_PER_BLOCK \
+    ((XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) / 8)
+#define XXH3_BUFFER_STRIPES   (256 / XXH3_STRIPE_LEN)
+
+static const uint8_t xxh3_secret[XXH3_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+/* SHA-256 round constants */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const char *const checksum_names[] = {
+    [CHECKSUM_NONE]   = "none",
+    [CHECKSUM_XXH3]   = "xxh3",
+    [CHECKSUM_CRC32C] = "crc32c",
+    [CHECKSUM_SHA256] = "sha256",
+};
+
+/* implementations selected according to CPU features */
+static void (*crc32c_update) (uint32_t *crc, const uint8_t *p, size_t len);
+static void (*sha256_blocks) (uint32_t h[8], const uint8_t *p, size_t blocks);
+
+static inline uint32_t
+read32 (const void *p)
+{
+    uint32_t  v;
+
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+static inline uint64_t
+read64 (const void *p)
+{
+    uint64_t  v;
+
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+static inline uint64_t
+rotl64 (uint64_t v, int n)
+{
+    return (v << n) | (v >> (64 - n));
+}
+
+static inline uint32_t
+rotr32 (uint32_t v, int n)
+{
+    return (v >> n) | (v << (32 - n));
+}
+
+static inline uint64_t
+mul128_fold64 (uint64_t a, uint64_t b)
+{
+    unsigned __int128  product = (unsigned __int128)a * b;
+
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t
+xxh64_avalanche (uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t
+xxh3_avalanche (uint64_t h)
+{
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t
+xxh3_rrmxmx (uint64_t h, uint64_t len)
+{
+    h ^= rotl64 (h, 49) ^ rotl64 (h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= PRIME_MX2;
+    h ^= h >> 28;
+    return h;
+}
+
+static inline uint64_t
+xxh3_mix16 (const uint8_t *in, const uint8_t *secret)
+{
+    return mul128_fold64 (read64 (in) ^ read64 (secret),
+            read64 (in + 8) ^ read64 (secret + 8));
+}
+
+/**
+ * xxh3_short:
+ *
+ * @in: data,
+ * @len: length of @in (at most 240 bytes).
+ *
+ * Returns: XXH3 hash of @in.
+ **/
+static uint64_t
+xxh3_short (const uint8_t *in, size_t len)
+{
+    const uint8_t  *s = xxh3_secret;
+    uint64_t        acc;
+    size_t          i;
+
+    if (len > 128) {
+        acc = len * PRIME64_1;
+
+        for (i = 0; i < 8; i++)
+            acc += xxh3_mix16 (in + (16 * i), s + (16 * i));
+
+        acc = xxh3_avalanche (acc);
+
+        for (i = 8; i < len / 16; i++)
+            acc += xxh3_mix16 (in + (16 * i), s + (16 * (i - 8)) + 3);
+
+        acc += xxh3_mix16 (in + len - 16, s + 136 - 17);
+
+        return xxh3_avalanche (acc);
+    }
+
+    if (len > 16) {
+        acc = len * PRIME64_1;
+
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96) {
+                    acc += xxh3_mix16 (in + 48, s + 96);
+                    acc += xxh3_mix16 (in + len - 64, s + 112);
+                }
+                acc += xxh3_mix16 (in + 32, s + 64);
+                acc += xxh3_mix16 (in + len - 48, s + 80);
+            }
+            acc += xxh3_mix16 (in + 16, s + 32);
+            acc += xxh3_mix16 (in + len - 32, s + 48);
+        }
+        acc += xxh3_mix16 (in, s);
+        acc += xxh3_mix16 (in + len - 16, s + 16);
+
+        return xxh3_avalanche (acc);
+    }
+
+    if (len > 8) {
+        uint64_t  lo = read64 (in) ^ (read64 (s + 24) ^ read64 (s + 32));
+        uint64_t  hi = read64 (in + len - 8) ^ (read64 (s + 40) ^ read64 (s + 48));
+
+        acc = len + __builtin_bswap64 (lo) + hi + mul128_fold64 (lo, hi);
+
+        return xxh3_avalanche (acc);
+    }
+
+    if (len >= 4) {
+        uint64_t  value;
+
+        value = read32 (in + len - 4) + ((uint64_t)read32 (in) << 32);
+        value ^= read64 (s + 8) ^ read64 (s + 16);
+
+        return xxh3_rrmxmx (value, len);
+    }
+
+    if (len) {
+        uint32_t  combined;
+
+        combined = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24)
+            | in[len - 1] | ((uint32_t)len << 8);
+
+        return xxh64_avalanche (combined ^ (uint64_t)(read32 (s) ^ read32 (s + 4)));
+    }
+
+    return xxh64_avalanche (read64 (s + 56) ^ read64 (s + 64));
+}
+
+/**
+ * xxh3_accumulate:
+ *
+ * @acc: accumulators,
+ * @in: input,
+ * @secret: secret for first stripe,
+ * @stripes: number of 64-byte stripes in @in.
+ *
+ * Mix @stripes stripes of @in into @acc.
+ **/
+static void
+xxh3_accumulate (uint64_t *acc, const uint8_t *in, const uint8_t *secret,
+                 size_t stripes)
+{
+    size_t  n;
+
+#ifdef __SSE2__
+    __m128i  a[4];
+    size_t   i;
+
+    for (i = 0; i < 4; i++)
+        a[i] = _mm_loadu_si128 ((const __m128i *)(acc + (2 * i)));
+
+    for (n = 0; n < stripes; n++) {
+        const uint8_t  *p = in + (n * XXH3_STRIPE_LEN);
+        const uint8_t  *k = secret + (n * 8);
+
+        for (i = 0; i < 4; i++) {
+            __m128i  data = _mm_loadu_si128 ((const __m128i *)(p + (16 * i)));
+            __m128i  key = _mm_loadu_si128 ((const __m128i *)(k + (16 * i)));
+            __m128i  data_key = _mm_xor_si128 (data, key);
+            __m128i  data_key_hi = _mm_shuffle_epi32 (data_key, _MM_SHUFFLE (0, 3, 0, 1));
+            __m128i  product = _mm_mul_epu32 (data_key, data_key_hi);
+            __m128i  swapped = _mm_shuffle_epi32 (data, _MM_SHUFFLE (1, 0, 3, 2));
+
+            a[i] = _mm_add_epi64 (a[i], _mm_add_epi64 (product, swapped));
+        }
+    }
+
+    for (i = 0; i < 4; i++)
+        _mm_storeu_si128 ((__m128i *)(acc + (2 * i)), a[i]);
+#else
+    for (n = 0; n < stripes; n++) {
+        const uint8_t  *p = in + (n * XXH3_STRIPE_LEN);
+        const uint8_t  *k = secret + (n * 8);
+        size_t          i;
+
+        for (i = 0; i < 8; i++) {
+            uint64_t  data = read64 (p + (8 * i));
+            uint64_t  data_key = data ^ read64 (k + (8 * i));
+
+            acc[i ^ 1] += data;
+            acc[i] += (data_key & 0xffffffff) * (data_key >> 32);
+        }
+    }
+#endif
+}
+
+/**
+ * xxh3_scramble:
+ *
+ * @acc: accumulators.
+ *
+ * Scramble @acc at the end of a block.
+ **/
+static void
+xxh3_scramble (uint64_t *acc)
+{
+    const uint8_t  *k = xxh3_secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN;
+    size_t          i;
+
+    for (i = 0; i < 8; i++) {
+        uint64_t  a = acc[i];
+
+        a ^= a >> 47;
+        a ^= read64 (k + (8 * i));
+        a *= PRIME32_1;
+        acc[i] = a;
+    }
+}
+
+/**
+ * xxh3_consume:
+ *
+ * @state: XXH3 state,
+ * @acc: accumulators,
+ * @stripes_so_far: number of stripes consumed in current block,
+ * @in: input,
+ * @stripes: number of stripes in @in.
+ *
+ * Mix @stripes stripes of @in into @acc, scrambling at block
+ * boundaries.
+ **/
+static void
+xxh3_consume (uint64_t *acc, size_t *stripes_so_far, const uint8_t *in,
+              size_t stripes)
+{
+    size_t  todo;
+
+    while (stripes) {
+        todo = XXH3_STRIPES_PER_BLOCK - *stripes_so_far;
+
+        if (todo > stripes) {
+            xxh3_accumulate (acc, in, xxh3_secret + (*stripes_so_far * 8),
+                    stripes);
+            *stripes_so_far += stripes;
+            return;
+        }
+
+        xxh3_accumulate (acc, in, xxh3_secret + (*stripes_so_far * 8), todo);
+        xxh3_scramble (acc);
+
+        *stripes_so_far = 0;
+        in += todo * XXH3_STRIPE_LEN;
+        stripes -= todo;
+    }
+}
+
+static void
+xxh3_init (struct xxh3_state *state)
+{
+    static const uint64_t  initial[8] = {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+        PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+    };
+
+    memset (state, 0, sizeof (struct xxh3_state));
+    memcpy (state->acc, initial, sizeof (initial));
+}
+
+static void
+xxh3_update (struct xxh3_state *state, const uint8_t *in, size_t len)
+{
+    const uint8_t  *end = in + len;
+    size_t          fill;
+
+    state->total += len;
+
+    if (state->buffered + len <= sizeof (state->buffer)) {
+        memcpy (state->buffer + state->buffered, in, len);
+        state->buffered += len;
+        return;
+    }
+
+    if (state->buffered) {
+        fill = sizeof (state->buffer) - state->buffered;
+        memcpy (state->buffer + state->buffered, in, fill);
+        in += fill;
+
+        xxh3_consume (state->acc, &state->stripes, state->buffer,
+                XXH3_BUFFER_STRIPES);
+        state->buffered = 0;
+    }
+
+    /* always leave some input buffered for the final stripe */
+    if (end - in > (ptrdiff_t)sizeof (state->buffer)) {
+        size_t  stripes = (size_t)(end - in - 1) / XXH3_STRIPE_LEN;
+
+        xxh3_consume (state->acc, &state->stripes, in, stripes);
+        in += stripes * XXH3_STRIPE_LEN;
+
+        /* keep the last stripe consumed in case it is needed as
+         * part of the final stripe.
+         */
+        memcpy (state->buffer + sizeof (state->buffer) - XXH3_STRIPE_LEN,
+                in - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+    }
+
+    memcpy (state->buffer, in, (size_t)(end - in));
+    state->buffered = (size_t)(end - in);
+}
+
+static uint64_t
+xxh3_final (const struct xxh3_state *state)
+{
+    uint64_t        acc[8];
+    uint8_t         last[XXH3_STRIPE_LEN];
+    const uint8_t  *stripe;
+    const uint8_t  *s = xxh3_secret + 11;
+    size_t          stripes_so_far = state->stripes;
+    uint64_t        result;
+    size_t          i;
+
+    if (state->total <= 240)
+        return xxh3_short (state->buffer, (size_t)state->total);
+
+    memcpy (acc, state->acc, sizeof (acc));
+
+    if (state->buffered >= XXH3_STRIPE_LEN) {
+        size_t  stripes = (state->buffered - 1) / XXH3_STRIPE_LEN;
+
+        xxh3_consume (acc, &stripes_so_far, state->buffer, stripes);
+        stripe = state->buffer + state->buffered - XXH3_STRIPE_LEN;
+    } else {
+        size_t  catchup = XXH3_STRIPE_LEN - state->buffered;
+
+        memcpy (last, state->buffer + sizeof (state->buffer) - catchup,
+                catchup);
+        memcpy (last + catchup, state->buffer, state->buffered);
+        stripe = last;
+    }
+
+    xxh3_accumulate (acc, stripe,
+            xxh3_secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - 7, 1);
+
+    result = state->total * PRIME64_1;
+
+    for (i = 0; i < 4; i++)
+        result += mul128_fold64 (acc[2 * i] ^ read64 (s + (16 * i)),
+                acc[(2 * i) + 1] ^ read64 (s + (16 * i) + 8));
+
+    return xxh3_avalanche (result);
+}
+
+/**
+ * crc32c_update_table:
+ *
+ * @crc: CRC to update,
+ * @p: data,
+ * @len: length of @p.
+ *
+ * Portable CRC32C implementation.
+ **/
+static void
+crc32c_update_table (uint32_t *crc, const uint8_t *p, size_t len)
+{
+    static uint32_t  table[256];
+    uint32_t         c = *crc;
+
+    if (! table[1]) {
+        uint32_t  i;
+        int       j;
+
+        for (i = 0; i < 256; i++) {
+            uint32_t  v = i;
+
+            for (j = 0; j < 8; j++)
+                v = (v >> 1) ^ (0x82f63b78 & -(v & 1));
+
+            table[i] = v;
+        }
+    }
+
+    while (len--)
+        c = table[(c ^ *p++) & 0xff] ^ (c >> 8);
+
+    *crc = c;
+}
+
+#ifdef HAVE_X86
+
+/**
+ * crc32c_update_sse42:
+ *
+ * @crc: CRC to update,
+ * @p: data,
+ * @len: length of @p.
+ *
+ * CRC32C implementation using the SSE4.2 crc32 instruction.
+ **/
+__attribute__ ((target ("sse4.2")))
+static void
+crc32c_update_sse42 (uint32_t *crc, const uint8_t *p, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t  c = *crc;
+
+    for (; len >= 8; p += 8, len -= 8)
+        c = _mm_crc32_u64 (c, read64 (p));
+#else
+    uint32_t  c = *crc;
+
+    for (; len >= 4; p += 4, len -= 4)
+        c = _mm_crc32_u32 (c, read32 (p));
+#endif
+
+    while (len--)
+        c = _mm_crc32_u8 ((uint32_t)c, *p++);
+
+    *crc = (uint32_t)c;
+}
+
+#endif /* HAVE_X86 */
+
+/**
+ * sha256_blocks_generic:
+ *
+ * @h: hash value,
+ * @p: data,
+ * @blocks: number of 64-byte blocks in @p.
+ *
+ * Portable SHA-256 compression function.
+ **/
+static void
+sha256_blocks_generic (uint32_t h[8], const uint8_t *p, size_t blocks)
+{
+    uint32_t  w[64];
+    uint32_t  a, b, c, d, e, f, g, hh;
+    uint32_t  t1;
+    uint32_t  t2;
+    size_t    i;
+
+    for (; blocks; blocks--, p += 64) {
+        for (i = 0; i < 16; i++)
+            w[i] = __builtin_bswap32 (read32 (p + (4 * i)));
+
+        for (i = 16; i < 64; i++) {
+            uint32_t  s0 = rotr32 (w[i - 15], 7) ^ rotr32 (w[i - 15], 18)
+                ^ (w[i - 15] >> 3);
+            uint32_t  s1 = rotr32 (w[i - 2], 17) ^ rotr32 (w[i - 2], 19)
+                ^ (w[i - 2] >> 10);
+
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3];
+        e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+
+        for (i = 0; i < 64; i++) {
+            t1 = hh + (rotr32 (e, 6) ^ rotr32 (e, 11) ^ rotr32 (e, 25))
+                + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            t2 = (rotr32 (a, 2) ^ rotr32 (a, 13) ^ rotr32 (a, 22))
+                + ((a & b) ^ (a & c) ^ (b & c));
+
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+}
+
+#ifdef HAVE_X86
+
+/**
+ * sha256_blocks_shani:
+ *
+ * @h: hash value,
+ * @p: data,
+ * @blocks: number of 64-byte blocks in @p.
+ *
+ * SHA-256 compression function using the x86 SHA extensions.
+ **/
+__attribute__ ((target ("sha,sse4.1,ssse3")))
+static void
+sha256_blocks_shani (uint32_t h[8], const uint8_t *p, size_t blocks)
+{
+    const __m128i  mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+                                          0x0405060700010203ULL);
+    __m128i        state0;
+    __m128i        state1;
+    __m128i        tmp;
+    __m128i        msg[16];
+    __m128i        abef;
+    __m128i        cdgh;
+    size_t         i;
+
+    tmp = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *)&h[0]), 0xB1);
+    state1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *)&h[4]), 0x1B);
+    state0 = _mm_alignr_epi8 (tmp, state1, 8);
+    state1 = _mm_blend_epi16 (state1, tmp, 0xF0);
+
+    for (; blocks; blocks--, p += 64) {
+        abef = state0;
+        cdgh = state1;
+
+        for (i = 0; i < 16; i++) {
+            if (i < 4) {
+                msg[i] = _mm_shuffle_epi8 (
+                        _mm_loadu_si128 ((const __m128i *)(p + (16 * i))), mask);
+            } else {
+                tmp = _mm_sha256msg1_epu32 (msg[i - 4], msg[i - 3]);
+                tmp = _mm_add_epi32 (tmp,
+                        _mm_alignr_epi8 (msg[i - 1], msg[i - 2], 4));
+                msg[i] = _mm_sha256msg2_epu32 (tmp, msg[i - 1]);
+            }
+
+            tmp = _mm_add_epi32 (msg[i],
+                    _mm_loadu_si128 ((const __m128i *)&sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32 (state1, state0, tmp);
+            tmp = _mm_shuffle_epi32 (tmp, 0x0E);
+            state0 = _mm_sha256rnds2_epu32 (state0, state1, tmp);
+        }
+
+        state0 = _mm_add_epi32 (state0, abef);
+        state1 = _mm_add_epi32 (state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32 (state0, 0x1B);
+    state1 = _mm_shuffle_epi32 (state1, 0xB1);
+    state0 = _mm_blend_epi16 (tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8 (state1, tmp, 8);
+
+    _mm_storeu_si128 ((__m128i *)&h[0], state0);
+    _mm_storeu_si128 ((__m128i *)&h[4], state1);
+}
+
+#endif /* HAVE_X86 */
+
+static void
+sha256_init (struct sha256_state *state)
+{
+    static const uint32_t  initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memset (state, 0, sizeof (struct sha256_state));
+    memcpy (state->h, initial, sizeof (initial));
+}
+
+static void
+sha256_update (struct sha256_state *state, const uint8_t *in, size_t len)
+{
+    size_t  fill;
+
+    state->total += len;
+
+    if (state->buffered) {
+        fill = sizeof (state->buffer) - state->buffered;
+        if (fill > len)
+            fill = len;
+
+        memcpy (state->buffer + state->buffered, in, fill);
+        state->buffered += fill;
+        in += fill;
+        len -= fill;
+
+        if (state->buffered < sizeof (state->buffer))
+            return;
+
+        sha256_blocks (state->h, state->buffer, 1);
+        state->buffered = 0;
+    }
+
+    if (len >= 64) {
+        sha256_blocks (state->h, in, len / 64);
+        in += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    memcpy (state->buffer, in, len);
+    state->buffered = len;
+}
+
+static void
+sha256_final (struct sha256_state *state, uint8_t digest[32])
+{
+    uint8_t   pad[72] = { 0x80 };
+    uint64_t  bits = state->total * 8;
+    size_t    padlen;
+    size_t    i;
+
+    padlen = (state->buffered < 56 ? 56 : 120) - state->buffered;
+
+    for (i = 0; i < 8; i++)
+        pad[padlen + i] = (uint8_t)(bits >> (56 - (8 * i)));
+
+    sha256_update (state, pad, padlen + 8);
+
+    for (i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(state->h[i] >> 24);
+        digest[(4 * i) + 1] = (uint8_t)(state->h[i] >> 16);
+        digest[(4 * i) + 2] = (uint8_t)(state->h[i] >> 8);
+        digest[(4 * i) + 3] = (uint8_t)state->h[i];
+    }
+}
+
+/**
+ * checksum_select:
+ *
+ * Choose implementations according to the features of the CPU.
+ **/
+static void
+checksum_select (void)
+{
+    crc32c_update = crc32c_update_table;
+    sha256_blocks = sha256_blocks_generic;
+
+#ifdef HAVE_X86
+    {
+        unsigned int  eax, ebx, ecx, edx;
+        int           ssse3 = 0;
+        int           sse41 = 0;
+
+        if (__get_cpuid (1, &eax, &ebx, &ecx, &edx)) {
+            ssse3 = !! (ecx & bit_SSSE3);
+            sse41 = !! (ecx & bit_SSE4_1);
+
+            if (ecx & bit_SSE4_2)
+                crc32c_update = crc32c_update_sse42;
+        }
+
+        if (ssse3 && sse41 && __get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx)
+                && (ebx & bit_SHA))
+            sha256_blocks = sha256_blocks_shani;
+    }
+#endif
+}
+
+/**
+ * checksum_type_from_name:
+ *
+ * @name: name of checksum algorithm.
+ *
+ * Returns: checksum type, or CHECKSUM_NONE if @name is not known.
+ **/
+enum checksum_type
+checksum_type_from_name (const char *name)
+{
+    size_t  i;
+
+    assert (name);
+
+    for (i = CHECKSUM_NONE + 1; i <= CHECKSUM_SHA256; i++) {
+        if (! strcasecmp (name, checksum_names[i]))
+            return (enum checksum_type)i;
+    }
+
+    return CHECKSUM_NONE;
+}
+
+/**
+ * checksum_name:
+ *
+ * @type: checksum type.
+ *
+ * Returns: name of @type.
+ **/
+const char *
+checksum_name (enum checksum_type type)
+{
+    return checksum_names[type];
+}
+
+/**
+ * checksum_init:
+ *
+ * @sum: checksum,
+ * @type: algorithm to use.
+ *
+ * Prepare @sum for use.
+ **/
+void
+checksum_init (struct checksum *sum, enum checksum_type type)
+{
+    assert (sum);
+
+    if (! crc32c_update)
+        checksum_select ();
+
+    memset (sum, 0, sizeof (struct checksum));
+    sum->type = type;
+
+    switch (type) {
+        case CHECKSUM_XXH3:
+            xxh3_init (&sum->u.xxh3);
+            break;
+
+        case CHECKSUM_CRC32C:
+            sum->u.crc32c = 0xffffffff;
+            break;
+
+        case CHECKSUM_SHA256:
+            sha256_init (&sum->u.sha256);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * checksum_update:
+ *
+ * @sum: checksum,
+ * @data: data to add,
+ * @len: length of @data.
+ *
+ * Add @len bytes of @data to @sum.
+ **/
+void
+checksum_update (struct checksum *sum, const void *data, size_t len)
+{
+    assert (sum);
+
+    sum->bytes += len;
+
+    switch (sum->type) {
+        case CHECKSUM_XXH3:
+            xxh3_update (&sum->u.xxh3, data, len);
+            break;
+
+        case CHECKSUM_CRC32C:
+            crc32c_update (&sum->u.crc32c, data, len);
+            break;
+
+        case CHECKSUM_SHA256:
+            sha256_update (&sum->u.sha256, data, len);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * checksum_final:
+ *
+ * @sum: checksum,
+ * @hex: buffer of at least CHECKSUM_MAX_HEX bytes.
+ *
+ * Write the digest of @sum to @hex as a nul-terminated hexadecimal
+ * string, in the same form as xxhsum(1), crc32c tools and
+ * sha256sum(1). @sum may not be updated afterwards.
+ **/
+void
+checksum_final (struct checksum *sum, char *hex)
+{
+    uint8_t  digest[32];
+    size_t   i;
+
+    assert (sum);
+    assert (hex);
+
+    *hex = '\0';
+
+    switch (sum->type) {
+        case CHECKSUM_XXH3:
+            sprintf (hex, "%016llx",
+                    (unsigned long long)xxh3_final (&sum->u.xxh3));
+            break;
+
+        case CHECKSUM_CRC32C:
+            sprintf (hex, "%08x", (unsigned int)~sum->u.crc32c);
+            break;
+
+        case CHECKSUM_SHA256:
+            sha256_final (&sum->u.sha256, digest);
+            for (i = 0; i < sizeof (digest); i++)
+                sprintf (hex + (2 * i), "%02x", digest[i]);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * checksum_hash:
+ *
+ * @data: data to hash,
+ * @len: length of @data.
+ *
+ * Returns: XXH3 (64-bit) hash of @data.
+ **/
+uint64_t
+checksum_hash (const void *data, size_t len)
+{
+    struct xxh3_state  state;
+
+    assert (data || ! len);
+
+    if (len <= 240)
+        return xxh3_short ((const uint8_t *)data, len);
+
+    xxh3_init (&state);
+    xxh3_update (&state, (const uint8_t *)data, len);
+
+    return xxh3_final (&state);
+}
@@ -0,0 +1,113 @@
+/*---------------------------------------------------------------------
+ * Description: Streaming checksums of utfout output.
+ *
+ * Author: James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * License: GPLv3. See below...
+ *---------------------------------------------------------------------
+ *
+ * Copyright © 2012-2015 James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *---------------------------------------------------------------------
+ */
+
+#ifndef UTFOUT_CHECKSUM_H
+#define UTFOUT_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* size of buffer required by checksum_final() */
+#define CHECKSUM_MAX_HEX    65
+
+/**
+ * enum checksum_type:
+ *
+ * Supported checksum algorithms.
+ **/
+enum checksum_type {
+    CHECKSUM_NONE,
+    CHECKSUM_XXH3,
+    CHECKSUM_CRC32C,
+    CHECKSUM_SHA256,
+};
+
+/**
+ * struct xxh3_state:
+ *
+ * @acc: accumulators,
+ * @buffer: input not yet consumed,
+ * @buffered: number of bytes in @buffer,
+ * @stripes: number of stripes consumed in the current block,
+ * @total: total number of bytes hashed.
+ *
+ * State of a streaming XXH3 (64-bit, seed 0) hash.
+ **/
+struct xxh3_state {
+    uint64_t  acc[8];
+    uint8_t   buffer[256];
+    size_t    buffered;
+    size_t    stripes;
+    uint64_t  total;
+};
+
+/**
+ * struct sha256_state:
+ *
+ * @h: hash value,
+ * @buffer: partial block,
+ * @buffered: number of bytes in @buffer,
+ * @total: total number of bytes hashed.
+ *
+ * State of a streaming SHA-256 hash.
+ **/
+struct sha256_state {
+    uint32_t  h[8];
+    uint8_t   buffer[64];
+    size_t    buffered;
+    uint64_t  total;
+};
+
+/**
+ * struct checksum:
+ *
+ * @type: algorithm,
+ * @bytes: number of bytes hashed,
+ * @xxh3: state for CHECKSUM_XXH3,
+ * @crc32c: state for CHECKSUM_CRC32C,
+ * @sha256: state for CHECKSUM_SHA256.
+ *
+ * Running checksum.
+ **/
+struct checksum {
+    enum checksum_type  type;
+    uint64_t            bytes;
+    union {
+        struct xxh3_state    xxh3;
+        uint32_t             crc32c;
+        struct sha256_state  sha256;
+    } u;
+};
+
+enum checksum_type  checksum_type_from_name (const char *name);
+const char         *checksum_name           (enum checksum_type type);
+void                checksum_init           (struct checksum *sum,
+                                             enum checksum_type type);
+void                checksum_update         (struct checksum *sum,
+                                             const void *data, size_t len);
+void                checksum_final          (struct checksum *sum, char *hex);
+uint64_t            checksum_hash           (const void *data, size_t len);
+
+#endif /* UTFOUT_CHECKSUM_H */
@@ -0,0 +1,43 @@
+#!/bin/sh
+#---------------------------------------------------------------------
+# Description: Training workload for profile-guided optimisation.
+#
+# Runs the utfout binary given as the only argument over a
+# representative set of strings (literals, escapes, ranges, random
+# output and separators), writing all output to standard output.
+# The output is deterministic such that builds can be compared.
+#
+# License: GPLv3.
+#---------------------------------------------------------------------
+
+set -e
+
+utfout=${1:?usage: $0 <utfout>}
+
+LC_ALL=C.UTF-8
+export LC_ALL
+"$utfout" '' > /dev/null 2>&1 || LC_ALL=C
+
+# literals
+"$utfout" 'The quick brown fox jumps over the lazy dog.\n' -r 200000
+"$utfout" -l 'no \escapes \here\n' -r 100000
+
+# escapes
+"$utfout" '\a\b\e\f\n\r\t\v\0\x41\o102☺\U0001F600\n' -r 100000
+"$utfout" -B '\xde\xad\xbe\xef\X{cafebabe}\n' -r 100000
+
+# ranges and sequences
+"$utfout" '\{a..z}\{Z..A}\{x21..x2f}\{u03b1..u03c9}\n' -r 20000
+"$utfout" '\{1..1000000,\n}\n'
+"$utfout" '\{0001..9999..7,-}\n' -r 20
+
+# random output
+"$utfout" --seed=1 '\g' -r 1000000
+"$utfout" --seed=2 '\g\g\g\g\g\g\g\g\n' -r 100000
+"$utfout" --seed=3 '\G{any}' -r 100000
+"$utfout" --seed=4 '\z{3,4K}' -r 1000
+
+# separators
+"$utfout" -a , 'separated\n' -r 100000
+"$utfout" -a ' ' '\{a..z}\n' -r 20000
+"$utfout" --begin 'key=' -a : 'value\n' --end -r 100000
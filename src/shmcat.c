@@ -0,0 +1,293 @@
+/*---------------------------------------------------------------------
+ * Description: Reference consumer of the shared memory ring written
+ * by 'utfout --shm'.
+ *
+ * Waits for the ring to be created, then copies its data to standard
+ * output (or with '-c' only counts it) until utfout has finished,
+ * removing the shared memory object afterwards.
+ *
+ * Author: James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * License: GPLv3. See below...
+ *---------------------------------------------------------------------
+ *
+ * Copyright © 2012-2015 James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *---------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmring.h"
+
+/* interval between checks for the ring being created */
+#define POLL_NS  1000000
+
+static const char *program_name = "utfout-shmcat";
+
+/**
+ * die:
+ *
+ * @fmt: printf-style format and arguments.
+ *
+ * Display formatted string and exit.
+ **/
+static void
+die (const char *fmt, ...)
+{
+    va_list  ap;
+
+    fprintf (stderr, "%s: ERROR: ", program_name);
+
+    va_start (ap, fmt);
+    vfprintf (stderr, fmt, ap);
+    va_end (ap);
+
+    if (errno)
+        fprintf (stderr, " (%s)", strerror (errno));
+
+    fputc ('\n', stderr);
+
+    exit (EXIT_FAILURE);
+}
+
+/**
+ * usage:
+ **/
+static void
+usage (void)
+{
+    printf ("Usage: %s [options] <name>\n"
+            "\n"
+            "Copy the data of shared memory ring <name> written by\n"
+            "'utfout --shm=<name>' to standard output.\n"
+            "\n"
+            "Options:\n"
+            "\n"
+            "  -c : Count the data rather than copying it and display the\n"
+            "       rate it was consumed at on standard error.\n"
+            "  -h : This help text.\n"
+            "  -k : Keep the shared memory object rather than removing it.\n"
+            "\n",
+            program_name);
+}
+
+/**
+ * open_ring:
+ *
+ * @name: name of shared memory object,
+ * @fd: file descriptor of object (set).
+ *
+ * Wait for utfout to create and initialise the ring @name.
+ *
+ * Returns: header of ring.
+ **/
+static struct shm_ring *
+open_ring (const char *name, int *fd)
+{
+    const struct timespec   poll = { 0, POLL_NS };
+    struct shm_ring        *ring;
+    struct stat             st;
+    long                    page = sysconf (_SC_PAGESIZE);
+
+    while ((*fd = shm_open (name, O_RDWR, 0)) < 0) {
+        if (errno != ENOENT)
+            die ("failed to open shared memory '%s'", name);
+
+        nanosleep (&poll, NULL);
+    }
+
+    errno = 0;
+
+    /* the object is sized once, just after it is created */
+    for (;;) {
+        if (fstat (*fd, &st) < 0)
+            die ("failed to query shared memory '%s'", name);
+
+        if (st.st_size)
+            break;
+
+        nanosleep (&poll, NULL);
+    }
+
+    if (st.st_size < page)
+        die ("shared memory '%s' is not a ring", name);
+
+    ring = mmap (NULL, (size_t)page, PROT_READ | PROT_WRITE, MAP_SHARED,
+            *fd, 0);
+    if (ring == MAP_FAILED)
+        die ("failed to map shared memory '%s'", name);
+
+    while (__atomic_load_n (&ring->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC)
+        nanosleep (&poll, NULL);
+
+    if (ring->version != SHM_RING_VERSION)
+        die ("unsupported ring version %u", ring->version);
+
+    if ((uint64_t)st.st_size < ring->data + ring->size)
+        die ("shared memory '%s' is truncated", name);
+
+    return ring;
+}
+
+/**
+ * write_all:
+ *
+ * @data: data to write,
+ * @len: length of @data.
+ *
+ * Write @data to standard output.
+ **/
+static void
+write_all (const char *data, size_t len)
+{
+    ssize_t  ret;
+
+    while (len) {
+        ret = write (STDOUT_FILENO, data, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            die ("failed to write output");
+        }
+
+        data += ret;
+        len -= (size_t)ret;
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+    struct shm_ring  *ring;
+    const char       *name;
+    char             *data;
+    uint64_t          mask;
+    uint64_t          head;
+    uint64_t          tail = 0;
+    uint32_t          seq;
+    struct timespec   start;
+    struct timespec   end;
+    double            secs;
+    int               count = 0;
+    int               keep = 0;
+    int               option;
+    int               fd;
+
+    while ((option = getopt (argc, argv, "chk")) != -1) {
+        switch (option) {
+            case 'c':
+                count = 1;
+                break;
+
+            case 'h':
+                usage ();
+                exit (EXIT_SUCCESS);
+
+            case 'k':
+                keep = 1;
+                break;
+
+            default:
+                usage ();
+                exit (EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage ();
+        exit (EXIT_FAILURE);
+    }
+
+    name = argv[optind];
+
+    ring = open_ring (name, &fd);
+
+    data = shm_ring_map (fd, ring->data, ring->size);
+    if (! data)
+        die ("failed to map shared memory '%s'", name);
+
+    mask = ring->size - 1;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            seq = __atomic_load_n (&ring->head_seq, __ATOMIC_ACQUIRE);
+
+            /* all data is written before the ring is closed */
+            if (__atomic_load_n (&ring->closed, __ATOMIC_ACQUIRE)) {
+                if (__atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) == tail)
+                    break;
+                continue;
+            }
+
+            __atomic_store_n (&ring->reader_waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+            /* utfout only wakes the reader if it sees the flag */
+            if (__atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) == tail)
+                shm_ring_wait (&ring->head_seq, seq);
+
+            __atomic_store_n (&ring->reader_waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        /* the data is mapped twice, so is contiguous however it wraps */
+        if (! count)
+            write_all (data + (tail & mask), (size_t)(head - tail));
+
+        tail = head;
+
+        __atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+        __atomic_fetch_add (&ring->tail_seq, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n (&ring->writer_waiting, __ATOMIC_RELAXED))
+            shm_ring_wake (&ring->tail_seq);
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    if (count) {
+        secs = (double)(end.tv_sec - start.tv_sec)
+            + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+        fprintf (stderr, "%llu bytes in %.3fs (%.1f MiB/s)\n",
+                (unsigned long long)tail, secs,
+                secs > 0 ? (double)tail / secs / (1024 * 1024) : 0.0);
+    }
+
+    if (! keep && shm_unlink (name) < 0 && errno != ENOENT)
+        die ("failed to remove shared memory '%s'", name);
+
+    shm_ring_unmap (data, ring->size);
+    munmap (ring, (size_t)ring->data);
+    close (fd);
+
+    exit (EXIT_SUCCESS);
+}
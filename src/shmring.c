@@ -0,0 +1,111 @@
+/*---------------------------------------------------------------------
+ * Description: Shared memory ring written by '--shm'.
+ *
+ * Mapping and futex helpers used by both utfout (the producer) and
+ * utfout-shmcat (the reference consumer).
+ *
+ * Author: James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * License: GPLv3. See below...
+ *---------------------------------------------------------------------
+ *
+ * Copyright © 2012-2015 James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *---------------------------------------------------------------------
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmring.h"
+
+/**
+ * shm_ring_map:
+ *
+ * @fd: shared memory object containing a ring,
+ * @offset: offset of the data in @fd,
+ * @size: size of the data (a multiple of the page size).
+ *
+ * Map the data of the ring twice, back to back, so that any @size
+ * bytes starting within the first mapping are contiguous in memory
+ * however they wrap around the end of the ring.
+ *
+ * Returns: data, or NULL on failure.
+ **/
+char *
+shm_ring_map (int fd, uint64_t offset, uint64_t size)
+{
+    char  *data;
+
+    /* reserve the address space for both mappings */
+    data = mmap (NULL, (size_t)size * 2, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    if (mmap (data, (size_t)size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, (off_t)offset) == MAP_FAILED
+            || mmap (data + size, (size_t)size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, (off_t)offset) == MAP_FAILED) {
+        munmap (data, (size_t)size * 2);
+        return NULL;
+    }
+
+    return data;
+}
+
+/**
+ * shm_ring_unmap:
+ *
+ * @data: data returned by shm_ring_map(),
+ * @size: size passed to shm_ring_map().
+ **/
+void
+shm_ring_unmap (char *data, uint64_t size)
+{
+    if (data)
+        munmap (data, (size_t)size * 2);
+}
+
+/**
+ * shm_ring_wait:
+ *
+ * @seq: futex word in the ring header,
+ * @value: value of @seq the caller last saw.
+ *
+ * Sleep until @seq is woken, unless it no longer has @value. Callers
+ * must recheck the condition they are waiting for on return.
+ **/
+void
+shm_ring_wait (uint32_t *seq, uint32_t value)
+{
+    /* EAGAIN (@seq has changed) and EINTR just mean "look again" */
+    (void)syscall (SYS_futex, seq, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+/**
+ * shm_ring_wake:
+ *
+ * @seq: futex word in the ring header.
+ *
+ * Wake a process sleeping in shm_ring_wait() on @seq.
+ **/
+void
+shm_ring_wake (uint32_t *seq)
+{
+    (void)syscall (SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
@@ -0,0 +1,95 @@
+/*---------------------------------------------------------------------
+ * Description: Layout of the shared memory ring written by '--shm'.
+ *
+ * Author: James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * License: GPLv3. See below...
+ *---------------------------------------------------------------------
+ *
+ * Copyright © 2012-2015 James Hunt <jamesodhunt@ubuntu.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *---------------------------------------------------------------------
+ */
+
+#ifndef UTFOUT_SHMRING_H
+#define UTFOUT_SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* "UTFR" once the ring is ready for use */
+#define SHM_RING_MAGIC      0x52465455
+
+#define SHM_RING_VERSION    1
+
+/**
+ * struct shm_ring:
+ *
+ * @magic: SHM_RING_MAGIC, stored last when the ring is created,
+ * @version: SHM_RING_VERSION,
+ * @size: size of the data in bytes (a power of 2),
+ * @data: offset of the data in the object (the page size),
+ * @head: total number of bytes written (only written by the producer),
+ * @head_seq: incremented whenever @head or @closed changes,
+ * @closed: set once the producer has finished writing,
+ * @reader_waiting: set by a consumer before waiting on @head_seq,
+ * @tail: total number of bytes consumed (only written by the consumer),
+ * @tail_seq: incremented whenever @tail changes,
+ * @writer_waiting: set by the producer before waiting on @tail_seq.
+ *
+ * Header at the start of the POSIX shared memory object created by
+ * '--shm'. It is followed at offset @data by @size bytes of data, byte
+ * N of the output being at offset (N % @size). The producer and a
+ * single consumer each own one of @head and @tail, so the ring needs
+ * no locks: the producer writes data then stores @head (release), the
+ * consumer loads @head (acquire), reads the data then stores @tail
+ * (release). Bytes from @tail up to @head are readable, and the
+ * producer only writes between @head and @tail + @size.
+ *
+ * The *_seq fields are futex words (shared, not private) so that
+ * either side can sleep: set the *_waiting flag, recheck the index,
+ * then FUTEX_WAIT on the *_seq value read before the flag was set.
+ * After updating its index and sequence, each side wakes the other
+ * only if the corresponding *_waiting flag is set, so no system
+ * calls are made while neither side waits. Data is complete once
+ * @closed is set and @tail equals @head.
+ **/
+struct shm_ring {
+    uint32_t  magic;
+    uint32_t  version;
+    uint64_t  size;
+    uint64_t  data;
+
+    /* producer (kept on its own cache line) */
+    uint64_t  head __attribute__ ((aligned (64)));
+    uint32_t  head_seq;
+    uint32_t  closed;
+    uint32_t  reader_waiting;
+
+    /* consumer */
+    uint64_t  tail __attribute__ ((aligned (64)));
+    uint32_t  tail_seq;
+    uint32_t  writer_waiting;
+};
+
+/* used by utfout and utfout-shmcat (see shmring.c, which other
+ * consumers may copy)
+ */
+char *shm_ring_map   (int fd, uint64_t offset, uint64_t size);
+void  shm_ring_unmap (char *data, uint64_t size);
+void  shm_ring_wait  (uint32_t *seq, uint32_t value);
+void  shm_ring_wake  (uint32_t *seq);
+
+#endif /* UTFOUT_SHMRING_H */
@@ -11,11 +11,10 @@
  *
  * Author: James Hunt <jamesodhunt@ubuntu.com>
  *
- * Bugs: This code is messy (*), partly since we're not using
- *       flex+bison due to the inherant difficulties of handling
- *       UTF-8/wide characters with those tools.
- *
- *       (*) In particular, generate_chars() is an abomination.
+ * Notes: We don't use flex+bison due to the inherant difficulties of
+ *        handling UTF-8/wide characters with those tools. Instead,
+ *        strings are tokenized by a small table-driven lexer
+ *        (see lex_string()).
  *
  * License: GPLv3. See below...
  *---------------------------------------------------------------------
@@ -37,9 +36,15 @@
  *---------------------------------------------------------------------
  */
 
+#ifndef _GNU_SOURCE
+/* for sendmmsg(2) */
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -57,11 +62,61 @@
 #include <assert.h>
 #include <sys/time.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <libintl.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define _(string) gettext (string)
 
 #include "config.h"
+#include "checksum.h"
+
+#ifdef UTFOUT_BUILTIN
+#include <setjmp.h>
+#include "builtin.h"
+
+/* main() is run by the shell builtin (see builtin.c) */
+#define main utfout_main
+int main (int argc, char *argv[]);
+#endif
+
+#if defined (HAVE_SYS_EPOLL_H) && defined (HAVE_SYS_TIMERFD_H)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define HAVE_STREAMS 1
+#endif
+
+#if defined (HAVE_PTHREAD_H) && defined (HAVE_SEMAPHORE_H)
+#include <pthread.h>
+#include <semaphore.h>
+#define HAVE_PIPELINE 1
+#endif
+
+#if defined (HAVE_LINUX_FUTEX_H) && defined (HAVE_SYS_SYSCALL_H) \
+    && defined (HAVE_SHM_OPEN)
+#include "shmring.h"
+#define HAVE_SHM_RING 1
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#else
+#define DTRACE_PROBE1(provider, name, arg1)
+#define DTRACE_PROBE2(provider, name, arg1, arg2)
+#define DTRACE_PROBE3(provider, name, arg1, arg2, arg3)
+#endif
 
 /* character to emit for '\e' escape */
 #define ESCAPE_CHAR       0x1b
@@ -87,1181 +142,9248 @@ char              *last_str = NULL;
 /* true if all escapes are to be disabled */
 int                disable_escapes = 0;
 
-
-/* prototypes */
-void      usage                    (void);
-int       open_terminal            (void);
-void      handle_string            (int fd, const char *str, const char *delay,
-                                    int separator_specified, int separator);
-void      signal_handler           (int signum);
-void      handle_sleep             (const char *str);
-void      wait_for_intr            (void);
-int       generate_chars           (const wchar_t *range, wchar_t **expanded,
-                                    size_t *len, size_t *consumed);
-int       get_hex_char             (const wchar_t *str, wchar_t *character);
-int       simple_escape_to_literal (int value);
-wchar_t   get_random_char          (void);
+/* true if malformed escapes should be fatal */
+int                strict = 0;
+
+/* true if '\x' and '\o' escapes produce bytes rather than characters */
+int                bytes_mode = 0;
+
+/* maximum number of functions registered by utfout_atexit() */
+#define EXIT_HANDLERS     8
+
+/* functions to call on exit */
+void             (*exit_handlers[EXIT_HANDLERS]) (void);
+size_t             exit_handler_count = 0;
+
+
+/* values for options that only have a long form */
+enum {
+    OPTION_STRICT = 256,
+    OPTION_CLOCK_UPDATE,
+    OPTION_ENCODING,
+    OPTION_BOM,
+    OPTION_STREAM,
+    OPTION_STATS,
+    OPTION_CHECKSUM,
+    OPTION_SEED,
+    OPTION_SKIP,
+    OPTION_RANGE,
+    OPTION_SHARD,
+    OPTION_DATAGRAM,
+    OPTION_FILE,
+    OPTION_FILE_OPTIONS,
+    OPTION_PIPELINE,
+    OPTION_BEGIN,
+    OPTION_END,
+    OPTION_PROFILE,
+    OPTION_PROFILE_REPORT,
+    OPTION_FRAME,
+    OPTION_TERM_BENCH,
+    OPTION_SHM,
+    OPTION_SKIP_REPEATS,
+};
+
+/* Character classes recognised by the lexer */
+#define CLASS_OCT         0x01
+#define CLASS_DEC         0x02
+#define CLASS_HEX         0x04
 
 /**
- * get_oct_char:
+ * struct char_info:
  *
- * Convert octal value in @str to single wide character value @character.
+ * @flags: bitmask of CLASS_* values,
+ * @value: numeric value of a digit character.
  *
- * @str: wide string containing octal value,
- * @character: wide character output value.
+ * Classification of a single ASCII character. Non-ASCII characters
+ * belong to no class.
  **/
-#define get_oct_char(str, character) \
-    get_base_char (str, character, 8)
+struct char_info {
+    unsigned char  flags;
+    unsigned char  value;
+};
+
+#define OCT_DIGIT(c, v) [c] = { CLASS_OCT | CLASS_DEC | CLASS_HEX, v }
+#define DEC_DIGIT(c, v) [c] = { CLASS_DEC | CLASS_HEX, v }
+#define HEX_DIGIT(c, v) [c] = { CLASS_HEX, v }
+
+static const struct char_info char_table[128] = {
+    OCT_DIGIT ('0', 0),  OCT_DIGIT ('1', 1),  OCT_DIGIT ('2', 2),
+    OCT_DIGIT ('3', 3),  OCT_DIGIT ('4', 4),  OCT_DIGIT ('5', 5),
+    OCT_DIGIT ('6', 6),  OCT_DIGIT ('7', 7),  DEC_DIGIT ('8', 8),
+    DEC_DIGIT ('9', 9),
+
+    HEX_DIGIT ('a', 10), HEX_DIGIT ('b', 11), HEX_DIGIT ('c', 12),
+    HEX_DIGIT ('d', 13), HEX_DIGIT ('e', 14), HEX_DIGIT ('f', 15),
+
+    HEX_DIGIT ('A', 10), HEX_DIGIT ('B', 11), HEX_DIGIT ('C', 12),
+    HEX_DIGIT ('D', 13), HEX_DIGIT ('E', 14), HEX_DIGIT ('F', 15),
+};
 
 /**
- * get_hex_char:
+ * enum escape_kind:
  *
- * Convert hex value in @str to single wide character value @character.
- *
- * @str: wide string containing hex value,
- * @character: wide character output value.
+ * How the character following the escape prefix is handled.
  **/
-#define get_hex_char(str, character) \
-    get_base_char (str, character, 16)
+enum escape_kind {
+    ESCAPE_INVALID = 0, /* not an escape: display uninterpreted */
+    ESCAPE_SIMPLE,      /* maps to a single literal character */
+    ESCAPE_NUMERIC,     /* character value given as digits */
+    ESCAPE_RANGE,       /* '\{N..N}' */
+    ESCAPE_RANDOM,      /* '\g' */
+    ESCAPE_STOP,        /* '\c' */
+    ESCAPE_TIME,        /* '\T{FORMAT}' */
+    ESCAPE_ELAPSED,     /* '\M{UNIT}' */
+    ESCAPE_WORD,        /* '\w{PATH}' */
+    ESCAPE_MALFORMED,   /* '\G{KIND}' */
+    ESCAPE_COMPRESSIBLE,/* '\z{RATIO}' */
+    ESCAPE_BYTES        /* '\X{HEX}' */
+};
 
 /**
- * is_octal:
+ * struct escape_spec:
  *
- * @wc: wide character to check.
+ * @kind: type of escape,
+ * @value: literal value for ESCAPE_SIMPLE,
+ * @flags: CLASS_* value digits must belong to for ESCAPE_NUMERIC,
+ * @base: numerical base for ESCAPE_NUMERIC,
+ * @digits: maximum number of digits for ESCAPE_NUMERIC (and the
+ *  exact number required when used as a range endpoint).
+ **/
+struct escape_spec {
+    enum escape_kind  kind;
+    wchar_t           value;
+    unsigned char     flags;
+    int               base;
+    int               digits;
+};
+
+static const struct escape_spec escape_table[128] = {
+    ['0'] = { ESCAPE_SIMPLE,  L'\0' },
+    ['a'] = { ESCAPE_SIMPLE,  L'\a' },
+    ['b'] = { ESCAPE_SIMPLE,  L'\b' },
+    ['c'] = { ESCAPE_STOP },
+    ['e'] = { ESCAPE_SIMPLE,  ESCAPE_CHAR },
+    ['f'] = { ESCAPE_SIMPLE,  L'\f' },
+    ['g'] = { ESCAPE_RANDOM },
+    ['G'] = { ESCAPE_MALFORMED },
+    ['M'] = { ESCAPE_ELAPSED },
+    ['n'] = { ESCAPE_SIMPLE,  L'\n' },
+    ['o'] = { ESCAPE_NUMERIC, 0, CLASS_OCT, 8, 3 },
+    ['r'] = { ESCAPE_SIMPLE,  L'\r' },
+    ['t'] = { ESCAPE_SIMPLE,  L'\t' },
+    ['T'] = { ESCAPE_TIME },
+    ['u'] = { ESCAPE_NUMERIC, 0, CLASS_HEX, 16, 4 },
+    ['U'] = { ESCAPE_NUMERIC, 0, CLASS_HEX, 16, 8 },
+    ['v'] = { ESCAPE_SIMPLE,  L'\v' },
+    ['w'] = { ESCAPE_WORD },
+    ['x'] = { ESCAPE_NUMERIC, 0, CLASS_HEX, 16, 2 },
+    ['X'] = { ESCAPE_BYTES },
+    ['z'] = { ESCAPE_COMPRESSIBLE },
+    ['{'] = { ESCAPE_RANGE },
+};
+
+/* maximum number of digits in a numeric sequence value */
+#define SEQUENCE_MAX_DIGITS   19
+
+/* maximum number of characters in a numeric sequence separator */
+#define SEQUENCE_MAX_SEP      16
+
+/* records up to this size are copied using a fixed-size copy */
+#define SEQUENCE_RECORD_COPY  32
+
+/**
+ * struct sequence:
  *
- * Determine if @wc is an octal character.
+ * @first: first value,
+ * @last: limit value,
+ * @step: (positive) increment between values,
+ * @width: minimum width of values (zero-padded),
+ * @sep: separator to display between values,
+ * @sep_len: number of characters in @sep,
+ * @sep_specified: TRUE if @sep was specified.
  *
- * Returns: TRUE if @wc is an octal character, else FALSE.
+ * Numeric sequence of the form '\{FIRST..LAST[..STEP][,SEP]}'.
  **/
-#define is_octal(wc) \
-    (wc && \
-     iswctype (wc, wctype("digit")) && wc >= L'0' && wc <= L'7')
+struct sequence {
+    unsigned long long  first;
+    unsigned long long  last;
+    unsigned long long  step;
+    int                 width;
+    wchar_t             sep[SEQUENCE_MAX_SEP];
+    size_t              sep_len;
+    int                 sep_specified;
+};
+
+/* maximum number of characters in a time format */
+#define TIME_MAX_FORMAT       64
+
+/* maximum number of pieces a time format is split into */
+#define TIME_MAX_PIECES       16
+
+/* size of formatted time cache */
+#define TIME_CACHE_SIZE       256
 
 /**
- * is_hex:
+ * enum clock_update:
  *
- * @wc: wide character to check.
+ * How often the clock is read for time escapes.
+ **/
+enum clock_update {
+    CLOCK_UPDATE_BUFFER,    /* once per output buffer */
+    CLOCK_UPDATE_STRING,    /* once per string (and repeat) displayed */
+    CLOCK_UPDATE_ALWAYS     /* for every time escape */
+};
+
+/**
+ * enum time_piece_type:
  *
- * Determine if @wc is an hex character.
+ * Types of element a time format is split into.
+ **/
+enum time_piece_type {
+    TIME_PIECE_STRFTIME,    /* strftime(3) format */
+    TIME_PIECE_SECONDS,     /* integer number of seconds */
+    TIME_PIECE_FRACTION     /* fractional seconds */
+};
+
+/**
+ * struct time_piece:
  *
- * Returns: TRUE if @wc is an hex character, else FALSE.
+ * @type: type of piece,
+ * @format: strftime(3) format for TIME_PIECE_STRFTIME,
+ * @digits: number of digits for TIME_PIECE_FRACTION,
+ * @offset: offset of TIME_PIECE_FRACTION digits in formatted cache.
  **/
-#define is_hex(wc) \
-    (wc && iswctype (wc, wctype("xdigit")))
+struct time_piece {
+    enum time_piece_type  type;
+    char                 *format;
+    int                   digits;
+    size_t                offset;
+};
 
 /**
- * die:
+ * struct time_format:
  *
- * @fmt: printf-style format and arguments.
+ * @clock: clock to read,
+ * @pieces: pieces format has been split into,
+ * @count: number of entries in @pieces,
+ * @cached_sec: second @cache was formatted for (or -1),
+ * @cache: formatted time,
+ * @cache_len: length of @cache.
  *
- * Display formatted string and exit.
+ * Time escape. The formatted time is cached and only recalculated
+ * when the second changes; fractional seconds are patched into
+ * @cache in place.
  **/
-void
-die (const char *fmt, ...)
-{
-    char     tag[] = "ERROR";
-    va_list  ap;
-    char     buffer[BUFSIZ];
-    wchar_t  wbuffer[BUFSIZ];
-    char    *p;
-    size_t   len;
-    size_t   wlen;
-    int      ret;
+struct time_format {
+    clockid_t           clock;
+    struct time_piece   pieces[TIME_MAX_PIECES];
+    size_t              count;
+    time_t              cached_sec;
+    char                cache[TIME_CACHE_SIZE];
+    size_t              cache_len;
+};
 
-    len = sizeof (buffer) / sizeof (wchar_t);
-
-    buffer[len-1] = '\0';
+/**
+ * struct clock_cache:
+ *
+ * @realtime: last value read from CLOCK_REALTIME,
+ * @monotonic: last value read from CLOCK_MONOTONIC,
+ * @realtime_valid: TRUE if @realtime is current,
+ * @monotonic_valid: TRUE if @monotonic is current,
+ * @start: value of CLOCK_MONOTONIC at startup.
+ **/
+struct clock_cache {
+    struct timespec  realtime;
+    struct timespec  monotonic;
+    int              realtime_valid;
+    int              monotonic_valid;
+    struct timespec  start;
+};
 
-    p = buffer;
+struct clock_cache  clocks;
 
-    va_start (ap, fmt);
+/* how often to read the clock */
+enum clock_update   clock_update = CLOCK_UPDATE_BUFFER;
 
-    ret = snprintf (p, len, "%s", tag);
-    if (ret < 0)
-        goto error;
+/**
+ * struct corpus:
+ *
+ * @next: next corpus in list,
+ * @path: path of file,
+ * @map: memory-mapped contents of file,
+ * @size: size of @map,
+ * @entries: offset and length of each entry in @map,
+ * @count: number of entries.
+ *
+ * Newline-separated list of entries (such as words). Each file is
+ * only mapped once however many escapes refer to it.
+ **/
+struct corpus {
+    struct corpus  *next;
+    char           *path;
+    char           *map;
+    size_t          size;
+    struct {
+        size_t      offset;
+        size_t      length;
+    }              *entries;
+    size_t          count;
+};
+
+/* list of all corpora that have been loaded */
+struct corpus  *corpora = NULL;
 
-    p += ret;
+/**
+ * struct word_source:
+ *
+ * @corpus: corpus to select entries from,
+ * @zipf: TRUE to select using a Zipf distribution, else uniformly,
+ * @exponent: Zipf exponent,
+ * @h_integral_x1: precomputed value for Zipf sampler,
+ * @h_integral_n: precomputed value for Zipf sampler,
+ * @s: precomputed value for Zipf sampler,
+ * @next: indices of the next entries to display.
+ *
+ * Word escape.
+ **/
+struct word_source {
+    struct corpus  *corpus;
+    int             zipf;
+    double          exponent;
+    double          h_integral_x1;
+    double          h_integral_n;
+    double          s;
+    size_t          next[2];
+};
 
-    ret = vsnprintf (p, len-ret, fmt, ap);
-    if (ret < 0)
-        goto error;
+/**
+ * enum malformed_kind:
+ *
+ * Classes of malformed UTF-8 sequence.
+ **/
+enum malformed_kind {
+    MALFORMED_OVERLONG,     /* value encoded with more bytes than needed */
+    MALFORMED_SURROGATE,    /* UTF-16 surrogate (U+D800 - U+DFFF) */
+    MALFORMED_TRUNCATED,    /* multi-byte sequence missing trailing bytes */
+    MALFORMED_CONTINUATION, /* continuation byte without a lead byte */
+    MALFORMED_TOO_LARGE,    /* value beyond U+10FFFF */
+
+    MALFORMED_KINDS
+};
+
+/* names of malformed kinds, indexed by enum malformed_kind */
+static const char *const malformed_names[MALFORMED_KINDS] = {
+    "overlong",
+    "surrogate",
+    "truncated",
+    "continuation",
+    "toolarge",
+};
 
-    va_end (ap);
+/**
+ * struct malformed:
+ *
+ * @weights: relative frequency of each kind,
+ * @total: sum of @weights.
+ *
+ * Malformed UTF-8 escape.
+ **/
+struct malformed {
+    unsigned int  weights[MALFORMED_KINDS];
+    unsigned int  total;
+};
 
-    p += ret;
+/* default number of bytes displayed by a compressible data escape */
+#define COMPRESSIBLE_DEFAULT_SIZE   4096
 
-    ret = snprintf (p, len, "\n");
-    if (ret < 0)
-        goto error;
+/* largest compression ratio a compressible data escape may request */
+#define COMPRESSIBLE_MAX_RATIO      1000.0
 
-    p += ret;
+/* mean number of random bytes between back-references */
+#define COMPRESSIBLE_LITERAL_RUN    16
 
-    /* check for buffer overflow */
-    assert (buffer[len-1] == '\0');
+/* shortest literal plus back-reference segment */
+#define COMPRESSIBLE_MIN_PERIOD     256
 
-    /* convert MBS to wide-character string */
-    errno = 0;
-    wlen = mbsnrtowcs (wbuffer, (const char **)&p, len, len, NULL);
-    if (wlen == (size_t)-1 && errno == EILSEQ)
-        goto error;
+/* longest segment: keeps back-references within a 32KiB window */
+#define COMPRESSIBLE_MAX_PERIOD     8192
 
-    ret = fputws (wbuffer, stderr);
+/* approximate encoded size of a back-reference (deflate and zstd) */
+#define COMPRESSIBLE_MATCH_COST     5.0
 
-    if (ret < 0)
-        goto error;
+/* longest back-reference distance: nearer matches cost less to encode,
+ * so a short window keeps the ratio independent of SIZE */
+#define COMPRESSIBLE_WINDOW         4096
 
-    exit (EXIT_FAILURE);
+/**
+ * struct compressible:
+ *
+ * @ratio: requested compression ratio,
+ * @size: number of bytes to display,
+ * @period: number of bytes in each literal plus back-reference segment,
+ * @literal: mean number of random bytes per segment, as a 16.16
+ *  fixed-point value.
+ *
+ * Compressible data escape.
+ **/
+struct compressible {
+    double    ratio;
+    size_t    size;
+    size_t    period;
+    uint64_t  literal;
+};
 
-error:
-    fwprintf (stderr, L"ERROR: failed to format error string\n");
-    exit (EXIT_FAILURE);
-}
+/**
+ * enum token_type:
+ *
+ * Types of token produced by the lexer.
+ **/
+enum token_type {
+    TOKEN_LITERAL,      /* run of characters from the string */
+    TOKEN_CHAR,         /* single character produced by an escape */
+    TOKEN_RANGE,        /* range of characters */
+    TOKEN_SEQUENCE,     /* numeric sequence */
+    TOKEN_RANDOM,       /* random character */
+    TOKEN_STOP,         /* no further output */
+    TOKEN_TIME,         /* formatted time */
+    TOKEN_WORD,         /* random entry from a corpus */
+    TOKEN_MALFORMED,    /* malformed UTF-8 sequence */
+    TOKEN_COMPRESSIBLE, /* data with a given compression ratio */
+    TOKEN_BYTES         /* run of raw bytes */
+};
 
 /**
- * get_base_char:
+ * struct token:
  *
- * @str: string containing wide char that needs conversion,
- * @character: output value,
- * @base: numerical base.
+ * @type: type of token,
+ * @offset: position of token in wide string,
+ * @len: number of characters in a TOKEN_LITERAL,
+ * @byte_offset: offset of multi-byte form of TOKEN_LITERAL (or of the
+ *  bytes of a TOKEN_BYTES) in lexed string,
+ * @byte_len: number of bytes in multi-byte form of TOKEN_LITERAL (or
+ *  in a TOKEN_BYTES),
+ * @start: character for TOKEN_CHAR, or first character of a TOKEN_RANGE,
+ * @end: last character of a TOKEN_RANGE,
+ * @separate: TRUE if the separator may follow this token,
+ * @seq: details of a TOKEN_SEQUENCE,
+ * @time: details of a TOKEN_TIME,
+ * @words: details of a TOKEN_WORD,
+ * @malformed: details of a TOKEN_MALFORMED,
+ * @compressible: details of a TOKEN_COMPRESSIBLE.
+ **/
+struct token {
+    enum token_type      type;
+    size_t               offset;
+    size_t               len;
+    size_t               byte_offset;
+    size_t               byte_len;
+    wchar_t              start;
+    wchar_t              end;
+    int                  separate;
+    struct sequence     *seq;
+    struct time_format  *time;
+    struct word_source  *words;
+    struct malformed    *malformed;
+    struct compressible *compressible;
+};
+
+/**
+ * struct lexed_string:
  *
- * Convert string representation of number in @str to @character
- * in base @base.
+ * @wstr: wide character version of string,
+ * @len: number of wide characters in @wstr,
+ * @tokens: array of tokens,
+ * @count: number of entries in @tokens,
+ * @size: number of entries allocated for @tokens,
+ * @bytes: multi-byte version of literal runs and raw bytes,
+ * @bytes_len: number of bytes in @bytes,
+ * @rendered: output of a string that is the same every time it is
+ *  displayed, rendered once by prerender_string() (or NULL),
+ * @rendered_len: number of bytes in @rendered.
+ **/
+struct lexed_string {
+    wchar_t       *wstr;
+    size_t         len;
+    struct token  *tokens;
+    size_t         count;
+    size_t         size;
+    char          *bytes;
+    size_t         bytes_len;
+    char          *rendered;
+    size_t         rendered_len;
+};
+
+/**
+ * enum op:
  *
- * Returns: 0 on success, -1 on error.
+ * Operations performed by the instructions that arguments are
+ * compiled to.
  **/
-int
-get_base_char (const wchar_t  *str,
-               wchar_t        *character,
-               int             base)
-{
-    wchar_t  *endptr;
-    size_t    tmp;
+enum op {
+    OP_EMIT,            /* display a string */
+    OP_SLEEP,           /* pause */
+    OP_BLOCK,           /* run a block of instructions */
+    OP_EXIT             /* exit */
+};
 
-    assert (str);
+struct program;
 
-    errno = 0;
-    tmp = wcstoul (str, &endptr, base);
-    if (errno || *endptr) {
-        fwprintf (stderr,
-                L"%s: %s\n",
-                L"ERROR",
-                L"failed to extract base %d character from string '%s'",
-                base, str);
-        return -1;
-    }
+/* interval at which a profile's rate is re-evaluated */
+#define PROFILE_TICK      1000000ULL
 
-    *character = (wchar_t)tmp;
+/**
+ * enum profile_shape:
+ *
+ * How the rate changes during a phase of a profile.
+ **/
+enum profile_shape {
+    PROFILE_HOLD,       /* constant rate */
+    PROFILE_RAMP,       /* linear change from @from to @to */
+    PROFILE_STEP,       /* @steps equal steps from @from to @to */
+    PROFILE_SINE        /* sine wave between @from and @to */
+};
 
-    return 0;
-}
+/**
+ * struct profile_phase:
+ *
+ * @shape: shape of phase,
+ * @start: seconds from start of profile at which phase starts,
+ * @duration: length of phase in seconds,
+ * @from: initial (or minimum) rate,
+ * @to: final (or maximum) rate,
+ * @steps: number of steps for PROFILE_STEP,
+ * @period: seconds per cycle for PROFILE_SINE.
+ **/
+struct profile_phase {
+    enum profile_shape  shape;
+    double              start;
+    double              duration;
+    double              from;
+    double              to;
+    double              steps;
+    double              period;
+};
 
 /**
- * OUT_WCHAR:
+ * struct profile:
  *
- * @fd: open file descriptor,
- * @wc: wide character to display.
+ * @phases: phases in order,
+ * @count: number of @phases,
+ * @length: total length of profile in seconds,
+ * @burst_factor: rate multiplier during a burst (0 for no bursts),
+ * @burst_length: seconds each burst lasts,
+ * @burst_every: seconds from the start of one burst to the next,
+ * @text: copy of the specification or timeline parsed,
+ * @next: next profile in list.
  *
- * Convert wide character @wc back into multi-byte sequence and
- * write to file descriptor @fd.
- */
-#define OUT_WCHAR(fd, wc, delay) \
-{ \
-    char    buffer[8]; \
-    size_t  len; \
-    \
-    len = wcrtomb (buffer, wc, NULL); \
-    if (len != (size_t)-1) { \
-        ret = write (fd, buffer, len); \
-        if (ret < 0) \
-        die ("failed to display character %lx", wc); \
-    } \
-    \
-    if (delay) \
-    handle_sleep (delay); \
-}
+ * Target number of displays per second of a repeat over time.
+ **/
+struct profile {
+    struct profile_phase  *phases;
+    size_t                 count;
+    double                 length;
+    double                 burst_factor;
+    double                 burst_length;
+    double                 burst_every;
+    char                  *text;
+    struct profile        *next;
+};
+
+/* profile applied to subsequent repeats (or NULL) */
+struct profile         *profile = NULL;
+
+/* list of all profiles that have been parsed */
+struct profile         *profiles = NULL;
+
+/* nano-seconds between reports of the achieved rate (0 for none) */
+uint64_t                profile_report = 0;
 
 /**
- * usage:
+ * struct shaper:
  *
- * Display details to stdout of how this program can be used.
+ * @profile: profile being followed,
+ * @start: CLOCK_MONOTONIC time in nano-seconds the profile started,
+ * @tick: number of PROFILE_TICK intervals scheduled,
+ * @target: number of displays due by the end of the current tick,
+ * @emitted: number of displays so far,
+ * @report_tick: tick at which the current report interval started,
+ * @report_target: value of @target at start of report interval,
+ * @report_emitted: value of @emitted at start of report interval.
+ *
+ * State of a repeat following a profile.
  **/
-void
-usage (void)
-{
-    printf (
-            "Usage: %s [<options>]\n"
-            "\n"
-            "Description: Echo strings to specified output stream(s).\n"
-            "\n"
-            "Options:\n"
-            "\n"
-            "  -a, --intra-char=<char>    : Insert specified character between all\n"
-            "                               output characters.\n"
-            "  -b, --intra-pause=<delay>  : Pause between writing each character.\n"
-            "  -e, --stderr               : Write subsequent strings to standard error\n"
-            "                               (file descriptor %d).\n"
-            "  -h, --help                 : This help text.\n"
-            "  -i, --interpret            : Interpret escape characters.\n"
-            "  -l, --literal              : Write literal strings only\n"
-            "                               (disable escape characters)\n"
-            "  -o, --stdout               : Write subsequent strings to standard output\n"
-            "                               (file descriptor %d).\n"
-            "  -p, --prefix=<prefix>      : Use <prefix> as escape prefix (default='%lc')\n"
-            "  -r, --repeat=<repeat>      : Repeat previous value <repeat> times.\n"
-            "  -s, --sleep=<delay>        : Sleep for <delay> amount of time.\n"
-            "  -t, --terminal             : Write subsequent strings directly to terminal.\n"
-            "  -u, --file-descriptor=<fd> : Write to specified file descriptor.\n"
-            "  -x, --exit=<num>           : Exit with value <num>.\n"
-            "\n",
-        PACKAGE_NAME,
-        STDERR_FILENO,
-        STDOUT_FILENO,
-        (wint_t)escape_prefix);
-
-    printf (
-            "Escape Characters:\n"
-            "\n"
-            "  'a'         - alert (bell)\n"
-            "  'b'         - backspace\n"
-            "  'c'         - no further output\n"
-            "  'e'         - escape character\n"
-            "  'f'         - form feed\n"
-            "  'g'         - generate pseudo-random printable character\n"
-            "  'n'         - newline\n"
-            "  'oNNN'      - 1-byte octal character (1-3 digits)\n"
-            "  'r'         - carriage return\n"
-            "  't'         - horizontal tab\n"
-            "  'uNNNN'     - 4-byte unicode/UTF-8 character (4 hex digits)\n"
-            "  'UNNNNNNNN' - 4-byte unicode/UTF-8 character (8 hex digits)\n"
-            "  'v'         - vertical tab\n"
-            "  'xNN'       - 1-byte hexadecimal character (1-2 digits)\n"
-            "\n"
-           );
-
-    printf (
-            "Extended Escape Characters:\n"
-            "\n"
-            "  '\\{N..N}'                 - Specify a range by two 1-chacter literal\n"
-            "                              characters.\n"
-            "  '\\{xNN..xNN}'             - Specify a range by two 2-digit hex values.\n"
-            "  '\\{oNNN..oNNN}'           - Specify a range by two 3-digit octal values.\n"
-            "  '\\{uNNNN..uNNNN}'         - Specify a range by two 4-digit unicode values.\n"
-            "  '\\{UNNNNNNNN..UNNNNNNNN}' - Specify a range by two 8-digit unicode values.\n"
-            "\n");
-
-    printf (
-            "Notes:\n"
-            "\n"
-            "  - Arguments are processed in order.\n"
-            "  - With the exception of '-x', arguments may be repeated any number of times.\n"
-            "  - If <str> is \"\", a nul byte will be displayed.\n"
-            "  - If <repeat> is '-1', repeat forever.\n"
-            "  - Replace the 'Z' in the range formats above with the appropriate characters.\n"
-            "  - Ranges can be either ascending or descending.\n"
-            "  - <delay> can take the following forms where <num> is a positive integer:\n"
-            "\n"
-            "      <num>ns : nano-seconds (1/1,000,000,000 second)\n"
-            "      <num>us : micro-seconds (1/1,000,000 second)\n"
-            "      <num>ms : milli-seconds (1/1,000 second)\n"
-            "      <num>cs : centi-seconds (1/100 second)\n"
-            "      <num>ds : deci-seconds (1/10 second)\n"
-            "      <num>s  : seconds\n"
-            "      <num>m  : minutes\n"
-            "      <num>h  : hours\n"
-            "      <num>d  : days\n"
-            "      <num>   : seconds\n"
-            "\n"
-            "    If <num> is -1, wait until any signal is received.\n"
-            "    if signal is SIGNUM continue, else exit immediately.\n"
-            "  - Generated printable random characters will not display\n"
-            "    unless you are using an appropriate font.\n"
-            "\n");
-}
-
+struct shaper {
+    const struct profile  *profile;
+    uint64_t               start;
+    uint64_t               tick;
+    double                 target;
+    uint64_t               emitted;
+    uint64_t               report_tick;
+    double                 report_target;
+    uint64_t               report_emitted;
+};
 
 /**
- * open_terminal:
+ * struct instruction:
  *
- * Open terminal device.
+ * @op: operation,
+ * @count: number of times to perform @op (-1 for no limit),
+ * @fd: file descriptor to display string on for OP_EMIT,
+ * @lexed: string to display for OP_EMIT,
+ * @delay: nano-seconds to pause for OP_SLEEP or between characters for
+ *  OP_EMIT (-1 to wait for a signal),
+ * @delayed: TRUE if OP_EMIT has an inter-character delay,
+ * @separator_specified: TRUE if OP_EMIT has a separator,
+ * @separator: separator for OP_EMIT,
+ * @block: instructions to run for OP_BLOCK,
+ * @status: exit status for OP_EXIT,
+ * @profile: profile the rate of repeats follows (or NULL).
  *
- * Returns: -1 on error, or fd associated with terminal.
+ * A single compiled argument (or '--begin' to '--end' block). All
+ * parsing is done when compiling, so running an instruction only
+ * produces output.
  **/
-int
-open_terminal (void)
-{
-    return open (_PATH_TTY, O_RDWR);
-}
+struct instruction {
+    enum op               op;
+    int                   count;
+    int                   fd;
+    struct lexed_string   lexed;
+    int64_t               delay;
+    int                   delayed;
+    int                   separator_specified;
+    int                   separator;
+    struct program       *block;
+    int                   status;
+    const struct profile *profile;
+};
 
 /**
- * handle_string:
- *
- * @fd: file descriptor to write output to,
- * @str: string to process,
- * @delay: inter-chracter delay,
- * @separator_specified: TRUE if a separator value has been specified,
- * @separator: separator to use.
+ * struct program:
  *
- * Process string @str and write results to @fd, delaying output by
- * @delay between each character emitted. Characters will be
- * interspersed by @separator if @separator_specified is set.
+ * @code: instructions,
+ * @count: number of entries in @code,
+ * @size: number of entries allocated for @code,
+ * @refs: number of references to the program,
+ * @parent: enclosing block while compiling.
  *
- * Note that @separator_specified is required since a null byte
- * separtor is valid.
+ * Instructions compiled from the arguments between '--begin' and
+ * '--end'.
  **/
-void
-handle_string (int          fd,
-        const char  *str,
-        const char  *delay,
-        int          separator_specified,
-        int          separator)
-{
-    wchar_t      c;
-    size_t       i;
-    ssize_t      ret;
+struct program {
+    struct instruction  *code;
+    size_t               count;
+    size_t               size;
+    int                  refs;
+    struct program      *parent;
+};
+
+/* last block that has been run (repeated by '-r' in preference to
+ * last_str if no string has been given since).
+ */
+struct program         *last_block = NULL;
 
-    /* number of characters consumed */
-    size_t       consumed = 0;
+/* innermost block being defined between '--begin' and '--end' */
+struct program         *open_block = NULL;
 
-    /* XXX: _number_ of wide characters, *NOT* length in bytes!! */
-    size_t       len;
+/* instruction compiled but not yet added to a block or run */
+struct instruction     *pending_insn = NULL;
 
-    wchar_t     *wstr = NULL;
-    const char  *p;
-    wchar_t     *wc;
+/* size of output buffer */
+#define OUTPUT_BUFSIZE    (64 * 1024)
 
-    /* If -1, not in escape mode, else set to the position in the string the
-     * escape char seen at.
-     */
-    int          escape = -1;
+/* worst case size of an output buffer once encoded: a BOM plus every
+ * byte becoming a UTF-32 code unit.
+ */
+#define ENCODED_BUFSIZE   (4 + (OUTPUT_BUFSIZE * 4))
 
-    /* special case nul string */
-    if (*str == '\0') {
-        OUT_WCHAR (fd, L'\0', delay);
-        return;
-    }
+/**
+ * struct output_buffer:
+ *
+ * @fd: file descriptor buffered data is destined for,
+ * @len: number of bytes in @data,
+ * @data: buffered output (OUTPUT_BUFSIZE bytes).
+ *
+ * Output is accumulated here and only written when the buffer fills,
+ * the output file descriptor changes or before sleeping and exiting.
+ * When '--pipeline' is used, @data is the pipeline slot currently
+ * being rendered into; after '--shm', it is the free space of the
+ * shared memory ring.
+ **/
+struct output_buffer {
+    int     fd;
+    size_t  len;
+    char   *data;
+};
 
-    /* convert multi-byte (UTF-8) string into wide
-     * character string for reasier internal handling.
-     */
-    len = mbsrtowcs (NULL, &str, 0, NULL);
+static char           output_data[OUTPUT_BUFSIZE];
 
-    if (len == (size_t)-1) {
-        fwprintf (stderr,
-                L"%ls: %ls\n",
-                L"ERROR",
-                L"failed to determine length of wide string");
-        exit (EXIT_FAILURE);
+struct output_buffer  output = { .fd = -1, .data = output_data };
+
+/* largest unfinished record kept in the output buffer; larger ones
+ * move to frame.record until they are complete.
+ */
+#define FRAME_MAX         (OUTPUT_BUFSIZE / 2)
+
+/* maximum number of magic bytes preceding a frame's length */
+#define FRAME_MAGIC_MAX   16
+
+/* maximum size of a frame's length: a 64-bit varint, or 20 digits and
+ * a colon.
+ */
+#define FRAME_LENGTH_MAX  21
+
+/* units of output framed as a record */
+#define FRAME_REPEAT      0
+#define FRAME_LINE        1
+
+/**
+ * enum frame_length:
+ *
+ * How the length of a framed record is written.
+ **/
+enum frame_length {
+    FRAME_FIXED,        /* @width bytes in the byte order given */
+    FRAME_VARINT,       /* unsigned LEB128 */
+    FRAME_NETSTRING     /* decimal digits and a colon, with a comma
+                         * following the record
+                         */
+};
+
+/**
+ * struct frame_format:
+ *
+ * @name: name of format,
+ * @length: how the length is written,
+ * @width: size of length in bytes for FRAME_FIXED (0 otherwise),
+ * @big_endian: TRUE if a FRAME_FIXED length is big-endian.
+ *
+ * Encoding of the length of a framed record.
+ **/
+struct frame_format {
+    const char         *name;
+    enum frame_length   length;
+    size_t              width;
+    int                 big_endian;
+};
+
+static const struct frame_format frame_formats[] = {
+    { "u16be",     FRAME_FIXED,     2, 1 },
+    { "u16le",     FRAME_FIXED,     2, 0 },
+    { "u32be",     FRAME_FIXED,     4, 1 },
+    { "u32le",     FRAME_FIXED,     4, 0 },
+    { "u64be",     FRAME_FIXED,     8, 1 },
+    { "u64le",     FRAME_FIXED,     8, 0 },
+    { "varint",    FRAME_VARINT,    0, 0 },
+    { "netstring", FRAME_NETSTRING, 0, 0 },
+
+    /* terminator */
+    { NULL, FRAME_FIXED, 0, 0 }
+};
+
+/**
+ * struct frame_state:
+ *
+ * @format: length format (NULL if output is not framed),
+ * @unit: FRAME_REPEAT to frame each display of a string, or FRAME_LINE
+ *  to frame each line (excluding its newline),
+ * @include: TRUE if the length includes the header,
+ * @magic: bytes preceding the length,
+ * @magic_len: number of bytes in @magic,
+ * @header: number of bytes reserved for the header,
+ * @open: TRUE if a record is being rendered,
+ * @start: offset in the output buffer of the open record's header
+ *  (or of the rest of its data once moved to @record),
+ * @record: header space and data of an open record too large to keep
+ *  in the output buffer,
+ * @record_len: number of bytes in @record (0 if the record is in the
+ *  output buffer),
+ * @record_size: number of bytes allocated for @record,
+ * @framed: lines framed by frame_lines(),
+ * @framed_size: number of bytes allocated for @framed,
+ * @partial: incomplete final line of output flushed so far,
+ * @partial_len: number of bytes in @partial,
+ * @partial_size: number of bytes allocated for @partial,
+ * @partial_fd: file descriptor @partial is destined for.
+ *
+ * Displays of strings are framed by reserving space for the header in
+ * the output buffer before rendering and writing the header in place
+ * afterwards. A record that outgrows the output buffer is moved to
+ * @record and written once complete. Lines are framed as output is
+ * flushed, since a header must be inserted between each line.
+ **/
+struct frame_state {
+    const struct frame_format  *format;
+    int                         unit;
+    int                         include;
+    unsigned char               magic[FRAME_MAGIC_MAX];
+    size_t                      magic_len;
+    size_t                      header;
+    int                         open;
+    size_t                      start;
+    char                       *record;
+    size_t                      record_len;
+    size_t                      record_size;
+    char                       *framed;
+    size_t                      framed_size;
+    char                       *partial;
+    size_t                      partial_len;
+    size_t                      partial_size;
+    int                         partial_fd;
+};
+
+struct frame_state    frame;
+
+/**
+ * struct encoding:
+ *
+ * @name: name of encoding,
+ * @unit: size of code unit in bytes (0 for the locale's encoding),
+ * @big_endian: TRUE if code units are big-endian.
+ *
+ * Output encoding.
+ **/
+struct encoding {
+    const char  *name;
+    int          unit;
+    int          big_endian;
+};
+
+static const struct encoding encodings[] = {
+    { "locale",   0, 0 },
+    { "utf-16le", 2, 0 },
+    { "utf-16be", 2, 1 },
+    { "utf-32le", 4, 0 },
+    { "utf-32be", 4, 1 },
+
+    /* terminator */
+    { NULL, 0, 0 }
+};
+
+/* encoding output is converted to when flushed */
+const struct encoding  *output_encoding = &encodings[0];
+
+/* TRUE if a byte order mark should be written to each file descriptor */
+int                     output_bom = 0;
+
+/* file descriptors a byte order mark has been written to */
+int                    *bom_fds = NULL;
+size_t                  bom_fd_count = 0;
+
+/* TRUE if the locale's encoding is UTF-8 */
+int                     locale_utf8 = 0;
+
+/**
+ * struct write_stats:
+ *
+ * @bytes: number of bytes written,
+ * @writes: number of successful calls to write(2),
+ * @partial: number of writes that did not consume all data offered,
+ * @stalls: number of times output blocked waiting for a reader,
+ * @stall_time: nano-seconds spent blocked waiting for a reader,
+ * @datagrams: number of datagrams sent.
+ *
+ * Statistics recorded by flush_output().
+ **/
+struct write_stats {
+    uint64_t  bytes;
+    uint64_t  writes;
+    uint64_t  partial;
+    uint64_t  stalls;
+    uint64_t  stall_time;
+    uint64_t  datagrams;
+};
+
+struct write_stats      write_stats;
+
+/* number of bits of sub-bucket precision in delay histogram
+ * (values are recorded to within 1/2^DELAY_SUB_BITS).
+ */
+#define DELAY_SUB_BITS    5
+
+#define DELAY_SUB_BUCKETS (1 << DELAY_SUB_BITS)
+
+/* enough buckets for any 64-bit value */
+#define DELAY_BUCKETS     ((64 - DELAY_SUB_BITS + 1) * DELAY_SUB_BUCKETS)
+
+/**
+ * struct delay_stats:
+ *
+ * @count: number of delays recorded,
+ * @max: largest overshoot recorded,
+ * @buckets: log-linear histogram of overshoots.
+ *
+ * Histogram of the number of nano-seconds by which each delay in
+ * sleep_for() exceeded the time requested. Values are bucketed by
+ * power of 2, with each power of 2 divided linearly into
+ * DELAY_SUB_BUCKETS, so memory use is fixed and the relative error of
+ * any reported value is bounded.
+ **/
+struct delay_stats {
+    uint64_t  count;
+    uint64_t  max;
+    uint64_t  buckets[DELAY_BUCKETS];
+};
+
+struct delay_stats      delay_stats;
+
+/**
+ * enum stats_format:
+ *
+ * Format of statistics displayed on exit.
+ **/
+enum stats_format {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON,
+};
+
+enum stats_format       stats_format = STATS_NONE;
+
+/**
+ * struct fd_checksum:
+ *
+ * @fd: file descriptor,
+ * @sum: checksum of data written to @fd.
+ **/
+struct fd_checksum {
+    int              fd;
+    struct checksum  sum;
+};
+
+/* algorithm used to checksum output */
+enum checksum_type      checksum_type = CHECKSUM_NONE;
+
+/* file descriptor checksums are displayed on at exit */
+int                     checksum_fd = STDERR_FILENO;
+
+/* checksums of each file descriptor written to */
+struct fd_checksum     *checksums = NULL;
+size_t                  checksum_count = 0;
+
+/**
+ * struct random_state:
+ *
+ * @seeded: TRUE if @seed has been set,
+ * @seed: key for random number generator,
+ * @emission: number of strings displayed so far,
+ * @draw: number of values drawn while displaying the current string,
+ * @cache: unused half of the last block generated.
+ *
+ * State of the counter-based random number generator. Each value is
+ * a pure function of @seed, @emission and @draw, so the random content
+ * of any repeat of a string can be generated without generating the
+ * repeats preceding it.
+ **/
+struct random_state {
+    int       seeded;
+    uint64_t  seed;
+    uint64_t  emission;
+    uint64_t  draw;
+    uint64_t  cache;
+};
+
+struct random_state     random_state;
+
+/**
+ * struct output_window:
+ *
+ * @start: offset of first byte of output to write,
+ * @end: offset following last byte of output to write (0 for no limit),
+ * @offset: offset of the first byte in the output buffer.
+ *
+ * Range of output bytes that will actually be written; output outside
+ * the window is generated but discarded.
+ **/
+struct output_window {
+    uint64_t  start;
+    uint64_t  end;
+    uint64_t  offset;
+};
+
+struct output_window    window;
+
+/* number of displays of strings still to be skipped ('--skip-repeats') */
+uint64_t                skip_repeats = 0;
+
+/* pseudo file descriptor used to write to the shards */
+#define SHARD_FD          (-2)
+
+/* size of the buffer for each shard */
+#define SHARD_BUFSIZE     (1024 * 1024)
+
+/**
+ * enum shard_unit:
+ *
+ * Unit of output assigned to a single shard.
+ **/
+enum shard_unit {
+    SHARD_REPEAT,       /* each display of a string */
+    SHARD_LINE,         /* each line */
+    SHARD_CHUNK,        /* fixed number of bytes */
+};
+
+/**
+ * struct shard:
+ *
+ * @fd: file descriptor to write to,
+ * @flags: original file status flags of @fd,
+ * @nonblock: TRUE if O_NONBLOCK was set on @fd by utfout,
+ * @data: buffered output,
+ * @start: offset of first unwritten byte in @data,
+ * @len: number of unwritten bytes in @data.
+ *
+ * One of a set of file descriptors output is split between.
+ **/
+struct shard {
+    int       fd;
+    int       flags;
+    int       nonblock;
+    char     *data;
+    size_t    start;
+    size_t    len;
+};
+
+/**
+ * struct shard_set:
+ *
+ * @shards: array of shards,
+ * @count: number of entries in @shards,
+ * @unit: unit of output assigned to each shard,
+ * @chunk: number of bytes in a SHARD_CHUNK,
+ * @hash: TRUE if units are placed by hash of their contents rather
+ *  than round-robin,
+ * @current: shard receiving the current unit (round-robin),
+ * @filled: number of bytes of the current unit seen so far,
+ * @record: current unit (hash placement),
+ * @record_len: number of bytes in @record,
+ * @record_size: number of bytes allocated for @record,
+ * @pfds: space to poll each shard.
+ *
+ * Output written to SHARD_FD is split into units, each of which is
+ * written to one of @shards. Every shard has its own buffer so that
+ * data already generated continues to flow to fast readers while
+ * utfout waits for a slow one.
+ **/
+struct shard_set {
+    struct shard     *shards;
+    size_t            count;
+    enum shard_unit   unit;
+    size_t            chunk;
+    int               hash;
+    size_t            current;
+    size_t            filled;
+    char             *record;
+    size_t            record_len;
+    size_t            record_size;
+    struct pollfd    *pfds;
+};
+
+struct shard_set        shards;
+
+/* space for datagrams waiting to be sent */
+#define DATAGRAM_BUFSIZE      (1024 * 1024)
+
+/* default and maximum number of datagrams sent by a single call */
+#define DATAGRAM_BATCH        256
+#define DATAGRAM_MAX_BATCH    1024
+
+/* limits on the datagrams combined using UDP generic segmentation
+ * offload: number of segments and total payload.
+ */
+#define DATAGRAM_GSO_SEGMENTS 64
+#define DATAGRAM_GSO_BYTES    65507
+
+/**
+ * enum datagram_unit:
+ *
+ * Unit of output sent as a single datagram.
+ **/
+enum datagram_unit {
+    DATAGRAM_REPEAT,    /* each display of a string */
+    DATAGRAM_LINE,      /* each line (excluding the newline) */
+};
+
+/**
+ * struct datagram_state:
+ *
+ * @unit: unit of output sent as each datagram,
+ * @batch: maximum number of datagrams to send at once,
+ * @gso: TRUE if equal-sized datagrams should be combined using
+ *  UDP_SEGMENT,
+ * @fd: file descriptor @data is destined for,
+ * @udp: TRUE if @fd is a UDP socket,
+ * @data: datagrams waiting to be sent,
+ * @len: number of bytes in @data,
+ * @start: offset in @data of the datagram currently being built,
+ * @iov: complete datagrams in @data,
+ * @count: number of entries in @iov,
+ * @checked_fd: file descriptor last checked by datagram_socket(),
+ * @checked: TRUE if @checked_fd is a datagram socket.
+ *
+ * Datagram sockets are written to a message at a time: output is
+ * split into units, each sent as one datagram, in batches.
+ **/
+struct datagram_state {
+    enum datagram_unit   unit;
+    size_t               batch;
+    int                  gso;
+    int                  fd;
+    int                  udp;
+    char                *data;
+    size_t               len;
+    size_t               start;
+    struct iovec        *iov;
+    size_t               count;
+    int                  checked_fd;
+    int                  checked;
+};
+
+struct datagram_state   datagrams = {
+    .batch = DATAGRAM_BATCH,
+    .fd = -1,
+    .checked_fd = -1,
+};
+
+/* default size of each write to a file */
+#define FILE_BLOCK            (1024 * 1024)
+
+/* default alignment of writes to a file */
+#define FILE_ALIGN            4096
+
+/**
+ * struct file_options:
+ *
+ * @direct: TRUE to bypass the page cache (O_DIRECT),
+ * @dsync: TRUE to wait for each write to reach the device (O_DSYNC),
+ * @nocache: TRUE to write back and drop cached data as it is written,
+ * @sync: TRUE to flush the file to the device before exiting,
+ * @pad: TRUE to leave the file padded with zeros to a multiple of
+ *  @align bytes, rather than truncating it to the length of the output,
+ * @block: number of bytes written by each call to write(2),
+ * @align: alignment of the memory, offset and length of each write.
+ *
+ * Options for files opened by '--file'.
+ **/
+struct file_options {
+    int     direct;
+    int     dsync;
+    int     nocache;
+    int     sync;
+    int     pad;
+    size_t  block;
+    size_t  align;
+};
+
+struct file_options     file_options = {
+    .block = FILE_BLOCK,
+    .align = FILE_ALIGN,
+};
+
+/**
+ * struct file_target:
+ *
+ * @fd: file descriptor,
+ * @path: path of file,
+ * @options: options file was opened with,
+ * @data: buffer of @options.block bytes, aligned to @options.align,
+ * @len: number of bytes in @data,
+ * @offset: number of bytes written to the file,
+ * @cached: offset of data written but not yet dropped from the page
+ *  cache (@options.nocache),
+ * @next: next file.
+ *
+ * File opened by '--file'. Output is written a block at a time so
+ * that every write has the size and alignment the device expects.
+ **/
+struct file_target {
+    int                   fd;
+    char                 *path;
+    struct file_options   options;
+    char                 *data;
+    size_t                len;
+    uint64_t              offset;
+    uint64_t              cached;
+    struct file_target   *next;
+};
+
+/* files opened by '--file' */
+struct file_target     *files = NULL;
+
+/* default and maximum number of buffers in the pipeline */
+#define PIPELINE_SLOTS      8
+#define PIPELINE_MAX_SLOTS  64
+
+/**
+ * struct pipeline_slot:
+ *
+ * @fd: file descriptor to write to,
+ * @data: buffer output is rendered into,
+ * @encoded: buffer for transcoded output (allocated on first use),
+ * @p: data to write (either in @data or @encoded),
+ * @len: number of bytes at @p.
+ *
+ * A buffer passed from the rendering thread to the writer thread.
+ **/
+struct pipeline_slot {
+    int          fd;
+    char        *data;
+    char        *encoded;
+    const char  *p;
+    size_t       len;
+};
+
+/**
+ * struct pipeline:
+ *
+ * @slots: ring of buffers,
+ * @count: number of @slots (0 if the pipeline is not in use),
+ * @head: slot being rendered into (only used by the rendering thread),
+ * @tail: next slot to write (only used by the writer thread),
+ * @free: number of slots the rendering thread may fill,
+ * @filled: number of slots ready for the writer thread,
+ * @error: errno value of a failed write (0 if none),
+ * @error_fd: file descriptor a write failed for,
+ * @thread: writer thread.
+ *
+ * Single-producer, single-consumer ring connecting the rendering
+ * thread to the writer thread. Slots are filled and written strictly
+ * in order, so output is identical to unthreaded output. Each slot is
+ * owned by exactly one thread at a time; the semaphores hand them
+ * over (without a system call unless a thread must wait).
+ **/
+struct pipeline {
+    struct pipeline_slot  *slots;
+    int                    count;
+    int                    head;
+    int                    tail;
+#ifdef HAVE_PIPELINE
+    sem_t                  free;
+    sem_t                  filled;
+    pthread_t              thread;
+#endif
+    int                    error;
+    int                    error_fd;
+};
+
+struct pipeline         pipeline;
+
+/* default size of the data of a shared memory ring */
+#define SHM_SIZE          (4 * 1024 * 1024)
+
+/**
+ * struct shm_target:
+ *
+ * @fd: file descriptor of shared memory object,
+ * @ring: header of ring (NULL if '--shm' is not in use),
+ * @data: data of ring, mapped twice in succession,
+ * @size: size of @data (a power of 2),
+ * @head: number of bytes written to the ring.
+ *
+ * Shared memory ring created by '--shm' (see shmring.h). Output for
+ * @fd is rendered directly into the free space of the ring and made
+ * visible to the consumer by advancing the head, so it is never
+ * copied unless it has been transformed (transcoded, framed by line or
+ * windowed) after rendering.
+ **/
+struct shm_target {
+    int               fd;
+    struct shm_ring  *ring;
+    char             *data;
+    uint64_t          size;
+    uint64_t          head;
+};
+
+struct shm_target       shm = { .fd = -1 };
+
+/* resolution of the stream timer wheel in nano-seconds */
+#define WHEEL_TICK        1000000
+
+/* number of slots in the stream timer wheel (must be a power of 2) */
+#define WHEEL_SLOTS       512
+
+/* maximum number of times a stream that has fallen behind schedule
+ * is displayed before other streams are serviced.
+ */
+#define STREAM_MAX_BURST  1024
+
+/**
+ * struct stream:
+ *
+ * @id: position of stream on command-line,
+ * @fd: file descriptor to write to,
+ * @interval: nano-seconds between displays,
+ * @repeat: number of displays remaining (-1 for no limit),
+ * @due: CLOCK_MONOTONIC time of next display in nano-seconds,
+ * @separator_specified: TRUE if @separator should be used,
+ * @separator: separator to use,
+ * @lexed: string to display,
+ * @next: next stream in the same timer wheel slot.
+ *
+ * A string displayed repeatedly at a fixed interval, concurrently
+ * with the other streams in its group.
+ **/
+struct stream {
+    size_t               id;
+    int                  fd;
+    uint64_t             interval;
+    long                 repeat;
+    uint64_t             due;
+    int                  separator_specified;
+    int                  separator;
+    struct lexed_string  lexed;
+    struct stream       *next;
+};
+
+/**
+ * struct timer_wheel:
+ *
+ * @slots: lists of streams, hashed by the tick they are next due,
+ * @tick: earliest tick that may still have streams due,
+ * @count: number of streams in @slots.
+ *
+ * Hashed timer wheel used to schedule streams. Streams due more than
+ * WHEEL_SLOTS ticks in the future simply remain in their slot for
+ * further revolutions of the wheel.
+ **/
+struct timer_wheel {
+    struct stream  *slots[WHEEL_SLOTS];
+    uint64_t        tick;
+    size_t          count;
+};
+
+/* group of consecutive streams waiting to be run */
+struct stream         **streams = NULL;
+size_t                  stream_count = 0;
+
+/* event loop and timer of the group being run (-1 if none) */
+int                     stream_epoll_fd = -1;
+int                     stream_timer_fd = -1;
+
+/* longest list of comma-separated options given to an option */
+#define OPTIONS_MAX       256
+
+/* prototypes */
+void      usage                    (void);
+int       utfout_atexit            (void (*handler) (void));
+void      utfout_exit              (int status) __attribute__ ((noreturn));
+int       open_terminal            (void);
+void      run_term_bench           (const char *spec);
+void      compile_string           (struct instruction *insn, int fd,
+                                    const char *str, int count,
+                                    const int64_t *delay,
+                                    int separator_specified, int separator);
+void      prerender_string         (struct lexed_string *lexed,
+                                    int separator_specified, int separator);
+void      add_instruction          (struct program *block,
+                                    struct instruction *insn);
+void      run_instruction          (const struct instruction *insn);
+void      run_program              (const struct program *program);
+void      free_instruction         (struct instruction *insn);
+void      release_program          (struct program *program);
+void      signal_handler           (int signum);
+int       parse_delay              (const char *str, uint64_t *ns);
+void      sleep_for                (int64_t requested);
+struct profile *parse_profile      (const char *spec);
+void      start_shaper             (struct shaper *shaper,
+                                    const struct profile *profile);
+int       shape_next               (struct shaper *shaper);
+void      wait_for_intr            (void);
+void      lex_string               (const char *str, struct lexed_string *lexed);
+size_t    lex_range                (const wchar_t *range, size_t len,
+                                    wchar_t *start, wchar_t *end,
+                                    size_t *error);
+size_t    lex_sequence             (const wchar_t *range, size_t len,
+                                    struct sequence *seq, size_t *error);
+void      emit_tokens              (int fd, const struct lexed_string *lexed,
+                                    const int64_t *delay,
+                                    int separator_specified, int separator);
+void      emit_sequence            (int fd, const struct sequence *seq,
+                                    const int64_t *delay,
+                                    int separator_specified, int separator);
+size_t    lex_time                 (const wchar_t *str, size_t len,
+                                    int elapsed, struct time_format *tf,
+                                    size_t *error);
+void      emit_time                (int fd, struct time_format *tf);
+void      free_time_format         (struct time_format *tf);
+size_t    lex_word                 (const wchar_t *str, size_t len,
+                                    struct word_source *ws, size_t *error);
+struct corpus *load_corpus         (const char *path);
+void      emit_word                (int fd, struct word_source *ws);
+size_t    lex_malformed            (const wchar_t *str, size_t len,
+                                    struct malformed *m, size_t *error);
+void      emit_malformed           (int fd, const struct malformed *m);
+size_t    lex_compressible         (const wchar_t *str, size_t len,
+                                    struct compressible *z, size_t *error);
+void      emit_compressible        (int fd, const struct compressible *z);
+size_t    lex_bytes                (const wchar_t *str, size_t len, char *out,
+                                    size_t *n, size_t *error);
+void      free_lexed_string        (struct lexed_string *lexed);
+void      add_stream               (const char *spec, int separator_specified,
+                                    int separator);
+void      run_streams              (void);
+void      free_streams             (void);
+void      flush_output             (void);
+void      finish_output            (void);
+void      flush_targets            (int final);
+void      add_shards               (const char *spec);
+void      shard_output             (const char *data, size_t len);
+void      shard_record_end         (void);
+void      flush_shards             (int final);
+void      parse_datagram_spec      (const char *spec);
+int       datagram_socket          (int fd);
+void      datagram_output          (int fd, const char *data, size_t len);
+void      datagram_end             (int fd);
+void      flush_datagrams          (int final);
+void      parse_file_options       (const char *spec);
+int       open_file                (const char *path);
+struct file_target *file_target    (int fd);
+void      file_output              (struct file_target *file,
+                                    const char *data, size_t len);
+void      flush_files              (int final);
+void      start_pipeline           (const char *arg);
+void      drain_pipeline           (void);
+int       open_shm                 (const char *spec);
+void      wait_for_output          (int fd);
+void      display_stats            (void);
+void      checksum_output          (int fd, const char *data, size_t len);
+void      display_checksums        (void);
+void      record_delay             (uint64_t requested, uint64_t actual);
+size_t    transcode_output         (const char *in, size_t len, char *out);
+const char *encode_output          (int fd, const char *data, size_t *len);
+char     *reserve_output           (int fd, size_t len);
+void      write_output             (int fd, const char *data, size_t len);
+void      parse_frame_spec         (const char *spec);
+void      frame_begin              (int fd);
+void      frame_end                (int fd);
+void      frame_spill              (const char *data, size_t len);
+const char *frame_lines            (int fd, const char *data, size_t *len,
+                                    int final);
+void      flush_frames             (void);
+int       simple_escape_to_literal (int value);
+wchar_t   get_random_char          (void);
+uint64_t  get_random_u64           (void);
+uint64_t  parse_size               (const char *str);
+void      copy_options             (char *copy, const char *spec,
+                                    const char *what);
+int       lexed_fixed_length       (const struct lexed_string *lexed);
+
+/**
+ * digit_value:
+ *
+ * @wc: wide character to check,
+ * @flags: CLASS_* value @wc must belong to.
+ *
+ * Returns: numeric value of @wc, or -1 if @wc is not in class @flags.
+ **/
+static inline int
+digit_value (wchar_t wc, unsigned char flags)
+{
+    if ((unsigned int)wc >= 128 || ! (char_table[wc].flags & flags))
+        return -1;
+
+    return char_table[wc].value;
+}
+
+/**
+ * get_escape_spec:
+ *
+ * @wc: character following escape prefix.
+ *
+ * Returns: escape specification for @wc.
+ **/
+static inline const struct escape_spec *
+get_escape_spec (wchar_t wc)
+{
+    return &escape_table[(unsigned int)wc < 128 ? wc : 0];
+}
+
+/**
+ * die:
+ *
+ * @fmt: printf-style format and arguments.
+ *
+ * Display formatted string and exit.
+ **/
+void
+die (const char *fmt, ...)
+{
+    char     tag[] = "ERROR: ";
+    va_list  ap;
+    char     buffer[BUFSIZ];
+    wchar_t  wbuffer[BUFSIZ];
+    char    *p;
+    size_t   len;
+    size_t   wlen;
+    int      ret;
+
+    len = sizeof (buffer);
+
+    buffer[len-1] = '\0';
+
+    p = buffer;
+
+    va_start (ap, fmt);
+
+    ret = snprintf (p, len, "%s", tag);
+    if (ret < 0)
+        goto error;
+
+    p += ret;
+
+    ret = vsnprintf (p, len-ret, fmt, ap);
+    if (ret < 0)
+        goto error;
+
+    va_end (ap);
+
+    p += ret;
+
+    ret = snprintf (p, len, "\n");
+    if (ret < 0)
+        goto error;
+
+    p += ret;
+
+    /* check for buffer overflow */
+    assert (buffer[len-1] == '\0');
+
+#ifdef UTFOUT_BUILTIN
+    /* the shell's streams must not become wide-oriented */
+    if (fputs (buffer, stderr) < 0)
+        goto error;
+
+    utfout_exit (EXIT_FAILURE);
+#endif
+
+    /* convert MBS to wide-character string */
+    p = buffer;
+    errno = 0;
+    wlen = mbsnrtowcs (wbuffer, (const char **)&p, len, BUFSIZ, NULL);
+    if (wlen == (size_t)-1 && errno == EILSEQ)
+        goto error;
+
+    ret = fputws (wbuffer, stderr);
+
+    if (ret < 0)
+        goto error;
+
+    utfout_exit (EXIT_FAILURE);
+
+error:
+#ifdef UTFOUT_BUILTIN
+    fputs ("ERROR: failed to format error string\n", stderr);
+#else
+    fwprintf (stderr, L"ERROR: failed to format error string\n");
+#endif
+    utfout_exit (EXIT_FAILURE);
+}
+
+/**
+ * monotonic_ns:
+ *
+ * Returns: current CLOCK_MONOTONIC time in nano-seconds.
+ **/
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec  ts;
+
+    if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+        die ("failed to read clock");
+
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * write_fd:
+ *
+ * @fd: file descriptor,
+ * @data: data to write,
+ * @len: length of @data.
+ *
+ * Write all of @data to @fd, waiting for a non-blocking reader to
+ * catch up if necessary.
+ *
+ * Returns: 0 on success, or -1 with errno set on failure.
+ **/
+static int
+write_fd (int fd, const char *data, size_t len)
+{
+    ssize_t  ret;
+
+    while (len) {
+        ret = write (fd, data, len);
+
+        DTRACE_PROBE3 (utfout, write, fd, len, ret);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* non-blocking reader has fallen behind */
+                wait_for_output (fd);
+                continue;
+            }
+
+            return -1;
+        }
+
+        write_stats.writes++;
+        write_stats.bytes += (uint64_t)ret;
+
+        if ((size_t)ret < len)
+            write_stats.partial++;
+
+        data += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_PIPELINE
+
+/**
+ * pipeline_failed:
+ *
+ * Report a write failure of the writer thread.
+ **/
+static void
+pipeline_failed (void)
+{
+    die ("failed to write output to file descriptor %d", pipeline.error_fd);
+}
+
+/**
+ * pipeline_wait:
+ *
+ * @sem: semaphore.
+ *
+ * Decrement @sem, waiting until that is possible.
+ **/
+static void
+pipeline_wait (sem_t *sem)
+{
+    while (sem_wait (sem) < 0) {
+        if (errno != EINTR)
+            die ("failed to wait for pipeline");
+    }
+}
+
+/**
+ * pipeline_writer:
+ *
+ * @arg: unused.
+ *
+ * Writer thread: write filled slots in order, returning each to the
+ * rendering thread once written.
+ *
+ * Returns: never.
+ **/
+static void *
+pipeline_writer (void *arg)
+{
+    struct pipeline_slot  *slot;
+
+    (void)arg;
+
+    for (;;) {
+        pipeline_wait (&pipeline.filled);
+
+        slot = &pipeline.slots[pipeline.tail];
+        pipeline.tail = (pipeline.tail + 1) % pipeline.count;
+
+        /* after a failure, discard output until the rendering thread
+         * notices and exits.
+         */
+        if (! pipeline.error && write_fd (slot->fd, slot->p, slot->len) < 0) {
+            pipeline.error_fd = slot->fd;
+            pipeline.error = errno ? errno : EIO;
+        }
+
+        if (sem_post (&pipeline.free) < 0)
+            die ("failed to release pipeline buffer");
+    }
+
+    return NULL;
+}
+
+/**
+ * start_pipeline:
+ *
+ * @arg: number of buffers to use, or NULL for the default.
+ *
+ * Start a writer thread so that subsequent output is written
+ * concurrently with rendering.
+ **/
+void
+start_pipeline (const char *arg)
+{
+    sigset_t  mask;
+    sigset_t  saved;
+    long      count = PIPELINE_SLOTS;
+    char     *end;
+    int       i;
+
+    if (arg) {
+        errno = 0;
+        count = strtol (arg, &end, 10);
+        if (errno || *end || count < 2 || count > PIPELINE_MAX_SLOTS)
+            die ("invalid pipeline size '%s' (2-%d)", arg,
+                    PIPELINE_MAX_SLOTS);
+    }
+
+    if (pipeline.count)
+        die ("pipeline already started");
+
+    flush_output ();
+
+    pipeline.slots = calloc ((size_t)count, sizeof (struct pipeline_slot));
+    if (! pipeline.slots)
+        die ("failed to allocate space for pipeline");
+
+    for (i = 0; i < count; i++) {
+        pipeline.slots[i].data = malloc (OUTPUT_BUFSIZE);
+        if (! pipeline.slots[i].data)
+            die ("failed to allocate space for pipeline");
+    }
+
+    /* the first slot is being rendered into */
+    if (sem_init (&pipeline.free, 0, (unsigned int)count - 1) < 0
+            || sem_init (&pipeline.filled, 0, 0) < 0)
+        die ("failed to initialise pipeline");
+
+    pipeline.count = (int)count;
+    output.data = pipeline.slots[0].data;
+
+    /* signals are handled by the rendering thread, except SIGPIPE
+     * which must still terminate the process when a reader exits.
+     */
+    sigfillset (&mask);
+    sigdelset (&mask, SIGPIPE);
+
+    pthread_sigmask (SIG_SETMASK, &mask, &saved);
+
+    if (pthread_create (&pipeline.thread, NULL, pipeline_writer, NULL))
+        die ("failed to start writer thread");
+
+    pthread_sigmask (SIG_SETMASK, &saved, NULL);
+}
+
+/**
+ * pipeline_submit:
+ *
+ * @fd: file descriptor to write to,
+ * @data: encoded data (either in the current slot or a static buffer),
+ * @len: length of @data.
+ *
+ * Pass the current slot to the writer thread and start rendering into
+ * the next one, waiting for it to be written if the ring is full.
+ **/
+static void
+pipeline_submit (int fd, const char *data, size_t len)
+{
+    struct pipeline_slot  *slot = &pipeline.slots[pipeline.head];
+
+    if (data < slot->data || data >= slot->data + OUTPUT_BUFSIZE) {
+        if (! slot->encoded) {
+            slot->encoded = malloc (ENCODED_BUFSIZE);
+            if (! slot->encoded)
+                die ("failed to allocate space for pipeline");
+        }
+
+        memcpy (slot->encoded, data, len);
+        data = slot->encoded;
+    }
+
+    slot->fd = fd;
+    slot->p = data;
+    slot->len = len;
+
+    pipeline.head = (pipeline.head + 1) % pipeline.count;
+
+    if (sem_post (&pipeline.filled) < 0)
+        die ("failed to pass buffer to writer thread");
+
+    pipeline_wait (&pipeline.free);
+
+    if (pipeline.error)
+        pipeline_failed ();
+
+    output.data = pipeline.slots[pipeline.head].data;
+}
+
+/**
+ * drain_pipeline:
+ *
+ * Wait for the writer thread to write all output passed to it.
+ **/
+void
+drain_pipeline (void)
+{
+    int  i;
+
+    if (! pipeline.count)
+        return;
+
+    /* every slot but the one being rendered into is then free */
+    for (i = 1; i < pipeline.count; i++)
+        pipeline_wait (&pipeline.free);
+
+    for (i = 1; i < pipeline.count; i++) {
+        if (sem_post (&pipeline.free) < 0)
+            die ("failed to release pipeline buffer");
+    }
+
+    if (pipeline.error)
+        pipeline_failed ();
+}
+
+#else /* ! HAVE_PIPELINE */
+
+void
+start_pipeline (const char *arg)
+{
+    (void)arg;
+
+    die ("pipeline not supported on this platform");
+}
+
+static void
+pipeline_submit (int fd, const char *data, size_t len)
+{
+    (void)fd;
+    (void)data;
+    (void)len;
+}
+
+void
+drain_pipeline (void)
+{
+}
+
+#endif /* HAVE_PIPELINE */
+
+#ifdef HAVE_SHM_RING
+
+/**
+ * shm_wait:
+ *
+ * @len: number of bytes required.
+ *
+ * Wait until the consumer has left @len bytes of the ring free.
+ **/
+static void
+shm_wait (uint64_t len)
+{
+    struct shm_ring  *ring = shm.ring;
+    uint32_t          seq;
+
+    while (shm.size - (shm.head
+                - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE)) < len) {
+        seq = __atomic_load_n (&ring->tail_seq, __ATOMIC_ACQUIRE);
+
+        __atomic_store_n (&ring->writer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+        /* the consumer only wakes the writer if it sees the flag */
+        if (shm.size - (shm.head
+                    - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE)) < len)
+            shm_ring_wait (&ring->tail_seq, seq);
+
+        __atomic_store_n (&ring->writer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * shm_reserve:
+ *
+ * Returns: free space of OUTPUT_BUFSIZE bytes at the head of the ring,
+ * waiting for the consumer to make it available if necessary.
+ **/
+static char *
+shm_reserve (void)
+{
+    shm_wait (OUTPUT_BUFSIZE);
+
+    return shm.data + (shm.head & (shm.size - 1));
+}
+
+/**
+ * shm_publish:
+ *
+ * @len: number of bytes written at the head of the ring.
+ *
+ * Make @len bytes available to the consumer.
+ **/
+static void
+shm_publish (size_t len)
+{
+    struct shm_ring  *ring = shm.ring;
+
+    shm.head += len;
+
+    __atomic_store_n (&ring->head, shm.head, __ATOMIC_RELEASE);
+    __atomic_fetch_add (&ring->head_seq, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n (&ring->reader_waiting, __ATOMIC_RELAXED))
+        shm_ring_wake (&ring->head_seq);
+
+    write_stats.writes++;
+    write_stats.bytes += len;
+}
+
+/**
+ * close_shm:
+ *
+ * Tell the consumer that no more output will be written.
+ **/
+static void
+close_shm (void)
+{
+    struct shm_ring  *ring = shm.ring;
+
+    if (! ring)
+        return;
+
+    __atomic_store_n (&ring->closed, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add (&ring->head_seq, 1, __ATOMIC_RELEASE);
+
+    shm_ring_wake (&ring->head_seq);
+}
+
+/**
+ * open_shm:
+ *
+ * @spec: name of shared memory object, optionally followed by
+ * ',size=SIZE'.
+ *
+ * Create a shared memory ring for subsequent output, replacing any
+ * existing object of the same name.
+ *
+ * Returns: file descriptor identifying the ring.
+ **/
+int
+open_shm (const char *spec)
+{
+    struct shm_ring  *ring;
+    uint64_t          size = SHM_SIZE;
+    long              page = sysconf (_SC_PAGESIZE);
+    char              copy[OPTIONS_MAX];
+    char             *name;
+    char             *field;
+    char             *saveptr = NULL;
+    int               fd;
+
+    assert (spec);
+
+    if (shm.ring)
+        die ("shared memory ring already created");
+
+    copy_options (copy, spec, "shared memory spec");
+
+    name = strtok_r (copy, ",", &saveptr);
+    if (! name)
+        die ("invalid shared memory spec '%s'", spec);
+
+    while ((field = strtok_r (NULL, ",", &saveptr))) {
+        if (! strncmp (field, "size=", 5))
+            size = parse_size (field + 5);
+        else
+            die ("invalid shared memory option '%s'", field);
+    }
+
+    if (page < (long)sizeof (struct shm_ring))
+        page = 4096;
+
+    if (size < 2 * OUTPUT_BUFSIZE || (size & (size - 1))
+            || size % (uint64_t)page)
+        die ("shared memory ring size must be a power of 2 of at least %dK",
+                2 * OUTPUT_BUFSIZE / 1024);
+
+    /* earlier output is not part of the ring */
+    flush_output ();
+
+    /* a consumer waiting for the name only ever sees a new ring */
+    if (shm_unlink (name) < 0 && errno != ENOENT)
+        die ("failed to remove shared memory '%s'", name);
+
+    fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+        die ("failed to create shared memory '%s'", name);
+
+    if (ftruncate (fd, (off_t)(page + size)) < 0)
+        die ("failed to size shared memory '%s'", name);
+
+    ring = mmap (NULL, (size_t)page, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    if (ring == MAP_FAILED)
+        die ("failed to map shared memory '%s'", name);
+
+    shm.data = shm_ring_map (fd, (uint64_t)page, size);
+    if (! shm.data)
+        die ("failed to map shared memory '%s'", name);
+
+    ring->version = SHM_RING_VERSION;
+    ring->size = size;
+    ring->data = (uint64_t)page;
+
+    /* the ring is ready for consumers */
+    __atomic_store_n (&ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    shm.fd = fd;
+    shm.ring = ring;
+    shm.size = size;
+    shm.head = 0;
+
+    if (utfout_atexit (close_shm))
+        die ("failed to register exit handler");
+
+    /* render straight into the ring (the pipeline copies from its
+     * own buffers instead).
+     */
+    if (! pipeline.count)
+        output.data = shm_reserve ();
+
+    return fd;
+}
+
+/**
+ * shm_output:
+ *
+ * @data: data written to the file descriptor of the ring,
+ * @len: length of @data (at most OUTPUT_BUFSIZE).
+ *
+ * Encode @data and publish it to the consumer of the ring. Data that
+ * was rendered at the head of the ring and left as is has already
+ * been written and is published without being copied.
+ **/
+static void
+shm_output (const char *data, size_t len)
+{
+    char    *p;
+    size_t   n;
+
+    data = encode_output (shm.fd, data, &len);
+
+    while (len) {
+        p = shm.data + (shm.head & (shm.size - 1));
+        n = len < OUTPUT_BUFSIZE ? len : OUTPUT_BUFSIZE;
+
+        if (data != p) {
+            shm_wait (n);
+
+            /* windowed data may overlap the head */
+            memmove (p, data, n);
+        }
+
+        shm_publish (n);
+
+        data += n;
+        len -= n;
+    }
+
+    if (! pipeline.count)
+        output.data = shm_reserve ();
+}
+
+#else /* ! HAVE_SHM_RING */
+
+int
+open_shm (const char *spec)
+{
+    (void)spec;
+
+    die ("shared memory output not supported on this platform");
+
+    return -1;
+}
+
+static void
+shm_output (const char *data, size_t len)
+{
+    (void)data;
+    (void)len;
+}
+
+#endif /* HAVE_SHM_RING */
+
+/**
+ * dispatch_output:
+ *
+ * @fd: file descriptor,
+ * @data: data to write,
+ * @len: length of @data (at most OUTPUT_BUFSIZE).
+ *
+ * Pass @data on to the target for @fd.
+ **/
+static void
+dispatch_output (int fd, const char *data, size_t len)
+{
+    struct file_target  *file;
+
+    /* targets with their own buffering are written by this thread
+     * once earlier pipelined output has been written.
+     */
+    if (fd == SHARD_FD) {
+        drain_pipeline ();
+        shard_output (data, len);
+        len = 0;
+    } else if (len && (file = file_target (fd))) {
+        drain_pipeline ();
+        file_output (file, data, len);
+        len = 0;
+    } else if (len && datagram_socket (fd)) {
+        drain_pipeline ();
+        datagram_output (fd, data, len);
+        len = 0;
+    } else if (len && shm.ring && fd == shm.fd) {
+        drain_pipeline ();
+        shm_output (data, len);
+        len = 0;
+    }
+
+    data = encode_output (fd, data, &len);
+
+    if (len && pipeline.count)
+        pipeline_submit (fd, data, len);
+    else if (write_fd (fd, data, len) < 0)
+        die ("failed to write output to file descriptor %d", fd);
+}
+
+/**
+ * flush_frames:
+ *
+ * Write an incomplete final line as a record.
+ **/
+void
+flush_frames (void)
+{
+    const char  *p;
+    size_t       len = 0;
+
+    if (! frame.partial_len)
+        return;
+
+    p = frame_lines (frame.partial_fd, NULL, &len, 1);
+
+    while (len > OUTPUT_BUFSIZE) {
+        dispatch_output (frame.partial_fd, p, OUTPUT_BUFSIZE);
+        p += OUTPUT_BUFSIZE;
+        len -= OUTPUT_BUFSIZE;
+    }
+
+    dispatch_output (frame.partial_fd, p, len);
+}
+
+/**
+ * flush_output:
+ *
+ * Write any buffered output to its file descriptor.
+ **/
+void
+flush_output (void)
+{
+    const char  *p = output.data;
+    size_t       len = output.len;
+    const char  *held = NULL;
+    size_t       hold = 0;
+    int          done = 0;
+
+    /* discard data first to avoid recursion via die() */
+    output.len = 0;
+
+    /* an unfinished record stays buffered until its length is known */
+    if (frame.open) {
+        held = p + frame.start;
+        hold = len - frame.start;
+        len = frame.start;
+        frame.start = 0;
+
+        if (frame.record_len || hold > FRAME_MAX) {
+            frame_spill (held, hold);
+            hold = 0;
+        } else if (shm.ring && output.data != output_data) {
+            /* output written to the shared memory ring ahead of the
+             * record may overwrite it once transcoded or framed.
+             */
+            memcpy (output_data, held, hold);
+            held = output_data;
+        }
+    }
+
+    if (len && clock_update == CLOCK_UPDATE_BUFFER)
+        clocks.realtime_valid = clocks.monotonic_valid = 0;
+
+    if (window.start || window.end) {
+        uint64_t  first = window.offset;
+
+        window.offset += len;
+
+        if (first < window.start) {
+            uint64_t  skip = window.start - first;
+
+            if (skip > len)
+                skip = len;
+
+            p += skip;
+            len -= skip;
+            first += skip;
+        }
+
+        if (window.end && first + len >= window.end) {
+            len = window.end > first ? (size_t)(window.end - first) : 0;
+            done = 1;
+        }
+    }
+
+    if (frame.format && frame.unit == FRAME_LINE) {
+        /* a partial line for another file descriptor is complete */
+        if (frame.partial_len && frame.partial_fd != output.fd)
+            flush_frames ();
+
+        p = frame_lines (output.fd, p, &len, 0);
+    }
+
+    while (len > OUTPUT_BUFSIZE) {
+        dispatch_output (output.fd, p, OUTPUT_BUFSIZE);
+        p += OUTPUT_BUFSIZE;
+        len -= OUTPUT_BUFSIZE;
+    }
+
+    dispatch_output (output.fd, p, len);
+
+    if (hold) {
+        memmove (output.data, held, hold);
+        output.len = hold;
+    }
+
+    /* the end of the output window has been reached */
+    if (done) {
+        flush_frames ();
+        flush_targets (1);
+        utfout_exit (EXIT_SUCCESS);
+    }
+}
+
+/**
+ * flush_targets:
+ *
+ * @final: TRUE if no more output will be written.
+ *
+ * Write data that flush_output() has passed on to the writer thread,
+ * shards, datagram sockets and files but which is still buffered.
+ **/
+void
+flush_targets (int final)
+{
+    drain_pipeline ();
+    flush_shards (final);
+    flush_datagrams (final);
+    flush_files (final);
+}
+
+/**
+ * finish_output:
+ *
+ * Write all buffered output, including that buffered for shards,
+ * datagram sockets and files, before exiting.
+ **/
+void
+finish_output (void)
+{
+    frame_end (output.fd);
+
+    flush_output ();
+    flush_frames ();
+    flush_targets (1);
+}
+
+/**
+ * wait_for_output:
+ *
+ * @fd: file descriptor.
+ *
+ * Wait until @fd can accept more data, recording the time spent
+ * waiting.
+ **/
+void
+wait_for_output (int fd)
+{
+    struct pollfd  pfd;
+    uint64_t       start;
+    int            ret;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    start = monotonic_ns ();
+
+    do {
+        ret = poll (&pfd, 1, -1);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 || (pfd.revents & POLLNVAL))
+        die ("failed to wait for file descriptor %d", fd);
+
+    /* errors such as POLLERR are reported by the next write */
+
+    write_stats.stalls++;
+    write_stats.stall_time += monotonic_ns () - start;
+}
+
+/**
+ * delay_bucket:
+ *
+ * @value: value to record.
+ *
+ * Returns: index of delay_stats bucket for @value.
+ **/
+static inline size_t
+delay_bucket (uint64_t value)
+{
+    int  shift;
+
+    if (value < DELAY_SUB_BUCKETS)
+        return (size_t)value;
+
+    shift = 63 - __builtin_clzll (value) - DELAY_SUB_BITS;
+
+    return ((size_t)(shift + 1) * DELAY_SUB_BUCKETS)
+        + (size_t)((value >> shift) - DELAY_SUB_BUCKETS);
+}
+
+/**
+ * delay_bucket_max:
+ *
+ * @bucket: index of delay_stats bucket.
+ *
+ * Returns: largest value recorded in @bucket.
+ **/
+static inline uint64_t
+delay_bucket_max (size_t bucket)
+{
+    uint64_t  mantissa;
+    int       shift;
+
+    if (bucket < DELAY_SUB_BUCKETS)
+        return bucket;
+
+    shift = (int)(bucket / DELAY_SUB_BUCKETS) - 1;
+    mantissa = (bucket % DELAY_SUB_BUCKETS) + DELAY_SUB_BUCKETS;
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+/**
+ * record_delay:
+ *
+ * @requested: nano-seconds of delay requested,
+ * @actual: nano-seconds actually delayed.
+ *
+ * Add the overshoot of a delay to delay_stats.
+ **/
+void
+record_delay (uint64_t requested, uint64_t actual)
+{
+    uint64_t  overshoot;
+
+    overshoot = actual > requested ? actual - requested : 0;
+
+    delay_stats.buckets[delay_bucket (overshoot)]++;
+    delay_stats.count++;
+
+    if (overshoot > delay_stats.max)
+        delay_stats.max = overshoot;
+}
+
+/**
+ * delay_percentile:
+ *
+ * @percentile: percentile to calculate (0-100).
+ *
+ * Returns: overshoot in nano-seconds at or below which @percentile
+ * percent of delays fell.
+ **/
+static uint64_t
+delay_percentile (double percentile)
+{
+    uint64_t  target;
+    uint64_t  seen = 0;
+    uint64_t  value;
+    size_t    i;
+
+    if (! delay_stats.count)
+        return 0;
+
+    target = (uint64_t)ceil ((percentile / 100) * (double)delay_stats.count);
+    if (! target)
+        target = 1;
+
+    for (i = 0; i < DELAY_BUCKETS; i++) {
+        seen += delay_stats.buckets[i];
+        if (seen >= target)
+            break;
+    }
+
+    value = delay_bucket_max (i);
+
+    return value < delay_stats.max ? value : delay_stats.max;
+}
+
+/**
+ * display_stats:
+ *
+ * Write output and delay statistics to standard error in the format
+ * specified by stats_format. Called on exit.
+ **/
+void
+display_stats (void)
+{
+    static const double  percentiles[] = { 50, 99, 99.9 };
+    static const char   *names[] = { "p50", "p99", "p99.9" };
+    char                 buffer[1024];
+    uint64_t             values[4];
+    size_t               len = 0;
+    size_t               i;
+
+    if (stats_format == STATS_NONE)
+        return;
+
+#define APPEND(...) \
+    len += (size_t)snprintf (buffer + len, sizeof (buffer) - len, __VA_ARGS__)
+
+    for (i = 0; i < 3; i++)
+        values[i] = delay_percentile (percentiles[i]);
+    values[3] = delay_stats.max;
+
+    if (stats_format == STATS_JSON) {
+        APPEND ("{\"bytes\": %llu, \"writes\": %llu, \"partial_writes\": %llu, "
+                "\"stalls\": %llu, \"stall_time_ns\": %llu, "
+                "\"datagrams\": %llu, "
+                "\"delays\": %llu, \"delay_overshoot_ns\": {",
+                (unsigned long long)write_stats.bytes,
+                (unsigned long long)write_stats.writes,
+                (unsigned long long)write_stats.partial,
+                (unsigned long long)write_stats.stalls,
+                (unsigned long long)write_stats.stall_time,
+                (unsigned long long)write_stats.datagrams,
+                (unsigned long long)delay_stats.count);
+
+        for (i = 0; i < 3; i++)
+            APPEND ("\"%s\": %llu, ", names[i],
+                    (unsigned long long)values[i]);
+
+        APPEND ("\"max\": %llu}}\n", (unsigned long long)values[3]);
+    } else {
+        APPEND ("bytes: %llu\n"
+                "writes: %llu\n"
+                "partial writes: %llu\n"
+                "stalls: %llu\n"
+                "stall time: %llu.%09llus\n"
+                "datagrams: %llu\n"
+                "delays: %llu\n",
+                (unsigned long long)write_stats.bytes,
+                (unsigned long long)write_stats.writes,
+                (unsigned long long)write_stats.partial,
+                (unsigned long long)write_stats.stalls,
+                (unsigned long long)(write_stats.stall_time / 1000000000),
+                (unsigned long long)(write_stats.stall_time % 1000000000),
+                (unsigned long long)write_stats.datagrams,
+                (unsigned long long)delay_stats.count);
+
+        for (i = 0; i < 4; i++)
+            APPEND ("delay overshoot %s: %llu.%09llus\n",
+                    i < 3 ? names[i] : "max",
+                    (unsigned long long)(values[i] / 1000000000),
+                    (unsigned long long)(values[i] % 1000000000));
+    }
+
+#undef APPEND
+
+    if (len > sizeof (buffer) - 1)
+        len = sizeof (buffer) - 1;
+
+    if (write (STDERR_FILENO, buffer, len) < 0)
+        return;
+}
+
+/**
+ * checksum_output:
+ *
+ * @fd: file descriptor @data is being written to,
+ * @data: data,
+ * @len: length of @data.
+ *
+ * Add @data to the checksum for @fd.
+ **/
+void
+checksum_output (int fd, const char *data, size_t len)
+{
+    size_t  i;
+
+    for (i = 0; i < checksum_count && checksums[i].fd != fd; i++)
+        ;
+
+    if (i == checksum_count) {
+        struct fd_checksum  *new;
+
+        new = realloc (checksums, (i + 1) * sizeof (struct fd_checksum));
+        if (! new)
+            die ("failed to allocate space for checksum");
+
+        checksums = new;
+        checksums[i].fd = fd;
+        checksum_init (&checksums[i].sum, checksum_type);
+        checksum_count++;
+    }
+
+    checksum_update (&checksums[i].sum, data, len);
+}
+
+/**
+ * display_checksums:
+ *
+ * Write the checksum and byte count of each file descriptor written
+ * to on checksum_fd. Called on exit.
+ **/
+void
+display_checksums (void)
+{
+    char    hex[CHECKSUM_MAX_HEX];
+    char    buffer[CHECKSUM_MAX_HEX + 64];
+    size_t  i;
+    int     len;
+
+    for (i = 0; i < checksum_count; i++) {
+        checksum_final (&checksums[i].sum, hex);
+
+        len = snprintf (buffer, sizeof (buffer), "fd %d: %s %s %llu bytes\n",
+                checksums[i].fd,
+                checksum_name (checksum_type),
+                hex,
+                (unsigned long long)checksums[i].sum.bytes);
+
+        if (len > 0 && write (checksum_fd, buffer, (size_t)len) < 0)
+            return;
+    }
+}
+
+/**
+ * put_unit:
+ *
+ * @out: output position,
+ * @value: code unit value,
+ * @unit: size of code unit (2 or 4),
+ * @big_endian: TRUE for big-endian output.
+ *
+ * Returns: position following code unit.
+ **/
+static inline char *
+put_unit (char *out, uint32_t value, int unit, int big_endian)
+{
+    int  i;
+
+    for (i = 0; i < unit; i++) {
+        int  shift = big_endian ? (unit - 1 - i) * 8 : i * 8;
+
+        *out++ = (char)(value >> shift);
+    }
+
+    return out;
+}
+
+/**
+ * decode_utf8:
+ *
+ * @in: UTF-8 data,
+ * @len: number of bytes available at @in (at least 1),
+ * @cp: code point.
+ *
+ * Decode the UTF-8 character at @in. Invalid sequences (including
+ * overlong forms, surrogates, values beyond U+10FFFF and truncated
+ * sequences) are decoded as a single U+FFFD replacement character.
+ *
+ * Returns: number of bytes consumed.
+ **/
+static size_t
+decode_utf8 (const unsigned char *in, size_t len, uint32_t *cp)
+{
+    uint32_t  value;
+    uint32_t  min;
+    size_t    n;
+    size_t    i;
+
+    if (in[0] < 0x80) {
+        *cp = in[0];
+        return 1;
+    } else if (in[0] >= 0xc2 && in[0] <= 0xdf) {
+        n = 2; value = in[0] & 0x1f; min = 0x80;
+    } else if (in[0] >= 0xe0 && in[0] <= 0xef) {
+        n = 3; value = in[0] & 0x0f; min = 0x800;
+    } else if (in[0] >= 0xf0 && in[0] <= 0xf4) {
+        n = 4; value = in[0] & 0x07; min = 0x10000;
+    } else {
+        goto invalid;
+    }
+
+    if (n > len)
+        goto invalid;
+
+    for (i = 1; i < n; i++) {
+        if ((in[i] & 0xc0) != 0x80)
+            goto invalid;
+        value = (value << 6) | (in[i] & 0x3f);
+    }
+
+    if (value < min || value > 0x10ffff
+            || (value >= 0xd800 && value <= 0xdfff))
+        goto invalid;
+
+    *cp = value;
+    return n;
+
+invalid:
+    *cp = 0xfffd;
+    return 1;
+}
+
+/**
+ * transcode_output:
+ *
+ * @in: data in the locale's encoding,
+ * @len: length of @in,
+ * @out: buffer for transcoded data (at least @len * 4 bytes).
+ *
+ * Convert @in to the UTF-16 or UTF-32 output encoding. Characters
+ * beyond the Basic Multilingual Plane are written as UTF-16
+ * surrogate pairs. Blocks of ASCII characters are converted using
+ * SSE2 where available.
+ *
+ * Returns: number of bytes written to @out.
+ **/
+size_t
+transcode_output (const char *in, size_t len, char *out)
+{
+    const unsigned char  *p = (const unsigned char *)in;
+    const unsigned char  *end = p + len;
+    char                 *o = out;
+    int                   unit = output_encoding->unit;
+    int                   be = output_encoding->big_endian;
+    uint32_t              cp;
+    mbstate_t             state;
+
+    memset (&state, 0, sizeof (state));
+
+    while (p < end) {
+#ifdef __SSE2__
+        const __m128i  zero = _mm_setzero_si128 ();
+
+        while (end - p >= 16) {
+            __m128i  v = _mm_loadu_si128 ((const __m128i *)p);
+            __m128i  lo;
+            __m128i  hi;
+
+            if (_mm_movemask_epi8 (v))
+                break;
+
+            /* widen bytes to 16-bit units */
+            lo = be ? _mm_unpacklo_epi8 (zero, v) : _mm_unpacklo_epi8 (v, zero);
+            hi = be ? _mm_unpackhi_epi8 (zero, v) : _mm_unpackhi_epi8 (v, zero);
+
+            if (unit == 2) {
+                _mm_storeu_si128 ((__m128i *)o, lo);
+                _mm_storeu_si128 ((__m128i *)(o + 16), hi);
+            } else {
+                /* and then to 32-bit units */
+                _mm_storeu_si128 ((__m128i *)o, be
+                        ? _mm_unpacklo_epi16 (zero, lo)
+                        : _mm_unpacklo_epi16 (lo, zero));
+                _mm_storeu_si128 ((__m128i *)(o + 16), be
+                        ? _mm_unpackhi_epi16 (zero, lo)
+                        : _mm_unpackhi_epi16 (lo, zero));
+                _mm_storeu_si128 ((__m128i *)(o + 32), be
+                        ? _mm_unpacklo_epi16 (zero, hi)
+                        : _mm_unpacklo_epi16 (hi, zero));
+                _mm_storeu_si128 ((__m128i *)(o + 48), be
+                        ? _mm_unpackhi_epi16 (zero, hi)
+                        : _mm_unpackhi_epi16 (hi, zero));
+            }
+
+            p += 16;
+            o += 16 * unit;
+        }
+
+        if (p == end)
+            break;
+#endif
+
+        if (*p < 0x80) {
+            o = put_unit (o, *p++, unit, be);
+            continue;
+        }
+
+        if (locale_utf8) {
+            p += decode_utf8 (p, end - p, &cp);
+        } else {
+            wchar_t  wc;
+            size_t   ret = mbrtowc (&wc, (const char *)p, end - p, &state);
+
+            if (ret == (size_t)-1 || ret == (size_t)-2 || ! ret) {
+                memset (&state, 0, sizeof (state));
+                cp = 0xfffd;
+                ret = 1;
+            } else {
+                cp = (uint32_t)wc;
+            }
+
+            p += ret;
+        }
+
+        if (unit == 2 && cp > 0xffff) {
+            cp -= 0x10000;
+            o = put_unit (o, 0xd800 | (cp >> 10), unit, be);
+            o = put_unit (o, 0xdc00 | (cp & 0x3ff), unit, be);
+        } else {
+            o = put_unit (o, cp, unit, be);
+        }
+    }
+
+    return o - out;
+}
+
+/**
+ * encode_output:
+ *
+ * @fd: file descriptor @data is destined for,
+ * @data: data to encode,
+ * @len: length of @data (at most OUTPUT_BUFSIZE), updated to the
+ *  length of the encoded data.
+ *
+ * Convert @data to the output encoding, preceded by a byte order mark
+ * if this is the first data for @fd and one is required, and add the
+ * result to the checksum for @fd.
+ *
+ * Returns: encoded data, either @data or a static buffer that is
+ * overwritten by the next call.
+ **/
+const char *
+encode_output (int fd, const char *data, size_t *len)
+{
+    static char  transcoded[ENCODED_BUFSIZE];
+
+    assert (*len <= OUTPUT_BUFSIZE);
+
+    if (*len && output_encoding->unit) {
+        size_t  bom = 0;
+
+        if (output_bom) {
+            size_t  i;
+
+            for (i = 0; i < bom_fd_count && bom_fds[i] != fd; i++)
+                ;
+
+            if (i == bom_fd_count) {
+                int  *fds = realloc (bom_fds, (i + 1) * sizeof (int));
+
+                if (! fds)
+                    die ("failed to allocate space for file descriptors");
+
+                bom_fds = fds;
+                bom_fds[bom_fd_count++] = fd;
+
+                bom = put_unit (transcoded, 0xfeff, output_encoding->unit,
+                        output_encoding->big_endian) - transcoded;
+            }
+        }
+
+        *len = bom + transcode_output (data, *len, transcoded + bom);
+        data = transcoded;
+    }
+
+    if (*len && checksum_type)
+        checksum_output (fd, data, *len);
+
+    return data;
+}
+
+/**
+ * reserve_output:
+ *
+ * @fd: file descriptor output is destined for,
+ * @len: number of bytes required (at most OUTPUT_BUFSIZE).
+ *
+ * Reserve space in the output buffer for @len bytes of data that
+ * the caller will write directly, flushing the buffer first if
+ * necessary.
+ *
+ * Returns: pointer to reserved space.
+ **/
+char *
+reserve_output (int fd, size_t len)
+{
+    char  *p;
+
+    assert (len <= OUTPUT_BUFSIZE);
+
+    if (output.fd != fd || (OUTPUT_BUFSIZE - output.len) < len) {
+        flush_output ();
+        output.fd = fd;
+
+        /* only an unfinished record can remain */
+        if ((OUTPUT_BUFSIZE - output.len) < len) {
+            frame_spill (output.data + frame.start, output.len - frame.start);
+            output.len = frame.start;
+        }
+    }
+
+    p = output.data + output.len;
+    output.len += len;
+
+    return p;
+}
+
+/**
+ * write_output:
+ *
+ * @fd: file descriptor to write to,
+ * @data: data to write,
+ * @len: length of @data.
+ *
+ * Buffer @len bytes of @data for writing to @fd.
+ **/
+void
+write_output (int fd, const char *data, size_t len)
+{
+    size_t  chunk;
+
+    while (len) {
+        chunk = len < OUTPUT_BUFSIZE ? len : OUTPUT_BUFSIZE;
+
+        /* don't split a UTF-8 character between flushes */
+        if (chunk < len && locale_utf8) {
+            while (chunk > 1 && (data[chunk] & 0xc0) == 0x80)
+                chunk--;
+        }
+
+        memcpy (reserve_output (fd, chunk), data, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * parse_frame_spec:
+ *
+ * @spec: comma-separated list of frame options.
+ *
+ * Set how subsequent output is framed. The first option is a length
+ * format from frame_formats (or 'none'); the remainder are 'repeat'
+ * (the default) or 'line' for the unit framed as a record, 'include'
+ * for a length that includes the header, and 'magic=HEX' for bytes
+ * preceding the length.
+ **/
+void
+parse_frame_spec (const char *spec)
+{
+    struct frame_state          new;
+    const struct frame_format  *format = NULL;
+    char                        copy[OPTIONS_MAX];
+    char                       *field;
+    char                       *saveptr = NULL;
+    const char                 *hex;
+    int                         hi;
+    int                         lo;
+
+    assert (spec);
+
+    memset (&new, 0, sizeof (new));
+
+    copy_options (copy, spec, "frame options");
+
+    field = strtok_r (copy, ",", &saveptr);
+
+    if (field && strcmp (field, "none")) {
+        for (format = frame_formats; format->name; format++) {
+            if (! strcmp (format->name, field))
+                break;
+        }
+
+        if (! format->name)
+            die ("invalid frame format '%s'", field);
+
+        new.format = format;
+    }
+
+    while (new.format && (field = strtok_r (NULL, ",", &saveptr))) {
+        if (! strcmp (field, "repeat"))
+            new.unit = FRAME_REPEAT;
+        else if (! strcmp (field, "line"))
+            new.unit = FRAME_LINE;
+        else if (! strcmp (field, "include"))
+            new.include = 1;
+        else if (! strncmp (field, "magic=", 6)) {
+            for (hex = field + 6; *hex; hex += 2) {
+                hi = isxdigit ((unsigned char)hex[0]) ? hex[0] : -1;
+                lo = hi >= 0 && isxdigit ((unsigned char)hex[1]) ? hex[1] : -1;
+
+                if (lo < 0 || new.magic_len == FRAME_MAGIC_MAX)
+                    die ("invalid frame magic '%s'", field + 6);
+
+                hi = isdigit (hi) ? hi - '0' : (tolower (hi) - 'a' + 10);
+                lo = isdigit (lo) ? lo - '0' : (tolower (lo) - 'a' + 10);
+
+                new.magic[new.magic_len++] = (unsigned char)(hi << 4 | lo);
+            }
+        } else
+            die ("invalid frame option '%s'", field);
+    }
+
+    if (new.include && new.format && new.format->length != FRAME_FIXED)
+        die ("'include' requires a fixed-size length");
+
+    if (new.format)
+        new.header = new.magic_len
+            + (new.format->length == FRAME_FIXED
+                    ? new.format->width : FRAME_LENGTH_MAX);
+
+    frame.format = new.format;
+    frame.unit = new.unit;
+    frame.include = new.include;
+    memcpy (frame.magic, new.magic, new.magic_len);
+    frame.magic_len = new.magic_len;
+    frame.header = new.header;
+}
+
+/**
+ * check_frame_length:
+ *
+ * @len: length of record.
+ *
+ * Die if @len cannot be represented in the frame format.
+ **/
+static void
+check_frame_length (uint64_t len)
+{
+    const struct frame_format  *format = frame.format;
+
+    if (frame.include)
+        len += frame.header;
+
+    if (format->length == FRAME_FIXED && format->width < 8
+            && len >> (format->width * 8))
+        die ("record too large for frame format '%s'", format->name);
+}
+
+/**
+ * frame_header:
+ *
+ * @header: buffer of at least frame.header bytes,
+ * @len: length of record.
+ *
+ * Returns: number of bytes of header for a record of @len bytes
+ * written to @header.
+ **/
+static size_t
+frame_header (unsigned char *header, uint64_t len)
+{
+    const struct frame_format  *format = frame.format;
+    unsigned char              *p = header;
+    size_t                      i;
+    int                         ret;
+
+    memcpy (p, frame.magic, frame.magic_len);
+    p += frame.magic_len;
+
+    check_frame_length (len);
+
+    switch (format->length) {
+        case FRAME_FIXED:
+            if (frame.include)
+                len += frame.header;
+
+            for (i = 0; i < format->width; i++) {
+                size_t  shift = format->big_endian
+                    ? format->width - 1 - i : i;
+
+                *p++ = (unsigned char)(len >> (shift * 8));
+            }
+            break;
+
+        case FRAME_VARINT:
+            do {
+                *p = len & 0x7f;
+                len >>= 7;
+                if (len)
+                    *p |= 0x80;
+                p++;
+            } while (len);
+            break;
+
+        case FRAME_NETSTRING:
+            ret = snprintf ((char *)p, FRAME_LENGTH_MAX + 1, "%llu:",
+                    (unsigned long long)len);
+            p += ret;
+            break;
+    }
+
+    return (size_t)(p - header);
+}
+
+/**
+ * frame_begin:
+ *
+ * @fd: file descriptor output is destined for.
+ *
+ * Reserve space in the output buffer for the header of a record if
+ * each display of a string is framed.
+ **/
+void
+frame_begin (int fd)
+{
+    if (! frame.format || frame.unit != FRAME_REPEAT || frame.open)
+        return;
+
+    reserve_output (fd, frame.header);
+
+    frame.start = output.len - frame.header;
+    frame.open = 1;
+}
+
+/**
+ * frame_end:
+ *
+ * @fd: file descriptor output is destined for.
+ *
+ * Complete the open record by writing its header into the space
+ * reserved for it. Fixed-size headers fill that space exactly, so
+ * framing costs no copying; the few unused bytes of a variable-size
+ * header are removed by moving the record down.
+ **/
+void
+frame_end (int fd)
+{
+    unsigned char   header[FRAME_MAGIC_MAX + FRAME_LENGTH_MAX + 1];
+    char           *base;
+    size_t          len;
+    size_t          n;
+
+    if (! frame.open)
+        return;
+
+    frame.open = 0;
+
+    if (frame.record_len) {
+        frame_spill (output.data + frame.start, output.len - frame.start);
+        output.len = frame.start;
+
+        len = frame.record_len - frame.header;
+        frame.record_len = 0;
+
+        n = frame_header (header, len);
+
+        write_output (fd, (const char *)header, n);
+        write_output (fd, frame.record + frame.header, len);
+    } else {
+        base = output.data + frame.start;
+        len = output.len - frame.start - frame.header;
+
+        n = frame_header (header, len);
+
+        if (n < frame.header) {
+            memmove (base + n, base + frame.header, len);
+            output.len -= frame.header - n;
+        }
+
+        memcpy (base, header, n);
+    }
+
+    if (frame.format->length == FRAME_NETSTRING)
+        write_output (fd, ",", 1);
+}
+
+/**
+ * frame_spill:
+ *
+ * @data: data of the open record,
+ * @len: length of @data.
+ *
+ * Move @data, which follows any data already moved, out of the output
+ * buffer since the open record will not fit in it. The first call
+ * includes the space reserved for the header.
+ **/
+void
+frame_spill (const char *data, size_t len)
+{
+    size_t   size = frame.record_len + len;
+    char    *p;
+
+    check_frame_length (size - frame.header);
+
+    if (size > frame.record_size) {
+        if (size < frame.record_size * 2)
+            size = frame.record_size * 2;
+
+        p = realloc (frame.record, size);
+        if (! p)
+            die ("failed to allocate space for record");
+
+        frame.record = p;
+        frame.record_size = size;
+    }
+
+    memcpy (frame.record + frame.record_len, data, len);
+    frame.record_len += len;
+}
+
+/**
+ * frame_append:
+ *
+ * @out: output position,
+ * @line: start of line (following any partial line),
+ * @len: length of @line.
+ *
+ * Write the record for @line, preceded by any partial line, to @out.
+ *
+ * Returns: output position following record.
+ **/
+static char *
+frame_append (char *out, const char *line, size_t len)
+{
+    out += frame_header ((unsigned char *)out, frame.partial_len + len);
+
+    if (frame.partial_len) {
+        memcpy (out, frame.partial, frame.partial_len);
+        out += frame.partial_len;
+        frame.partial_len = 0;
+    }
+
+    /* @line is NULL when only the partial line is left */
+    if (len) {
+        memcpy (out, line, len);
+        out += len;
+    }
+
+    if (frame.format->length == FRAME_NETSTRING)
+        *out++ = ',';
+
+    return out;
+}
+
+/**
+ * frame_lines:
+ *
+ * @fd: file descriptor @data is destined for,
+ * @data: data being flushed,
+ * @len: length of @data, updated to the length of the framed data,
+ * @final: TRUE if the final partial line should also be framed.
+ *
+ * Frame each complete line of @data (excluding its newline) as a
+ * record. An incomplete final line is kept until the rest of it is
+ * flushed.
+ *
+ * Returns: framed data, in a buffer that is overwritten by the next
+ * call.
+ **/
+const char *
+frame_lines (int fd, const char *data, size_t *len, int final)
+{
+    const char  *end = data + *len;
+    const char  *nl;
+    char        *out;
+    char        *partial;
+    size_t       size;
+
+    /* worst case: every byte is a newline */
+    size = (*len + 1) * (frame.header + 2) + frame.partial_len;
+
+    if (size > frame.framed_size) {
+        out = realloc (frame.framed, size);
+        if (! out)
+            die ("failed to allocate space for frames");
+
+        frame.framed = out;
+        frame.framed_size = size;
+    }
+
+    out = frame.framed;
+
+    while (data < end && (nl = memchr (data, '\n', (size_t)(end - data)))) {
+        out = frame_append (out, data, (size_t)(nl - data));
+        data = nl + 1;
+    }
+
+    if (data < end) {
+        size = frame.partial_len + (size_t)(end - data);
+
+        check_frame_length (size);
+
+        if (size > frame.partial_size) {
+            if (size < frame.partial_size * 2)
+                size = frame.partial_size * 2;
+
+            partial = realloc (frame.partial, size);
+            if (! partial)
+                die ("failed to allocate space for record");
+
+            frame.partial = partial;
+            frame.partial_size = size;
+        }
+
+        memcpy (frame.partial + frame.partial_len, data,
+                (size_t)(end - data));
+        frame.partial_len += (size_t)(end - data);
+        frame.partial_fd = fd;
+    }
+
+    if (final && frame.partial_len)
+        out = frame_append (out, data, 0);
+
+    *len = (size_t)(out - frame.framed);
+
+    return frame.framed;
+}
+
+/**
+ * restore_shards:
+ *
+ * Restore the original file status flags of shard file descriptors.
+ **/
+static void
+restore_shards (void)
+{
+    size_t  i;
+
+    for (i = 0; i < shards.count; i++) {
+        if (shards.shards[i].nonblock)
+            (void)fcntl (shards.shards[i].fd, F_SETFL,
+                    shards.shards[i].flags);
+    }
+}
+
+/**
+ * add_shards:
+ *
+ * @spec: shard specification.
+ *
+ * Split subsequent output between the file descriptors listed in
+ * @spec, which has the form:
+ *
+ *      FD,FD,...[:UNIT[,PLACEMENT]]
+ *
+ * UNIT is 'repeat' (each display of a string, the default), 'line' or
+ * a number of bytes. PLACEMENT is 'rr' (round-robin, the default) or
+ * 'hash' (by hash of the contents of each unit, so identical units
+ * are always written to the same file descriptor).
+ *
+ * Pipes and sockets are made non-blocking so that each can be written
+ * to as soon as its reader is ready.
+ **/
+void
+add_shards (const char *spec)
+{
+    char          copy[OPTIONS_MAX];
+    char         *options;
+    char         *field;
+    char         *saveptr = NULL;
+    char         *end;
+    long          fd;
+    struct stat   st;
+    struct shard *shard;
+    int           nonblock = 0;
+
+    assert (spec);
+
+    if (shards.count)
+        die ("only one set of shards may be specified");
+
+    copy_options (copy, spec, "shards");
+
+    options = strchr (copy, ':');
+    if (options)
+        *options++ = '\0';
+
+    for (field = strtok_r (copy, ",", &saveptr); field;
+            field = strtok_r (NULL, ",", &saveptr)) {
+
+        errno = 0;
+        fd = strtol (field, &end, 10);
+        if (end == field || *end || errno || fd < 0 || fd > INT_MAX)
+            die ("invalid shard file descriptor '%s'", field);
+
+        shard = realloc (shards.shards,
+                (shards.count + 1) * sizeof (struct shard));
+        if (! shard)
+            die ("failed to allocate space for shards");
+
+        shards.shards = shard;
+        shard = &shards.shards[shards.count++];
+
+        memset (shard, 0, sizeof (struct shard));
+        shard->fd = (int)fd;
+
+        shard->data = malloc (SHARD_BUFSIZE);
+        if (! shard->data)
+            die ("failed to allocate space for shard buffer");
+
+        shard->flags = fcntl (shard->fd, F_GETFL);
+        if (shard->flags < 0 || fstat (shard->fd, &st) < 0)
+            die ("invalid shard file descriptor %d", shard->fd);
+
+        if ((S_ISFIFO (st.st_mode) || S_ISSOCK (st.st_mode))
+                && ! (shard->flags & O_NONBLOCK)) {
+            if (fcntl (shard->fd, F_SETFL, shard->flags | O_NONBLOCK) < 0)
+                die ("failed to set file descriptor %d non-blocking",
+                        shard->fd);
+            shard->nonblock = nonblock = 1;
+        }
+    }
+
+    if (! shards.count)
+        die ("invalid shards '%s'", spec);
+
+    shards.pfds = calloc (shards.count, sizeof (struct pollfd));
+    if (! shards.pfds)
+        die ("failed to allocate space for shards");
+
+    shards.unit = SHARD_REPEAT;
+
+    field = options ? strtok_r (options, ",", &saveptr) : NULL;
+
+    if (field) {
+        if (! strcmp (field, "line"))
+            shards.unit = SHARD_LINE;
+        else if (strcmp (field, "repeat")) {
+            shards.unit = SHARD_CHUNK;
+            shards.chunk = (size_t)parse_size (field);
+            if (! shards.chunk)
+                die ("invalid shard unit '%s'", field);
+        }
+
+        field = strtok_r (NULL, ",", &saveptr);
+    }
+
+    if (field) {
+        if (! strcmp (field, "hash"))
+            shards.hash = 1;
+        else if (strcmp (field, "rr"))
+            die ("invalid shard placement '%s'", field);
+
+        if (strtok_r (NULL, ",", &saveptr))
+            die ("invalid shards '%s'", spec);
+    }
+
+    if (nonblock && utfout_atexit (restore_shards))
+        die ("failed to register shard handler");
+}
+
+/**
+ * shard_write:
+ *
+ * @shard: shard.
+ *
+ * Write as much of the data buffered for @shard as its file
+ * descriptor will accept without blocking.
+ **/
+static void
+shard_write (struct shard *shard)
+{
+    ssize_t  ret;
+
+    while (shard->len) {
+        ret = write (shard->fd, shard->data + shard->start, shard->len);
+
+        DTRACE_PROBE3 (utfout, write, shard->fd, shard->len, ret);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+
+            die ("failed to write output to file descriptor %d", shard->fd);
+        }
+
+        write_stats.writes++;
+        write_stats.bytes += (uint64_t)ret;
+
+        if ((size_t)ret < shard->len)
+            write_stats.partial++;
+
+        shard->start += (size_t)ret;
+        shard->len -= (size_t)ret;
+    }
+
+    shard->start = 0;
+}
+
+/**
+ * shard_wait:
+ *
+ * @target: shard,
+ * @limit: number of bytes.
+ *
+ * Write buffered data until no more than @limit bytes remain buffered
+ * for @target. While waiting for the reader of @target, data buffered
+ * for the other shards is written as their readers become ready.
+ **/
+static void
+shard_wait (struct shard *target, size_t limit)
+{
+    struct pollfd  *pfds = shards.pfds;
+    uint64_t        start = 0;
+    size_t          nfds;
+    size_t          i;
+
+    assert (target);
+
+    while (1) {
+        for (i = 0; i < shards.count; i++)
+            shard_write (&shards.shards[i]);
+
+        if (target->len <= limit)
+            break;
+
+        if (! start) {
+            start = monotonic_ns ();
+            write_stats.stalls++;
+        }
+
+        for (i = nfds = 0; i < shards.count; i++) {
+            if (! shards.shards[i].len)
+                continue;
+
+            pfds[nfds].fd = shards.shards[i].fd;
+            pfds[nfds].events = POLLOUT;
+            pfds[nfds].revents = 0;
+            nfds++;
+        }
+
+        if (poll (pfds, nfds, -1) < 0 && errno != EINTR)
+            die ("failed to wait for file descriptors");
+    }
+
+    if (start)
+        write_stats.stall_time += monotonic_ns () - start;
+}
+
+/**
+ * shard_append:
+ *
+ * @shard: shard,
+ * @data: data,
+ * @len: length of @data.
+ *
+ * Encode @data and add it to the buffer for @shard, first writing
+ * buffered data if there is insufficient space.
+ **/
+static void
+shard_append (struct shard *shard, const char *data, size_t len)
+{
+    const char  *p;
+    size_t       chunk;
+    size_t       n;
+
+    while (len) {
+        chunk = len < OUTPUT_BUFSIZE ? len : OUTPUT_BUFSIZE;
+
+        /* don't split a UTF-8 character between encodings */
+        if (chunk < len && locale_utf8) {
+            while (chunk > 1 && (data[chunk] & 0xc0) == 0x80)
+                chunk--;
+        }
+
+        n = chunk;
+        p = encode_output (shard->fd, data, &n);
+
+        if (shard->start + shard->len + n > SHARD_BUFSIZE) {
+            if (shard->len + n > SHARD_BUFSIZE)
+                shard_wait (shard, SHARD_BUFSIZE - n);
+
+            memmove (shard->data, shard->data + shard->start, shard->len);
+            shard->start = 0;
+        }
+
+        memcpy (shard->data + shard->start + shard->len, p, n);
+        shard->len += n;
+
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * shard_output:
+ *
+ * @data: data written to SHARD_FD,
+ * @len: length of @data.
+ *
+ * Split @data into units and add each to the appropriate shard.
+ **/
+void
+shard_output (const char *data, size_t len)
+{
+    const char  *nl;
+    size_t       n;
+    int          end;
+
+    while (len) {
+        n = len;
+        end = 0;
+
+        switch (shards.unit) {
+            case SHARD_LINE:
+                nl = memchr (data, '\n', len);
+                if (nl) {
+                    n = (size_t)(nl - data) + 1;
+                    end = 1;
+                }
+                break;
+
+            case SHARD_CHUNK:
+                if (n >= shards.chunk - shards.filled) {
+                    n = shards.chunk - shards.filled;
+                    end = 1;
+                }
+                break;
+
+            default:
+                /* end of unit marked by shard_record_end() */
+                break;
+        }
+
+        if (shards.hash) {
+            if (shards.record_len + n > shards.record_size) {
+                char    *record;
+                size_t   size = (shards.record_len + n) * 2;
+
+                record = realloc (shards.record, size);
+                if (! record)
+                    die ("failed to allocate space for shard record");
+
+                shards.record = record;
+                shards.record_size = size;
+            }
+
+            memcpy (shards.record + shards.record_len, data, n);
+            shards.record_len += n;
+        } else {
+            shard_append (&shards.shards[shards.current], data, n);
+        }
+
+        shards.filled += n;
+        data += n;
+        len -= n;
+
+        if (end)
+            shard_record_end ();
+    }
+}
+
+/**
+ * shard_record_end:
+ *
+ * Complete the current unit of output written to SHARD_FD.
+ **/
+void
+shard_record_end (void)
+{
+    size_t  i;
+
+    if (shards.hash) {
+        i = checksum_hash (shards.record, shards.record_len) % shards.count;
+
+        shard_append (&shards.shards[i], shards.record, shards.record_len);
+        shards.record_len = 0;
+    } else {
+        shards.current = (shards.current + 1) % shards.count;
+    }
+
+    shards.filled = 0;
+}
+
+/**
+ * flush_shards:
+ *
+ * @final: TRUE if no more output will be written to SHARD_FD.
+ *
+ * Write all data buffered for shards. If @final, a partial unit
+ * awaiting placement by hash is placed and written too.
+ **/
+void
+flush_shards (int final)
+{
+    size_t  i;
+
+    if (final && shards.record_len)
+        shard_record_end ();
+
+    for (i = 0; i < shards.count; i++)
+        shard_wait (&shards.shards[i], 0);
+}
+
+/**
+ * parse_datagram_spec:
+ *
+ * @spec: comma-separated list of datagram options.
+ *
+ * Specify how output to datagram sockets is split into datagrams.
+ * Options are 'repeat' (each display of a string is one datagram, the
+ * default), 'line' (each line, excluding its newline, is one
+ * datagram), the maximum number of datagrams to send with a single
+ * system call, and 'gso' (combine consecutive datagrams of the same
+ * size using UDP generic segmentation offload).
+ **/
+void
+parse_datagram_spec (const char *spec)
+{
+    char            copy[OPTIONS_MAX];
+    char           *field;
+    char           *saveptr = NULL;
+    char           *end;
+    unsigned long   batch;
+
+    assert (spec);
+
+    copy_options (copy, spec, "datagram options");
+
+    for (field = strtok_r (copy, ",", &saveptr); field;
+            field = strtok_r (NULL, ",", &saveptr)) {
+
+        if (! strcmp (field, "repeat")) {
+            datagrams.unit = DATAGRAM_REPEAT;
+        } else if (! strcmp (field, "line")) {
+            datagrams.unit = DATAGRAM_LINE;
+        } else if (! strcmp (field, "gso")) {
+#ifdef UDP_SEGMENT
+            datagrams.gso = 1;
+#else
+            die ("UDP segmentation offload is not supported on this platform");
+#endif
+        } else {
+            errno = 0;
+            batch = strtoul (field, &end, 10);
+            if (end == field || *end || errno
+                    || ! batch || batch > DATAGRAM_MAX_BATCH)
+                die ("invalid datagram option '%s'", field);
+
+            datagrams.batch = (size_t)batch;
+        }
+    }
+}
+
+/**
+ * datagram_socket:
+ *
+ * @fd: file descriptor.
+ *
+ * Returns: TRUE if @fd is a datagram socket.
+ **/
+int
+datagram_socket (int fd)
+{
+    socklen_t  len;
+    int        type;
+
+    if (fd == datagrams.checked_fd)
+        return datagrams.checked;
+
+    len = sizeof (type);
+
+    datagrams.checked_fd = fd;
+    datagrams.checked = fd >= 0
+        && ! getsockopt (fd, SOL_SOCKET, SO_TYPE, &type, &len)
+        && (type == SOCK_DGRAM || type == SOCK_SEQPACKET);
+
+    return datagrams.checked;
+}
+
+/**
+ * send_datagrams:
+ *
+ * @fd: socket,
+ * @msgs: datagrams to send,
+ * @count: number of entries in @msgs.
+ *
+ * Send as many of @msgs as possible, setting the msg_len of each
+ * datagram sent.
+ *
+ * Returns: number of datagrams sent, or -1 on error.
+ **/
+static int
+send_datagrams (int fd, struct mmsghdr *msgs, size_t count)
+{
+#ifdef HAVE_SENDMMSG
+    return sendmmsg (fd, msgs, (unsigned int)count, 0);
+#else
+    ssize_t  ret;
+
+    if (! count)
+        return 0;
+
+    ret = sendmsg (fd, &msgs[0].msg_hdr, 0);
+    if (ret < 0)
+        return -1;
+
+    msgs[0].msg_len = (unsigned int)ret;
+
+    return 1;
+#endif
+}
+
+/**
+ * datagram_send:
+ *
+ * Send all complete datagrams, keeping any partial datagram.
+ **/
+static void
+datagram_send (void)
+{
+    static struct mmsghdr  msgs[DATAGRAM_MAX_BATCH];
+#ifdef UDP_SEGMENT
+    static union {
+        char            buf[CMSG_SPACE (sizeof (uint16_t))];
+        struct cmsghdr  align;
+    } control[DATAGRAM_MAX_BATCH];
+#endif
+    struct iovec  *iov = datagrams.iov;
+    size_t         first = 0;
+    size_t         count;
+    size_t         i;
+    size_t         j;
+    size_t         total;
+    int            ret;
+    int            k;
+
+    while (first < datagrams.count) {
+        /* build the messages */
+        for (i = first, count = 0; i < datagrams.count; i = j, count++) {
+            struct msghdr  *hdr = &msgs[count].msg_hdr;
+
+            memset (hdr, 0, sizeof (struct msghdr));
+
+            j = i + 1;
+            total = iov[i].iov_len;
+
+#ifdef UDP_SEGMENT
+            /* the kernel splits a single large send into datagrams
+             * of the segment size.
+             */
+            while (datagrams.gso && datagrams.udp && iov[i].iov_len
+                    && j < datagrams.count
+                    && j - i < DATAGRAM_GSO_SEGMENTS
+                    && iov[j].iov_len == iov[i].iov_len
+                    && total + iov[j].iov_len <= DATAGRAM_GSO_BYTES) {
+                total += iov[j].iov_len;
+                j++;
+            }
+
+            if (j - i > 1) {
+                struct cmsghdr  *cmsg;
+                uint16_t         size = (uint16_t)iov[i].iov_len;
+
+                hdr->msg_control = control[count].buf;
+                hdr->msg_controllen = sizeof (control[count].buf);
+
+                cmsg = CMSG_FIRSTHDR (hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN (sizeof (uint16_t));
+                memcpy (CMSG_DATA (cmsg), &size, sizeof (size));
+            }
+#endif
+
+            hdr->msg_iov = &iov[i];
+            hdr->msg_iovlen = j - i;
+        }
+
+        ret = send_datagrams (datagrams.fd, msgs, count);
+
+        DTRACE_PROBE3 (utfout, write, datagrams.fd, count, ret);
+
+        if (ret < 0) {
+            /* ECONNREFUSED reports an earlier datagram that was not
+             * delivered because nothing was listening.
+             */
+            if (errno == EINTR || errno == ECONNREFUSED)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_for_output (datagrams.fd);
+                continue;
+            }
+
+            if (datagrams.gso && (errno == EINVAL || errno == EIO
+                        || errno == EOPNOTSUPP || errno == ENOPROTOOPT)) {
+                /* not supported by this socket or device */
+                datagrams.gso = 0;
+                continue;
+            }
+
+            die ("failed to write output to file descriptor %d",
+                    datagrams.fd);
+        }
+
+        write_stats.writes++;
+
+        for (k = 0; k < ret; k++) {
+            first += msgs[k].msg_hdr.msg_iovlen;
+            write_stats.datagrams += msgs[k].msg_hdr.msg_iovlen;
+            write_stats.bytes += msgs[k].msg_len;
+        }
+    }
+
+    /* keep the datagram being built */
+    memmove (datagrams.data, datagrams.data + datagrams.start,
+            datagrams.len - datagrams.start);
+    datagrams.len -= datagrams.start;
+    datagrams.start = 0;
+    datagrams.count = 0;
+}
+
+/**
+ * datagram_select:
+ *
+ * @fd: datagram socket.
+ *
+ * Prepare to build datagrams for @fd, sending everything built for
+ * any other socket first.
+ **/
+static void
+datagram_select (int fd)
+{
+    if (datagrams.fd == fd)
+        return;
+
+    flush_datagrams (1);
+
+    if (! datagrams.data) {
+        datagrams.data = malloc (DATAGRAM_BUFSIZE);
+        datagrams.iov = calloc (DATAGRAM_MAX_BATCH, sizeof (struct iovec));
+        if (! datagrams.data || ! datagrams.iov)
+            die ("failed to allocate space for datagrams");
+    }
+
+    datagrams.fd = fd;
+    datagrams.udp = 0;
+
+#if defined (UDP_SEGMENT) && defined (SO_PROTOCOL)
+    {
+        socklen_t  len = sizeof (int);
+        int        protocol;
+
+        /* other sockets ignore UDP_SEGMENT rather than failing */
+        datagrams.udp = ! getsockopt (fd, SOL_SOCKET, SO_PROTOCOL,
+                &protocol, &len) && protocol == IPPROTO_UDP;
+    }
+#endif
+}
+
+/**
+ * datagram_append:
+ *
+ * @data: data,
+ * @len: length of @data (at most OUTPUT_BUFSIZE).
+ *
+ * Encode @data and add it to the datagram being built.
+ **/
+static void
+datagram_append (const char *data, size_t len)
+{
+    const char  *p;
+
+    p = encode_output (datagrams.fd, data, &len);
+
+    if (datagrams.len + len > DATAGRAM_BUFSIZE) {
+        datagram_send ();
+
+        if (datagrams.len + len > DATAGRAM_BUFSIZE)
+            die ("datagram too large for file descriptor %d",
+                    datagrams.fd);
+    }
+
+    memcpy (datagrams.data + datagrams.len, p, len);
+    datagrams.len += len;
+}
+
+/**
+ * datagram_output:
+ *
+ * @fd: datagram socket,
+ * @data: data written to @fd,
+ * @len: length of @data (at most OUTPUT_BUFSIZE).
+ *
+ * Add @data to the datagrams being built for @fd.
+ **/
+void
+datagram_output (int fd, const char *data, size_t len)
+{
+    const char  *nl;
+    size_t       n;
+
+    datagram_select (fd);
+
+    while (len) {
+        nl = NULL;
+        n = len;
+
+        if (datagrams.unit == DATAGRAM_LINE) {
+            nl = memchr (data, '\n', len);
+            if (nl)
+                n = (size_t)(nl - data);
+        }
+
+        datagram_append (data, n);
+
+        if (nl) {
+            datagram_end (fd);
+            n++;
+        }
+
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * datagram_end:
+ *
+ * @fd: datagram socket.
+ *
+ * Complete the datagram being built for @fd, sending a batch of
+ * datagrams if enough are ready.
+ **/
+void
+datagram_end (int fd)
+{
+    struct iovec  *iov;
+
+    datagram_select (fd);
+
+    iov = &datagrams.iov[datagrams.count++];
+    iov->iov_base = datagrams.data + datagrams.start;
+    iov->iov_len = datagrams.len - datagrams.start;
+
+    datagrams.start = datagrams.len;
+
+    if (datagrams.count == datagrams.batch)
+        datagram_send ();
+}
+
+/**
+ * flush_datagrams:
+ *
+ * @final: TRUE if the datagram being built is complete.
+ *
+ * Send all complete datagrams and, if @final, the datagram being
+ * built.
+ **/
+void
+flush_datagrams (int final)
+{
+    if (datagrams.fd < 0)
+        return;
+
+    if (final && datagrams.start < datagrams.len)
+        datagram_end (datagrams.fd);
+
+    if (datagrams.count)
+        datagram_send ();
+}
+
+/**
+ * parse_file_options:
+ *
+ * @spec: comma-separated list of file options.
+ *
+ * Set the options used for files subsequently opened by '--file'.
+ * Options are 'direct', 'dsync', 'nocache', 'sync', 'pad',
+ * 'block=SIZE' and 'align=SIZE'; 'cached' clears 'direct'.
+ **/
+void
+parse_file_options (const char *spec)
+{
+    struct file_options   options = file_options;
+    char                  copy[OPTIONS_MAX];
+    char                 *field;
+    char                 *saveptr = NULL;
+
+    assert (spec);
+
+    copy_options (copy, spec, "file options");
+
+    for (field = strtok_r (copy, ",", &saveptr); field;
+            field = strtok_r (NULL, ",", &saveptr)) {
+
+        if (! strcmp (field, "direct"))
+            options.direct = 1;
+        else if (! strcmp (field, "cached"))
+            options.direct = 0;
+        else if (! strcmp (field, "dsync"))
+            options.dsync = 1;
+        else if (! strcmp (field, "nocache"))
+            options.nocache = 1;
+        else if (! strcmp (field, "sync"))
+            options.sync = 1;
+        else if (! strcmp (field, "pad"))
+            options.pad = 1;
+        else if (! strncmp (field, "block=", 6))
+            options.block = (size_t)parse_size (field + 6);
+        else if (! strncmp (field, "align=", 6))
+            options.align = (size_t)parse_size (field + 6);
+        else
+            die ("invalid file option '%s'", field);
+    }
+
+    if (! options.align || (options.align & (options.align - 1)))
+        die ("file alignment must be a power of 2");
+
+    if (! options.block || options.block % options.align)
+        die ("file block size must be a multiple of the alignment");
+
+    file_options = options;
+}
+
+/**
+ * open_file:
+ *
+ * @path: path of file.
+ *
+ * Create (or truncate) @path for writing using the current file
+ * options.
+ *
+ * Returns: file descriptor.
+ **/
+int
+open_file (const char *path)
+{
+    struct file_target  *file;
+    size_t               align;
+    int                  flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    assert (path);
+
+    file = calloc (1, sizeof (struct file_target));
+    if (! file)
+        die ("failed to allocate space for file");
+
+    file->options = file_options;
+
+    if (file->options.direct) {
+#ifdef O_DIRECT
+        flags |= O_DIRECT;
+#else
+        die ("direct I/O is not supported on this platform");
+#endif
+    }
+
+    if (file->options.dsync)
+        flags |= O_DSYNC;
+
+    file->fd = open (path, flags, 0666);
+    if (file->fd < 0)
+        die ("failed to open file '%s'", path);
+
+    file->path = strdup (path);
+    if (! file->path)
+        die ("failed to allocate space for file");
+
+    /* the buffer is also the source of direct I/O */
+    align = file->options.align < FILE_ALIGN
+        ? FILE_ALIGN : file->options.align;
+
+    if (posix_memalign ((void **)&file->data, align, file->options.block))
+        die ("failed to allocate space for file buffer");
+
+    if (! file->options.direct)
+        (void)posix_fadvise (file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    file->next = files;
+    files = file;
+
+    return file->fd;
+}
+
+/**
+ * file_target:
+ *
+ * @fd: file descriptor.
+ *
+ * Returns: file opened by '--file' with file descriptor @fd, or NULL.
+ **/
+struct file_target *
+file_target (int fd)
+{
+    struct file_target  *file;
+
+    for (file = files; file; file = file->next) {
+        if (file->fd == fd)
+            return file;
+    }
+
+    return NULL;
+}
+
+/**
+ * file_write:
+ *
+ * @file: file,
+ * @len: number of bytes at the start of the buffer of @file to write.
+ *
+ * Write @len bytes to @file, keeping any remaining buffered data.
+ **/
+static void
+file_write (struct file_target *file, size_t len)
+{
+    const char  *p = file->data;
+    size_t       todo = len;
+    ssize_t      ret;
+
+    while (todo) {
+        ret = write (file->fd, p, todo);
+
+        DTRACE_PROBE3 (utfout, write, file->fd, todo, ret);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            die ("failed to write output to file '%s'", file->path);
+        }
+
+        write_stats.writes++;
+        write_stats.bytes += (uint64_t)ret;
+
+        if ((size_t)ret < todo)
+            write_stats.partial++;
+
+        p += ret;
+        todo -= (size_t)ret;
+    }
+
+    file->offset += len;
+    file->len -= len;
+
+    if (file->len)
+        memmove (file->data, file->data + len, file->len);
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    if (file->options.nocache && ! file->options.direct) {
+        /* start writing back this block, then wait for the previous
+         * blocks to be written so they can be dropped from the cache
+         * without stalling the writes in between.
+         */
+        (void)sync_file_range (file->fd, (off_t)(file->offset - len),
+                (off_t)len, SYNC_FILE_RANGE_WRITE);
+
+        if (file->offset - len > file->cached) {
+            (void)sync_file_range (file->fd, (off_t)file->cached,
+                    (off_t)(file->offset - len - file->cached),
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                    | SYNC_FILE_RANGE_WAIT_AFTER);
+            (void)posix_fadvise (file->fd, (off_t)file->cached,
+                    (off_t)(file->offset - len - file->cached),
+                    POSIX_FADV_DONTNEED);
+            file->cached = file->offset - len;
+        }
+    }
+#endif
+}
+
+/**
+ * file_output:
+ *
+ * @file: file,
+ * @data: data written to the file descriptor of @file,
+ * @len: length of @data (at most OUTPUT_BUFSIZE).
+ *
+ * Encode @data and add it to the buffer for @file, writing each
+ * block as it fills.
+ **/
+void
+file_output (struct file_target *file, const char *data, size_t len)
+{
+    size_t  n;
+
+    assert (file);
+
+    data = encode_output (file->fd, data, &len);
+
+    while (len) {
+        n = file->options.block - file->len;
+        if (n > len)
+            n = len;
+
+        memcpy (file->data + file->len, data, n);
+        file->len += n;
+
+        if (file->len == file->options.block)
+            file_write (file, file->len);
+
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * flush_files:
+ *
+ * @final: TRUE if no more output will be written.
+ *
+ * Write data buffered for files. Direct I/O requires aligned lengths,
+ * so until @final only whole multiples of the alignment are written.
+ * When @final, the last partial write is padded with zeros and (unless
+ * the 'pad' option was given) the file is then truncated to the length
+ * of the output.
+ **/
+void
+flush_files (int final)
+{
+    struct file_target  *file;
+    size_t               aligned;
+    uint64_t             length;
+
+    for (file = files; file; file = file->next) {
+        length = file->offset + file->len;
+        aligned = (file->len + file->options.align - 1)
+            & ~(file->options.align - 1);
+
+        if (! final) {
+            if (file->options.direct)
+                file_write (file, file->len & ~(file->options.align - 1));
+            else
+                file_write (file, file->len);
+            continue;
+        }
+
+        if (file->options.direct || file->options.pad) {
+            memset (file->data + file->len, 0, aligned - file->len);
+            file->len = aligned;
+        }
+
+        file_write (file, file->len);
+
+        if (! file->options.pad && file->offset != length
+                && ftruncate (file->fd, (off_t)length) < 0)
+            die ("failed to truncate file '%s'", file->path);
+
+        if (file->options.sync && fsync (file->fd) < 0)
+            die ("failed to sync file '%s'", file->path);
+    }
+}
+
+/**
+ * pause_char:
+ *
+ * @delay: nano-seconds to pause between characters (or NULL).
+ **/
+static inline void
+pause_char (const int64_t *delay)
+{
+    if (delay)
+        sleep_for (*delay);
+}
+
+/**
+ * OUT_WCHAR:
+ *
+ * @fd: open file descriptor,
+ * @wc: wide character to display,
+ * @delay: nano-seconds to pause afterwards (or NULL).
+ *
+ * Convert wide character @wc back into multi-byte sequence and
+ * write to file descriptor @fd.
+ */
+#define OUT_WCHAR(fd, wc, delay) \
+{ \
+    char    buffer[8]; \
+    size_t  len; \
+    \
+    len = wcrtomb (buffer, wc, NULL); \
+    if (len != (size_t)-1) \
+        write_output (fd, buffer, len); \
+    \
+    pause_char (delay); \
+}
+
+/**
+ * usage:
+ *
+ * Display details to stdout of how this program can be used.
+ **/
+void
+usage (void)
+{
+    printf (
+            "Usage: %s [<options>]\n"
+            "\n"
+            "Description: Echo strings to specified output stream(s).\n"
+            "\n"
+            "Options:\n"
+            "\n"
+            "  -a, --intra-char=<char>    : Insert specified character between all\n"
+            "                               output characters.\n"
+            "  -b, --intra-pause=<delay>  : Pause between writing each character.\n"
+            "  -B, --bytes                : Write subsequent 'xNN' and 'oNNN' escapes\n"
+            "                               as raw bytes.\n"
+            "      --begin                : Start a block of strings and options\n"
+            "                               (ended by '--end') that '-r' repeats.\n"
+            "      --bom                  : Write a byte order mark before output\n"
+            "                               to each file descriptor when using\n"
+            "                               '--encoding'.\n"
+            "      --checksum=<alg>[:<fd>]: Display checksum ('xxh3', 'crc32c' or\n"
+            "                               'sha256') of output to each file\n"
+            "                               descriptor on <fd> (default %d) on exit.\n"
+            "      --clock-update=<when>  : Read clock for time escapes once per\n"
+            "                               'buffer' (default), 'string' or\n"
+            "                               'always'.\n"
+            "      --datagram=<options>   : Send each 'repeat' (default) or 'line' as\n"
+            "                               a datagram to datagram sockets, in\n"
+            "                               batches of <n> (default %d), optionally\n"
+            "                               using UDP segmentation offload ('gso').\n"
+            "  -e, --stderr               : Write subsequent strings to standard error\n"
+            "                               (file descriptor %d).\n"
+            "      --end                  : End a block started by '--begin'.\n"
+            "      --encoding=<name>      : Encode output as 'utf-16le', 'utf-16be',\n"
+            "                               'utf-32le', 'utf-32be' or 'locale'\n"
+            "                               (default).\n"
+            "      --file=<path>          : Write subsequent strings to file <path>.\n"
+            "      --file-options=<opts>  : Options for subsequent '--file' ('direct',\n"
+            "                               'dsync', 'nocache', 'sync', 'pad',\n"
+            "                               'block=<size>', 'align=<size>').\n"
+            "      --frame=<spec>         : Prefix each 'repeat' (default) or 'line'\n"
+            "                               with its length ('u16be', 'u16le',\n"
+            "                               'u32be', 'u32le', 'u64be', 'u64le',\n"
+            "                               'varint', 'netstring' or 'none').\n"
+            "  -h, --help                 : This help text.\n"
+            "  -i, --interpret            : Interpret escape characters.\n"
+            "  -l, --literal              : Write literal strings only\n"
+            "                               (disable escape characters)\n"
+            "  -o, --stdout               : Write subsequent strings to standard output\n"
+            "                               (file descriptor %d).\n"
+            "      --pipeline[=<n>]       : Write output from a separate thread, using\n"
+            "                               <n> buffers (default %d).\n"
+            "  -p, --prefix=<prefix>      : Use <prefix> as escape prefix (default='%lc')\n"
+            "      --profile=<spec>       : Vary the rate of subsequent repeats over\n"
+            "                               time ('hold', 'ramp', 'step', 'sine' and\n"
+            "                               'burst' phases, or '@<file>' for a CSV\n"
+            "                               timeline).\n"
+            "      --profile-report=<delay>: Display the target and achieved rate of\n"
+            "                               profiled repeats every <delay>.\n"
+            "      --range=<start>:<end>  : Only write bytes <start> to <end> of the\n"
+            "                               output (either may be omitted).\n"
+            "  -r, --repeat=<repeat>      : Repeat previous value (string or block)\n"
+            "                               <repeat> times.\n"
+            "      --seed=<seed>          : Seed for random escapes.\n"
+            "      --shard=<spec>         : Split subsequent strings between file\n"
+            "                               descriptors ('FD,FD,...[:UNIT[,PLACE]]').\n"
+            "      --shm=<name>[,size=<size>]: Write subsequent strings to a\n"
+            "                               shared memory ring <name> of <size>\n"
+            "                               bytes (default 4M).\n"
+            "      --skip=<bytes>         : Do not write the first <bytes> of output.\n"
+            "      --skip-repeats=<n>     : Do not display the first <n> repeats of\n"
+            "                               strings, nor generate them.\n"
+            "  -s, --sleep=<delay>        : Sleep for <delay> amount of time.\n"
+            "      --stats[=<format>]     : Display output and delay statistics on\n"
+            "                               standard error on exit as 'text'\n"
+            "                               (default) or 'json'.\n"
+            "      --stream=<spec>        : Add stream <spec> ('FD,DELAY[,COUNT]:STRING')\n"
+            "                               to a group run concurrently.\n"
+            "      --strict               : Treat malformed escapes as errors.\n"
+            "      --term-bench[=<spec>]  : Measure how fast the terminal displays\n"
+            "                               workloads ('ascii', 'sgr', 'cjk',\n"
+            "                               'braille', 'combining', 'cursor'), each\n"
+            "                               of 'budget=<size>' bytes (default 16M).\n"
+            "  -t, --terminal             : Write subsequent strings directly to terminal.\n"
+            "  -u, --file-descriptor=<fd> : Write to specified file descriptor.\n"
+            "  -x, --exit=<num>           : Exit with value <num>.\n"
+            "\n",
+        PACKAGE_NAME,
+        STDERR_FILENO,
+        DATAGRAM_BATCH,
+        STDERR_FILENO,
+        STDOUT_FILENO,
+        PIPELINE_SLOTS,
+        (wint_t)escape_prefix);
+
+    printf (
+            "Escape Characters:\n"
+            "\n"
+            "  'a'         - alert (bell)\n"
+            "  'b'         - backspace\n"
+            "  'c'         - no further output\n"
+            "  'e'         - escape character\n"
+            "  'f'         - form feed\n"
+            "  'g'         - generate pseudo-random printable character\n"
+            "  'n'         - newline\n"
+            "  'oNNN'      - 1-byte octal character (1-3 digits)\n"
+            "  'r'         - carriage return\n"
+            "  't'         - horizontal tab\n"
+            "  'uNNNN'     - 4-byte unicode/UTF-8 character (4 hex digits)\n"
+            "  'UNNNNNNNN' - 4-byte unicode/UTF-8 character (8 hex digits)\n"
+            "  'v'         - vertical tab\n"
+            "  'xNN'       - 1-byte hexadecimal character (1-2 digits)\n"
+            "  'X{HEX}'    - raw bytes given as pairs of hex digits\n"
+            "\n"
+           );
+
+    printf (
+            "Extended Escape Characters:\n"
+            "\n"
+            "  '\\{N..N}'                 - Specify a range by two 1-chacter literal\n"
+            "                              characters.\n"
+            "  '\\{xNN..xNN}'             - Specify a range by two 2-digit hex values.\n"
+            "  '\\{oNNN..oNNN}'           - Specify a range by two 3-digit octal values.\n"
+            "  '\\{uNNNN..uNNNN}'         - Specify a range by two 4-digit unicode values.\n"
+            "  '\\{UNNNNNNNN..UNNNNNNNN}' - Specify a range by two 8-digit unicode values.\n"
+            "  '\\{N..N[..S][,SEP]}'      - Specify a numeric sequence with optional step\n"
+            "                              S and separator SEP.\n"
+            "  '\\T{FORMAT}'              - Current time as strftime(3) FORMAT ('%%N',\n"
+            "                              '%%3N', '%%6N', '%%9N' for fractional seconds)\n"
+            "                              or time since the Epoch in 's', 'ms', 'us'\n"
+            "                              or 'ns'.\n"
+            "  '\\M{UNIT}'                - Time elapsed since startup in 's', 'ms',\n"
+            "                              'us' or 'ns'.\n"
+            "  '\\w{PATH[,zipf[=S]]}'     - Random line from file PATH, selected\n"
+            "                              uniformly or using a Zipf distribution\n"
+            "                              with exponent S (default 1).\n"
+            "  '\\G{KIND[=W],...}'        - Random malformed UTF-8 sequence of KIND\n"
+            "                              'overlong', 'surrogate', 'truncated',\n"
+            "                              'continuation', 'toolarge' or 'any',\n"
+            "                              mixed according to weights W.\n"
+            "  '\\z{RATIO[,SIZE[K]]}'      - SIZE bytes (default 4096) of binary data that\n"
+            "                              compresses by approximately RATIO.\n"
+            "\n");
+
+    printf (
+            "Notes:\n"
+            "\n"
+            "  - Arguments are processed in order.\n"
+            "  - With the exception of '-x', arguments may be repeated any number of times.\n"
+            "  - If <str> is \"\", a nul byte will be displayed.\n"
+            "  - If <repeat> is '-1', repeat forever.\n"
+            "  - Replace the 'Z' in the range formats above with the appropriate characters.\n"
+            "  - Ranges can be either ascending or descending.\n"
+            "  - Numeric sequence values are zero-padded if either value has a\n"
+            "    leading zero. If no separator is specified, the intra-char\n"
+            "    separator (if any) is used between values.\n"
+            "  - Consecutive '--stream' options form a group: each stream displays\n"
+            "    STRING on FD every DELAY, COUNT times (default forever), and the\n"
+            "    group finishes when all its streams have.\n"
+            "  - Malformed escapes are displayed uninterpreted unless '--strict'\n"
+            "    is specified.\n"
+            "  - <delay> can take the following forms where <num> is a positive integer:\n"
+            "\n"
+            "      <num>ns : nano-seconds (1/1,000,000,000 second)\n"
+            "      <num>us : micro-seconds (1/1,000,000 second)\n"
+            "      <num>ms : milli-seconds (1/1,000 second)\n"
+            "      <num>cs : centi-seconds (1/100 second)\n"
+            "      <num>ds : deci-seconds (1/10 second)\n"
+            "      <num>s  : seconds\n"
+            "      <num>m  : minutes\n"
+            "      <num>h  : hours\n"
+            "      <num>d  : days\n"
+            "      <num>   : seconds\n"
+            "\n"
+            "    If <num> is -1, wait until any signal is received.\n"
+            "    if signal is SIGNUM continue, else exit immediately.\n"
+            "  - Generated printable random characters will not display\n"
+            "    unless you are using an appropriate font.\n"
+            "\n");
+}
+
+
+/**
+ * open_terminal:
+ *
+ * Open terminal device.
+ *
+ * Returns: -1 on error, or fd associated with terminal.
+ **/
+int
+open_terminal (void)
+{
+    return open (_PATH_TTY, O_RDWR);
+}
+
+/* default number of bytes written by each terminal benchmark workload */
+#define TERM_BENCH_BUDGET     (16 * 1024 * 1024)
+
+/* milli-seconds to wait for the terminal to answer a status report */
+#define TERM_BENCH_TIMEOUT    10000
+
+/* columns and rows the workloads are designed for */
+#define TERM_BENCH_COLUMNS    80
+#define TERM_BENCH_ROWS       24
+
+/* no reply was received to a status report */
+#define TERM_BENCH_NO_REPLY   UINT64_MAX
+
+/**
+ * term_wchar:
+ *
+ * @buffer: buffer,
+ * @len: number of bytes used in @buffer,
+ * @wc: wide character to append.
+ *
+ * Append the multi-byte form of @wc to @buffer, which must have space
+ * for MB_CUR_MAX bytes. Characters that the locale cannot represent
+ * are ignored.
+ **/
+static void
+term_wchar (char *buffer, size_t *len, wchar_t wc)
+{
+    size_t  n;
+
+    n = wcrtomb (buffer + *len, wc, NULL);
+    if (n != (size_t)-1)
+        *len += n;
+}
+
+/**
+ * term_fill_ascii:
+ *
+ * @buffer: buffer,
+ * @line: line number.
+ *
+ * Write a line of printable ASCII to @buffer, starting at a different
+ * character on each line such that the screen scrolls continuously.
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+term_fill_ascii (char *buffer, unsigned long line)
+{
+    size_t  len = 0;
+    int     i;
+
+    for (i = 0; i < TERM_BENCH_COLUMNS; i++)
+        buffer[len++] = (char)(' ' + 1 + ((line + i) % 94));
+
+    buffer[len++] = '\n';
+
+    return len;
+}
+
+/**
+ * term_fill_sgr:
+ *
+ * @buffer: buffer,
+ * @line: line number.
+ *
+ * Write a line of characters to @buffer, each with a different
+ * 256-colour foreground and background.
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+term_fill_sgr (char *buffer, unsigned long line)
+{
+    size_t  len = 0;
+    int     i;
+
+    for (i = 0; i < TERM_BENCH_COLUMNS; i++) {
+        len += (size_t)sprintf (buffer + len, "\033[38;5;%d;48;5;%dm%c",
+                (int)((line + i) % 256), (int)((line * 7 + i) % 256),
+                'A' + (int)((line + i) % 26));
+    }
+
+    len += (size_t)sprintf (buffer + len, "\033[0m\n");
+
+    return len;
+}
+
+/**
+ * term_fill_cjk:
+ *
+ * @buffer: buffer,
+ * @line: line number.
+ *
+ * Write a line of double-width CJK ideographs to @buffer.
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+term_fill_cjk (char *buffer, unsigned long line)
+{
+    size_t  len = 0;
+    int     i;
+
+    for (i = 0; i < TERM_BENCH_COLUMNS / 2; i++)
+        term_wchar (buffer, &len,
+                (wchar_t)(0x4e00 + ((line * 40 + i) % 0x5200)));
+
+    buffer[len++] = '\n';
+
+    return len;
+}
+
+/**
+ * term_fill_braille:
+ *
+ * @buffer: buffer,
+ * @line: line number.
+ *
+ * Write a line of braille patterns to @buffer.
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+term_fill_braille (char *buffer, unsigned long line)
+{
+    size_t  len = 0;
+    int     i;
+
+    for (i = 0; i < TERM_BENCH_COLUMNS; i++)
+        term_wchar (buffer, &len, (wchar_t)(0x2800 + ((line + i) % 256)));
+
+    buffer[len++] = '\n';
+
+    return len;
+}
+
+/**
+ * term_fill_combining:
+ *
+ * @buffer: buffer,
+ * @line: line number.
+ *
+ * Write a line of letters to @buffer, each followed by two combining
+ * diacritical marks.
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+term_fill_combining (char *buffer, unsigned long line)
+{
+    size_t  len = 0;
+    int     i;
+
+    for (i = 0; i < TERM_BENCH_COLUMNS; i++) {
+        buffer[len++] = (char)('a' + ((line + i) % 26));
+        term_wchar (buffer, &len, (wchar_t)(0x0300 + ((line + i) % 0x70)));
+        term_wchar (buffer, &len, (wchar_t)(0x0300 + ((line * 3 + i) % 0x70)));
+    }
+
+    buffer[len++] = '\n';
+
+    return len;
+}
+
+/**
+ * term_fill_cursor:
+ *
+ * @buffer: buffer,
+ * @line: line number.
+ *
+ * Write a line's worth of characters to @buffer, each at a random
+ * position on the screen.
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+term_fill_cursor (char *buffer, unsigned long line)
+{
+    size_t    len = 0;
+    uint64_t  r;
+    int       i;
+
+    for (i = 0; i < TERM_BENCH_COLUMNS; i++) {
+        r = get_random_u64 ();
+        len += (size_t)sprintf (buffer + len, "\033[%d;%dH%c",
+                (int)(r % TERM_BENCH_ROWS) + 1,
+                (int)((r >> 16) % TERM_BENCH_COLUMNS) + 1,
+                'A' + (int)((line + i) % 26));
+    }
+
+    return len;
+}
+
+/**
+ * struct term_workload:
+ *
+ * @name: name of workload,
+ * @fill: function that writes a line of the workload to a buffer
+ *  (which must have space for TERM_BENCH_LINE_MAX bytes).
+ **/
+struct term_workload {
+    const char  *name;
+    size_t     (*fill) (char *buffer, unsigned long line);
+};
+
+/* maximum number of bytes a workload writes per line */
+#define TERM_BENCH_LINE_MAX   (TERM_BENCH_COLUMNS * 32)
+
+static const struct term_workload term_workloads[] = {
+    { "ascii",     term_fill_ascii     },
+    { "sgr",       term_fill_sgr       },
+    { "cjk",       term_fill_cjk       },
+    { "braille",   term_fill_braille   },
+    { "combining", term_fill_combining },
+    { "cursor",    term_fill_cursor    },
+};
+
+#define TERM_WORKLOADS \
+    (sizeof (term_workloads) / sizeof (term_workloads[0]))
+
+/**
+ * struct term_result:
+ *
+ * @bytes: number of bytes written,
+ * @elapsed: nano-seconds from the first write until the terminal
+ *  answered the status report that followed the last,
+ * @latency: nano-seconds from the last write until that answer,
+ * @idle: nano-seconds the terminal took to answer a status report
+ *  before the workload was written.
+ **/
+struct term_result {
+    uint64_t  bytes;
+    uint64_t  elapsed;
+    uint64_t  latency;
+    uint64_t  idle;
+};
+
+/* settings of the terminal before the benchmark changed them */
+static struct termios  term_saved;
+static int             term_saved_fd = -1;
+
+/**
+ * restore_terminal:
+ *
+ * Restore the settings of the terminal used for benchmarking.
+ **/
+static void
+restore_terminal (void)
+{
+    if (term_saved_fd < 0)
+        return;
+
+    (void)tcsetattr (term_saved_fd, TCSAFLUSH, &term_saved);
+    term_saved_fd = -1;
+}
+
+/**
+ * term_round_trip:
+ *
+ * @fd: terminal file descriptor.
+ *
+ * Request a cursor position report from the terminal and wait for
+ * it. Since the terminal answers requests in order, the answer
+ * arrives once all earlier output has been processed.
+ *
+ * Returns: nano-seconds until the answer arrived, or
+ * TERM_BENCH_NO_REPLY.
+ **/
+static uint64_t
+term_round_trip (int fd)
+{
+    struct pollfd  pfd;
+    uint64_t       start;
+    char           c;
+    ssize_t        ret;
+
+    (void)tcflush (fd, TCIFLUSH);
+
+    start = monotonic_ns ();
+
+    if (write_fd (fd, "\033[6n", 4) < 0)
+        die ("failed to write to terminal");
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    /* the answer is of the form "ESC [ row ; column R" */
+    while (1) {
+        ret = poll (&pfd, 1, TERM_BENCH_TIMEOUT);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return TERM_BENCH_NO_REPLY;
+
+        ret = read (fd, &c, 1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return TERM_BENCH_NO_REPLY;
+
+        if (c == 'R')
+            return monotonic_ns () - start;
+    }
+}
+
+/**
+ * term_report:
+ *
+ * @name: name of workload,
+ * @result: measurements.
+ *
+ * Write @result to standard error, as JSON if '--stats=json' was
+ * specified.
+ **/
+static void
+term_report (const char *name, const struct term_result *result)
+{
+    char    buffer[512];
+    char    latency[32];
+    char    idle[32];
+    double  seconds = (double)result->elapsed / 1e9;
+    double  rate = seconds > 0 ? (double)result->bytes / seconds : 0;
+    int     json = stats_format == STATS_JSON;
+    int     len;
+
+    if (result->latency == TERM_BENCH_NO_REPLY)
+        snprintf (latency, sizeof (latency), json ? "null" : "none");
+    else if (json)
+        snprintf (latency, sizeof (latency), "%llu",
+                (unsigned long long)result->latency);
+    else
+        snprintf (latency, sizeof (latency), "%.3fms",
+                (double)result->latency / 1e6);
+
+    if (result->idle == TERM_BENCH_NO_REPLY)
+        snprintf (idle, sizeof (idle), json ? "null" : "none");
+    else if (json)
+        snprintf (idle, sizeof (idle), "%llu",
+                (unsigned long long)result->idle);
+    else
+        snprintf (idle, sizeof (idle), "%.3fms",
+                (double)result->idle / 1e6);
+
+    if (json)
+        len = snprintf (buffer, sizeof (buffer),
+                "{\"workload\": \"%s\", \"bytes\": %llu, "
+                "\"elapsed_ns\": %llu, \"bytes_per_second\": %.0f, "
+                "\"completion_latency_ns\": %s, "
+                "\"idle_round_trip_ns\": %s}\n",
+                name, (unsigned long long)result->bytes,
+                (unsigned long long)result->elapsed, rate, latency, idle);
+    else
+        len = snprintf (buffer, sizeof (buffer),
+                "term-bench %s: %llu bytes in %.3fs (%.1f MiB/s),"
+                " completion latency %s, idle round trip %s\n",
+                name, (unsigned long long)result->bytes, seconds,
+                rate / (1024 * 1024), latency, idle);
+
+    if (len > 0 && write (STDERR_FILENO, buffer, (size_t)len) < 0)
+        return;
+}
+
+/**
+ * run_term_bench:
+ *
+ * @spec: comma-separated workload names and 'budget=SIZE' (or NULL).
+ *
+ * Measure the rate at which the terminal processes each workload in
+ * @spec (default all) by writing at least SIZE bytes (default
+ * TERM_BENCH_BUDGET) of it and waiting for the terminal to answer a
+ * status report, then display the results on standard error.
+ **/
+void
+run_term_bench (const char *spec)
+{
+    struct term_result  results[TERM_WORKLOADS];
+    struct termios      raw;
+    uint64_t            budget = TERM_BENCH_BUDGET;
+    uint64_t            start;
+    uint64_t            sent;
+    unsigned long       line;
+    unsigned int        selected = 0;
+    int                 answers = 1;
+    char                copy[OPTIONS_MAX];
+    char               *chunk;
+    char               *item;
+    char               *saveptr = NULL;
+    size_t              len;
+    size_t              n;
+    size_t              i;
+    int                 fd;
+
+    if (spec) {
+        copy_options (copy, spec, "terminal benchmark");
+
+        for (item = strtok_r (copy, ",", &saveptr); item;
+                item = strtok_r (NULL, ",", &saveptr)) {
+            if (! strncmp (item, "budget=", 7)) {
+                budget = parse_size (item + 7);
+                if (! budget)
+                    die ("invalid terminal benchmark budget '%s'", item + 7);
+                continue;
+            }
+
+            for (i = 0; i < TERM_WORKLOADS; i++) {
+                if (! strcmp (item, term_workloads[i].name))
+                    break;
+            }
+
+            if (i == TERM_WORKLOADS)
+                die ("invalid terminal benchmark workload '%s'", item);
+
+            selected |= 1U << i;
+        }
+    }
+
+    if (! selected)
+        selected = (1U << TERM_WORKLOADS) - 1;
+
+    fd = tty_fd >= 0 ? tty_fd : open_terminal ();
+    if (fd < 0)
+        die ("failed to open terminal");
+
+    /* earlier output may be destined for the terminal */
+    flush_output ();
+    flush_targets (0);
+
+    if (tcgetattr (fd, &term_saved) < 0)
+        die ("failed to read terminal settings");
+
+    if (utfout_atexit (restore_terminal))
+        die ("failed to register terminal handler");
+
+    term_saved_fd = fd;
+
+    /* status reports must be readable without echoing them */
+    raw = term_saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    if (tcsetattr (fd, TCSAFLUSH, &raw) < 0)
+        die ("failed to change terminal settings");
+
+    chunk = malloc (OUTPUT_BUFSIZE);
+    if (! chunk)
+        die ("failed to allocate space for terminal benchmark");
+
+    for (i = 0; i < TERM_WORKLOADS; i++) {
+        if (! (selected & (1U << i)))
+            continue;
+
+        /* a chunk of whole lines is written repeatedly */
+        len = 0;
+        for (line = 0; len + TERM_BENCH_LINE_MAX <= OUTPUT_BUFSIZE; line++) {
+            n = term_workloads[i].fill (chunk + len, line);
+            if (n <= 1)
+                die ("workload '%s' cannot be displayed in this locale",
+                        term_workloads[i].name);
+            len += n;
+        }
+
+        if (write_fd (fd, "\033[0m\033[H\033[2J", 10) < 0)
+            die ("failed to write to terminal");
+
+        /* don't wait for a terminal that has never answered */
+        results[i].idle = answers ? term_round_trip (fd)
+            : TERM_BENCH_NO_REPLY;
+        if (results[i].idle == TERM_BENCH_NO_REPLY)
+            answers = 0;
+
+        results[i].bytes = 0;
+
+        start = monotonic_ns ();
+
+        /* whole chunks, so no escape sequence is left incomplete */
+        while (results[i].bytes < budget) {
+            if (write_fd (fd, chunk, len) < 0)
+                die ("failed to write to terminal");
+
+            results[i].bytes += len;
+        }
+
+        /* leave the terminal in a known state before measuring */
+        if (write_fd (fd, "\033[0m", 4) < 0)
+            die ("failed to write to terminal");
+
+        sent = monotonic_ns ();
+
+        results[i].latency = answers ? term_round_trip (fd)
+            : TERM_BENCH_NO_REPLY;
+        results[i].elapsed = sent - start;
+
+        if (results[i].latency != TERM_BENCH_NO_REPLY)
+            results[i].elapsed += results[i].latency;
+    }
+
+    free (chunk);
+
+    if (write_fd (fd, "\033[0m\033[H\033[2J", 10) < 0)
+        die ("failed to write to terminal");
+
+    restore_terminal ();
+
+    for (i = 0; i < TERM_WORKLOADS; i++) {
+        if (selected & (1U << i))
+            term_report (term_workloads[i].name, &results[i]);
+    }
+}
+
+/**
+ * compile_string:
+ *
+ * @insn: instruction to initialise,
+ * @fd: file descriptor to write output to,
+ * @str: string to display,
+ * @count: number of times to display @str (-1 for no limit),
+ * @delay: nano-seconds to pause between characters (or NULL),
+ * @separator_specified: TRUE if a separator value has been specified,
+ * @separator: separator to use.
+ *
+ * Compile an OP_EMIT instruction for @str, lexing it (and rendering
+ * it if possible) once regardless of how often it is displayed.
+ **/
+void
+compile_string (struct instruction  *insn,
+                int                  fd,
+                const char          *str,
+                int                  count,
+                const int64_t       *delay,
+                int                  separator_specified,
+                int                  separator)
+{
+    assert (insn);
+    assert (str);
+
+    memset (insn, 0, sizeof (struct instruction));
+
+    insn->op = OP_EMIT;
+    insn->count = count < 0 ? -1 : count;
+    insn->fd = fd;
+    insn->separator_specified = separator_specified;
+    insn->separator = separator;
+
+    if (delay) {
+        insn->delay = *delay;
+        insn->delayed = 1;
+    }
+
+    pending_insn = insn;
+
+    lex_string (str, &insn->lexed);
+
+    if (! delay)
+        prerender_string (&insn->lexed, separator_specified, separator);
+}
+
+/**
+ * render_wchar:
+ *
+ * @rendered: buffer of OUTPUT_BUFSIZE bytes,
+ * @len: number of bytes used in @rendered (updated),
+ * @wc: character to append.
+ *
+ * Returns: FALSE if @rendered is full.
+ **/
+static int
+render_wchar (char *rendered, size_t *len, wchar_t wc)
+{
+    char    buffer[8];
+    size_t  n;
+
+    n = wcrtomb (buffer, wc, NULL);
+    if (n == (size_t)-1)
+        return 1;
+
+    if (*len + n > OUTPUT_BUFSIZE)
+        return 0;
+
+    memcpy (rendered + *len, buffer, n);
+    *len += n;
+
+    return 1;
+}
+
+/**
+ * prerender_string:
+ *
+ * @lexed: lexed string,
+ * @separator_specified: TRUE if a separator value has been specified,
+ * @separator: separator to use.
+ *
+ * If @lexed only contains literals, escaped characters and character
+ * ranges, render it once (as emit_tokens() would) such that displaying
+ * it just copies the result. Must not be used for strings displayed
+ * with an inter-character delay.
+ **/
+void
+prerender_string (struct lexed_string  *lexed,
+                  int                   separator_specified,
+                  int                   separator)
+{
+    const struct token  *token;
+    char                *rendered;
+    size_t               len = 0;
+    size_t               t;
+    size_t               i;
+    wchar_t              wc;
+    int                  direction;
+    int                  separate;
+
+    assert (lexed);
+
+    for (t = 0; t < lexed->count; t++) {
+        switch (lexed->tokens[t].type) {
+            case TOKEN_LITERAL:
+            case TOKEN_CHAR:
+            case TOKEN_RANGE:
+            case TOKEN_BYTES:
+                break;
+
+            default:
+                return;
+        }
+    }
+
+    rendered = malloc (OUTPUT_BUFSIZE);
+    if (! rendered)
+        die ("failed to allocate space for string");
+
+    separate = separator_specified && lexed->len > 1;
+
+    for (t = 0; t < lexed->count; t++) {
+        token = &lexed->tokens[t];
+
+        switch (token->type) {
+
+            case TOKEN_LITERAL:
+                if (! separate) {
+                    if (len + token->byte_len > OUTPUT_BUFSIZE)
+                        goto discard;
+
+                    memcpy (rendered + len, lexed->bytes + token->byte_offset,
+                            token->byte_len);
+                    len += token->byte_len;
+                    break;
+                }
+
+                for (i = token->offset; i < token->offset + token->len; i++) {
+                    if (! render_wchar (rendered, &len, lexed->wstr[i])
+                            || ! render_wchar (rendered, &len, separator))
+                        goto discard;
+                }
+                break;
+
+            case TOKEN_CHAR:
+                if (! render_wchar (rendered, &len, token->start))
+                    goto discard;
+
+                if (separate && token->separate
+                        && ! render_wchar (rendered, &len, separator))
+                    goto discard;
+                break;
+
+            case TOKEN_RANGE:
+                direction = (token->start < token->end) ? +1 : -1;
+
+                for (wc = token->start; ; wc += direction) {
+                    if (! render_wchar (rendered, &len, wc))
+                        goto discard;
+
+                    if (wc == token->end)
+                        break;
+
+                    if (separator_specified
+                            && ! render_wchar (rendered, &len, separator))
+                        goto discard;
+                }
+                break;
+
+            case TOKEN_BYTES:
+                for (i = 0; i < token->byte_len; i++) {
+                    if (len == OUTPUT_BUFSIZE)
+                        goto discard;
+
+                    rendered[len++] = lexed->bytes[token->byte_offset + i];
+
+                    if (separate && ! render_wchar (rendered, &len, separator))
+                        goto discard;
+                }
+                break;
+
+            default:
+                assert (0);
+        }
+    }
+
+    lexed->rendered = rendered;
+    lexed->rendered_len = len;
+    return;
+
+discard:
+    /* too large to be worth keeping */
+    free (rendered);
+}
+
+/**
+ * add_instruction:
+ *
+ * @block: block being compiled (or NULL),
+ * @insn: instruction.
+ *
+ * Append @insn to @block, taking ownership of its contents. Outside a
+ * block, @insn is run immediately and then freed.
+ **/
+void
+add_instruction (struct program *block, struct instruction *insn)
+{
+    struct instruction  *code;
+
+    assert (insn);
+
+    pending_insn = insn;
+
+    if (! block) {
+        run_instruction (insn);
+        free_instruction (insn);
+        pending_insn = NULL;
+        return;
+    }
+
+    if (block->count == block->size) {
+        size_t  size = block->size ? block->size * 2 : 16;
+
+        code = realloc (block->code, size * sizeof (struct instruction));
+        if (! code)
+            die ("failed to allocate space for block");
+
+        block->code = code;
+        block->size = size;
+    }
+
+    block->code[block->count++] = *insn;
+    pending_insn = NULL;
+}
+
+/**
+ * run_emit:
+ *
+ * @insn: OP_EMIT instruction.
+ *
+ * Display the string of @insn the required number of times.
+ **/
+static void
+run_emit (const struct instruction *insn)
+{
+    const int64_t  *delay = insn->delayed ? &insn->delay : NULL;
+    int             count = insn->count;
+    uint64_t        before;
+    uint64_t        length;
+    uint64_t        skip;
+    int             fixed;
+    struct shaper   shaper;
+
+    fixed = window.start && count != 1 && ! insn->profile
+        && lexed_fixed_length (&insn->lexed);
+
+    if (skip_repeats) {
+        /* the random content of a display only depends on how many
+         * came before it, so skipped displays need not be generated.
+         */
+        skip = skip_repeats;
+        if (count != -1 && skip > (uint64_t)count)
+            skip = (uint64_t)count;
+
+        random_state.emission += skip;
+        skip_repeats -= skip;
+
+        if (count != -1) {
+            count -= (int)skip;
+            if (! count)
+                return;
+        }
+    }
+
+    if (insn->profile)
+        start_shaper (&shaper, insn->profile);
+
+    while (count) {
+        if (insn->profile && ! shape_next (&shaper))
+            break;
+
+        before = window.offset + output.len;
+
+        emit_tokens (insn->fd, &insn->lexed, delay,
+                insn->separator_specified, insn->separator);
+
+        if (count != -1) {
+            count--;
+            if (! count)
+                break;
+        }
+
+        if (! fixed)
+            continue;
+
+        /* every repeat is the same length, so jump straight to the
+         * first one inside the output window.
+         */
+        fixed = 0;
+        length = window.offset + output.len - before;
+
+        if (! length || before + length >= window.start)
+            continue;
+
+        skip = (window.start - before - length) / length;
+        if (count != -1 && skip > (uint64_t)count)
+            skip = (uint64_t)count;
+
+        flush_output ();
+        window.offset += skip * length;
+        random_state.emission += skip;
+
+        if (count != -1)
+            count -= (int)skip;
+    }
+}
+
+/**
+ * run_instruction:
+ *
+ * @insn: instruction.
+ *
+ * Perform the operation of @insn.
+ **/
+void
+run_instruction (const struct instruction *insn)
+{
+    struct shaper  shaper;
+    int            count;
+
+    assert (insn);
+
+    switch (insn->op) {
+
+        case OP_EMIT:
+            run_emit (insn);
+            break;
+
+        case OP_SLEEP:
+            sleep_for (insn->delay);
+            break;
+
+        case OP_BLOCK:
+            count = insn->count;
+
+            if (insn->profile)
+                start_shaper (&shaper, insn->profile);
+
+            while (count) {
+                if (insn->profile && ! shape_next (&shaper))
+                    break;
+
+                run_program (insn->block);
+
+                if (count > 0)
+                    count--;
+            }
+            break;
+
+        case OP_EXIT:
+            finish_output ();
+            utfout_exit (insn->status);
+            break;
+    }
+}
+
+/**
+ * run_program:
+ *
+ * @program: program.
+ *
+ * Run each instruction of @program in turn.
+ **/
+void
+run_program (const struct program *program)
+{
+    const struct instruction  *insn;
+    const struct instruction  *end;
+
+    assert (program);
+
+    for (insn = program->code, end = insn + program->count; insn < end; insn++)
+        run_instruction (insn);
+}
+
+/**
+ * free_instruction:
+ *
+ * @insn: instruction.
+ *
+ * Free the contents of @insn.
+ **/
+void
+free_instruction (struct instruction *insn)
+{
+    assert (insn);
+
+    if (insn->op == OP_EMIT)
+        free_lexed_string (&insn->lexed);
+    else if (insn->op == OP_BLOCK)
+        release_program (insn->block);
+
+    memset (insn, 0, sizeof (struct instruction));
+}
+
+/**
+ * release_program:
+ *
+ * @program: program (or NULL).
+ *
+ * Drop a reference to @program, freeing it once unused.
+ **/
+void
+release_program (struct program *program)
+{
+    size_t  i;
+
+    if (! program || --program->refs > 0)
+        return;
+
+    for (i = 0; i < program->count; i++)
+        free_instruction (&program->code[i]);
+
+    free (program->code);
+    free (program);
+}
+
+/**
+ * add_token:
+ *
+ * @lexed: lexed string,
+ * @type: type of token,
+ * @offset: position of token in wide string.
+ *
+ * Append a new token to @lexed.
+ *
+ * Returns: newly-added token.
+ **/
+static struct token *
+add_token (struct lexed_string  *lexed,
+           enum token_type       type,
+           size_t                offset)
+{
+    struct token  *token;
+
+    if (lexed->count == lexed->size) {
+        size_t  size = lexed->size ? lexed->size * 2 : 16;
+
+        token = realloc (lexed->tokens, size * sizeof (struct token));
+        if (! token)
+            die ("failed to allocate space for tokens");
+
+        lexed->tokens = token;
+        lexed->size = size;
+    }
+
+    token = &lexed->tokens[lexed->count++];
+
+    memset (token, 0, sizeof (struct token));
+    token->type = type;
+    token->offset = offset;
+    token->separate = 1;
+
+    return token;
+}
+
+/**
+ * byte_token:
+ *
+ * @lexed: lexed string,
+ * @offset: position of escape in wide string.
+ *
+ * Returns: TOKEN_BYTES token that bytes appended to @lexed->bytes
+ * belong to, extending the previous token if it is also raw bytes.
+ **/
+static struct token *
+byte_token (struct lexed_string *lexed, size_t offset)
+{
+    struct token  *token;
+
+    if (lexed->count) {
+        token = &lexed->tokens[lexed->count - 1];
+
+        if (token->type == TOKEN_BYTES
+                && token->byte_offset + token->byte_len == lexed->bytes_len)
+            return token;
+    }
+
+    token = add_token (lexed, TOKEN_BYTES, offset);
+    token->byte_offset = lexed->bytes_len;
+
+    return token;
+}
+
+/**
+ * lex_error:
+ *
+ * @str: multi-byte string being lexed,
+ * @offset: position of offending character in wide string,
+ * @reason: description of problem.
+ *
+ * Report a malformed escape and exit.
+ **/
+static void
+lex_error (const char *str, size_t offset, const char *reason)
+{
+    die ("%s at character %lu of '%s'", reason,
+            (unsigned long)offset + 1, str);
+}
+
+/**
+ * lex_string:
+ *
+ * @str: multi-byte string to tokenize,
+ * @lexed: lexed string to fill in.
+ *
+ * Convert @str to a wide string and tokenize it in a single pass
+ * into literal runs, escaped characters, ranges, random characters
+ * and stop requests. Any number of contiguous escape prefix
+ * characters are collapsed into a single one.
+ *
+ * A malformed escape is displayed uninterpreted unless strict mode
+ * is enabled, in which case it is reported (along with its position)
+ * and the program exits.
+ *
+ * The caller must call free_lexed_string() on @lexed.
+ **/
+void
+lex_string (const char *str, struct lexed_string *lexed)
+{
+    const struct escape_spec  *spec;
+    struct token              *token;
+    wchar_t                   *wstr;
+    const char                *p;
+    size_t                     len;
+    size_t                     i;
+    wchar_t                    c;
+
+    /* If -1, not in escape mode, else set to the position in the
+     * string the escape char was seen at.
+     */
+    ssize_t                    escape = -1;
+
+    assert (str);
+    assert (lexed);
+
+    memset (lexed, 0, sizeof (struct lexed_string));
+
+    DTRACE_PROBE1 (utfout, parse__start, str);
+
+    /* special case nul string */
+    if (*str == '\0') {
+        token = add_token (lexed, TOKEN_CHAR, 0);
+        token->start = L'\0';
+        DTRACE_PROBE2 (utfout, parse__end, str, lexed->count);
+        return;
+    }
+
+    /* convert multi-byte (UTF-8) string into wide
+     * character string for easier internal handling.
+     */
+    p = str;
+    len = mbsrtowcs (NULL, &p, 0, NULL);
+    if (len == (size_t)-1)
+        die ("failed to determine length of wide string");
+
+    /* include space for terminator */
+    wstr = calloc (len + 1, sizeof (wchar_t));
+    if (! wstr)
+        die ("failed to allocate space for wide string '%s'", str);
+
+    p = str;
+
+    /* mbsrtowcs () doesn't include the terminator
+     * in the return value
+     */
+    if (mbsrtowcs (wstr, &p, len, NULL) != len)
+        die ("failed to convert string '%s' to wide string", str);
+
+    lexed->wstr = wstr;
+    lexed->len = len;
+
+    /* literal runs are also stored in multi-byte form */
+    lexed->bytes = malloc ((len * MB_CUR_MAX) + 1);
+    if (! lexed->bytes)
+        die ("failed to allocate space for string '%s'", str);
+
+    i = 0;
+
+    while (i < len) {
+        c = wstr[i];
+
+        if (escape == -1) {
+            size_t  start = i;
+
+            if (c == escape_prefix && ! disable_escapes) {
+                escape = i++;
+                continue;
+            }
+
+            /* consume a run of literal characters */
+            while (i < len && (disable_escapes || wstr[i] != escape_prefix))
+                i++;
+
+            token = add_token (lexed, TOKEN_LITERAL, start);
+            token->len = i - start;
+            token->byte_offset = lexed->bytes_len;
+
+            for (; start < i; start++) {
+                size_t  ret = wcrtomb (lexed->bytes + lexed->bytes_len,
+                        wstr[start], NULL);
+
+                if (ret != (size_t)-1)
+                    lexed->bytes_len += ret;
+            }
+
+            token->byte_len = lexed->bytes_len - token->byte_offset;
+            continue;
+        }
+
+        if (c == escape_prefix) {
+            /* collapse contiguous escape characters */
+            escape = i++;
+            continue;
+        }
+
+        escape = -1;
+
+        spec = get_escape_spec (c);
+
+        switch (spec->kind) {
+
+            case ESCAPE_SIMPLE:
+                token = add_token (lexed, TOKEN_CHAR, i++);
+                token->start = spec->value;
+                break;
+
+            case ESCAPE_NUMERIC:
+                {
+                    unsigned long  value = 0;
+                    int            digits = 0;
+                    int            d;
+                    size_t         start = i++;
+
+                    while (digits < spec->digits && i < len
+                            && (d = digit_value (wstr[i], spec->flags)) >= 0) {
+                        value = (value * spec->base) + d;
+                        digits++;
+                        i++;
+                    }
+
+                    if (! digits && strict)
+                        lex_error (str, i, "expected digits for escape");
+
+                    /* '\x' and '\o' (but not '\u' and '\U') are bytes */
+                    if (bytes_mode && digits && spec->digits <= 3
+                            && value <= 0xff) {
+                        token = byte_token (lexed, start);
+                        lexed->bytes[lexed->bytes_len++] = (char)value;
+                        token->byte_len++;
+                        token->len++;
+                        break;
+                    }
+
+                    token = add_token (lexed, TOKEN_CHAR, start);
+                    token->start = (wchar_t)value;
+                }
+                break;
+
+            case ESCAPE_RANGE:
+                {
+                    struct sequence  seq;
+                    wchar_t          start;
+                    wchar_t          end;
+                    size_t           consumed;
+                    size_t           error;
+                    size_t           seq_error;
+
+                    consumed = lex_sequence (wstr+i, len-i, &seq, &seq_error);
+                    if (consumed) {
+                        token = add_token (lexed, TOKEN_SEQUENCE, i);
+                        token->seq = malloc (sizeof (struct sequence));
+                        if (! token->seq)
+                            die ("failed to allocate space for sequence");
+                        *token->seq = seq;
+                        i += consumed;
+                        break;
+                    }
+
+                    consumed = lex_range (wstr+i, len-i, &start, &end, &error);
+                    if (! consumed) {
+                        /* report whichever form matched furthest */
+                        if (strict)
+                            lex_error (str, i + (seq_error > error
+                                        ? seq_error : error),
+                                    "invalid range escape");
+                        goto not_an_escape;
+                    }
+
+                    token = add_token (lexed, TOKEN_RANGE, i);
+                    token->start = start;
+                    token->end = end;
+
+                    /* jump over the already-handled pattern */
+                    i += consumed;
+                }
+                break;
+
+            case ESCAPE_RANDOM:
+                add_token (lexed, TOKEN_RANDOM, i++);
+                break;
+
+            case ESCAPE_STOP:
+                add_token (lexed, TOKEN_STOP, i++);
+                break;
+
+            case ESCAPE_TIME:
+            case ESCAPE_ELAPSED:
+                {
+                    struct time_format  *tf;
+                    size_t               consumed;
+                    size_t               error;
+
+                    tf = malloc (sizeof (struct time_format));
+                    if (! tf)
+                        die ("failed to allocate space for time format");
+
+                    consumed = lex_time (wstr+i+1, len-i-1,
+                            spec->kind == ESCAPE_ELAPSED, tf, &error);
+                    if (! consumed) {
+                        free (tf);
+                        if (strict)
+                            lex_error (str, i + 1 + error,
+                                    "invalid time escape");
+                        goto not_an_escape;
+                    }
+
+                    token = add_token (lexed, TOKEN_TIME, i);
+                    token->time = tf;
+
+                    i += 1 + consumed;
+                }
+                break;
+
+            case ESCAPE_WORD:
+                {
+                    struct word_source  ws;
+                    size_t              consumed;
+                    size_t              error;
+
+                    consumed = lex_word (wstr+i+1, len-i-1, &ws, &error);
+                    if (! consumed) {
+                        if (strict)
+                            lex_error (str, i + 1 + error,
+                                    "invalid word escape");
+                        goto not_an_escape;
+                    }
+
+                    token = add_token (lexed, TOKEN_WORD, i);
+                    token->words = malloc (sizeof (struct word_source));
+                    if (! token->words)
+                        die ("failed to allocate space for word escape");
+                    *token->words = ws;
+
+                    i += 1 + consumed;
+                }
+                break;
+
+            case ESCAPE_MALFORMED:
+                {
+                    struct malformed  m;
+                    size_t            consumed;
+                    size_t            error;
+
+                    consumed = lex_malformed (wstr+i+1, len-i-1, &m, &error);
+                    if (! consumed) {
+                        if (strict)
+                            lex_error (str, i + 1 + error,
+                                    "invalid malformed escape");
+                        goto not_an_escape;
+                    }
+
+                    token = add_token (lexed, TOKEN_MALFORMED, i);
+                    token->malformed = malloc (sizeof (struct malformed));
+                    if (! token->malformed)
+                        die ("failed to allocate space for malformed escape");
+                    *token->malformed = m;
+
+                    i += 1 + consumed;
+                }
+                break;
+
+            case ESCAPE_COMPRESSIBLE:
+                {
+                    struct compressible  z;
+                    size_t               consumed;
+                    size_t               error;
+
+                    consumed = lex_compressible (wstr+i+1, len-i-1,
+                            &z, &error);
+                    if (! consumed) {
+                        if (strict)
+                            lex_error (str, i + 1 + error,
+                                    "invalid compressible data escape");
+                        goto not_an_escape;
+                    }
+
+                    token = add_token (lexed, TOKEN_COMPRESSIBLE, i);
+                    token->compressible = malloc (sizeof (struct compressible));
+                    if (! token->compressible)
+                        die ("failed to allocate space for compressible "
+                                "data escape");
+                    *token->compressible = z;
+
+                    i += 1 + consumed;
+                }
+                break;
+
+            case ESCAPE_BYTES:
+                {
+                    size_t  consumed;
+                    size_t  n;
+                    size_t  error;
+
+                    consumed = lex_bytes (wstr+i+1, len-i-1,
+                            lexed->bytes + lexed->bytes_len, &n, &error);
+                    if (! consumed) {
+                        if (strict)
+                            lex_error (str, i + 1 + error,
+                                    "invalid bytes escape");
+                        goto not_an_escape;
+                    }
+
+                    token = byte_token (lexed, i);
+                    lexed->bytes_len += n;
+                    token->byte_len += n;
+                    token->len += n;
+
+                    i += 1 + consumed;
+                }
+                break;
+
+not_an_escape:
+            default:
+                if (strict)
+                    lex_error (str, i, "unknown escape");
+
+                /* invalid escape, so display escape (and
+                 * subsequent char) uninterpreted.
+                 */
+                token = add_token (lexed, TOKEN_CHAR, i - 1);
+                token->start = escape_prefix;
+                token->separate = 0;
+
+                token = add_token (lexed, TOKEN_CHAR, i++);
+                token->start = c;
+                break;
+        }
+    }
+
+    if (escape != -1 && strict)
+        lex_error (str, escape, "incomplete escape");
+
+    DTRACE_PROBE2 (utfout, parse__end, str, lexed->count);
+}
+
+/**
+ * emit_tokens:
+ *
+ * @fd: file descriptor to write output to,
+ * @lexed: lexed string to display,
+ * @delay: nano-seconds to pause between characters (or NULL),
+ * @separator_specified: TRUE if a separator value has been specified,
+ * @separator: separator to use.
+ *
+ * Write the characters represented by @lexed to @fd, pausing for
+ * @delay between each character. Characters will be interspersed by
+ * @separator if @separator_specified is set (required since a null
+ * byte separator is valid).
+ **/
+void
+emit_tokens (int                         fd,
+             const struct lexed_string  *lexed,
+             const int64_t              *delay,
+             int                         separator_specified,
+             int                         separator)
+{
+    const struct token  *token;
+    size_t               t;
+    size_t               i;
+    int                  separate;
+
+    assert (lexed);
+
+    separate = separator_specified && lexed->len > 1;
+
+    if (clock_update == CLOCK_UPDATE_STRING)
+        clocks.realtime_valid = clocks.monotonic_valid = 0;
+
+    random_state.emission++;
+    random_state.draw = 0;
+
+    DTRACE_PROBE2 (utfout, render__start, fd, lexed->count);
+
+    if (frame.format)
+        frame_begin (fd);
+
+    /* output that never changes was rendered when compiled */
+    if (lexed->rendered)
+        write_output (fd, lexed->rendered, lexed->rendered_len);
+
+    for (t = lexed->rendered ? lexed->count : 0; t < lexed->count; t++) {
+        token = &lexed->tokens[t];
+
+        switch (token->type) {
+
+            case TOKEN_LITERAL:
+                if (! delay && ! separate) {
+                    write_output (fd, lexed->bytes + token->byte_offset,
+                            token->byte_len);
+                    break;
+                }
+
+                for (i = token->offset; i < token->offset + token->len; i++) {
+                    OUT_WCHAR (fd, lexed->wstr[i], delay);
+                    if (separate)
+                        OUT_WCHAR (fd, separator, 0);
+                }
+                break;
+
+            case TOKEN_CHAR:
+                OUT_WCHAR (fd, token->start, delay);
+                if (separate && token->separate)
+                    OUT_WCHAR (fd, separator, 0);
+                break;
+
+            case TOKEN_RANGE:
+                {
+                    wchar_t  wc = token->start;
+                    int      direction;
+
+                    direction = (token->start < token->end) ? +1 : -1;
+
+                    DTRACE_PROBE2 (utfout, range, token->start, token->end);
+
+                    while (1) {
+                        OUT_WCHAR (fd, wc, delay);
+
+                        if (wc == token->end)
+                            break;
+
+                        if (separator_specified)
+                            OUT_WCHAR (fd, separator, 0);
+
+                        wc += direction;
+                    }
+                }
+                break;
+
+            case TOKEN_SEQUENCE:
+                emit_sequence (fd, token->seq, delay,
+                        separator_specified, separator);
+                break;
+
+            case TOKEN_RANDOM:
+                OUT_WCHAR (fd, get_random_char (), delay);
+                if (separate)
+                    OUT_WCHAR (fd, separator, 0);
+                break;
+
+            case TOKEN_STOP:
+                finish_output ();
+                utfout_exit (EXIT_SUCCESS);
+                break;
+
+            case TOKEN_TIME:
+                emit_time (fd, token->time);
+                if (separate)
+                    OUT_WCHAR (fd, separator, 0);
+                if (delay)
+                    sleep_for (*delay);
+                break;
+
+            case TOKEN_WORD:
+                emit_word (fd, token->words);
+                if (separate)
+                    OUT_WCHAR (fd, separator, 0);
+                if (delay)
+                    sleep_for (*delay);
+                break;
+
+            case TOKEN_MALFORMED:
+                emit_malformed (fd, token->malformed);
+                if (separate)
+                    OUT_WCHAR (fd, separator, 0);
+                if (delay)
+                    sleep_for (*delay);
+                break;
+
+            case TOKEN_COMPRESSIBLE:
+                emit_compressible (fd, token->compressible);
+                if (separate)
+                    OUT_WCHAR (fd, separator, 0);
+                if (delay)
+                    sleep_for (*delay);
+                break;
+
+            case TOKEN_BYTES:
+                if (! delay && ! separate) {
+                    write_output (fd, lexed->bytes + token->byte_offset,
+                            token->byte_len);
+                    break;
+                }
+
+                for (i = 0; i < token->byte_len; i++) {
+                    write_output (fd, lexed->bytes + token->byte_offset + i, 1);
+                    pause_char (delay);
+                    if (separate)
+                        OUT_WCHAR (fd, separator, 0);
+                }
+                break;
+        }
+    }
+
+    if (frame.open)
+        frame_end (fd);
+
+    /* each display is a unit of output for the shards or a datagram */
+    if (fd == SHARD_FD && shards.unit == SHARD_REPEAT) {
+        flush_output ();
+        shard_record_end ();
+    } else if (datagrams.unit == DATAGRAM_REPEAT && datagram_socket (fd)) {
+        flush_output ();
+        datagram_end (fd);
+    }
+
+    DTRACE_PROBE1 (utfout, render__end, fd);
+}
+
+/**
+ * free_lexed_string:
+ *
+ * @lexed: lexed string.
+ *
+ * Free memory associated with @lexed.
+ **/
+void
+free_lexed_string (struct lexed_string *lexed)
+{
+    size_t  i;
+
+    assert (lexed);
+
+    for (i = 0; i < lexed->count; i++) {
+        free (lexed->tokens[i].seq);
+        free (lexed->tokens[i].words);
+        free (lexed->tokens[i].malformed);
+        free (lexed->tokens[i].compressible);
+        if (lexed->tokens[i].time)
+            free_time_format (lexed->tokens[i].time);
+    }
+
+    free (lexed->wstr);
+    free (lexed->tokens);
+    free (lexed->bytes);
+    free (lexed->rendered);
+
+    memset (lexed, 0, sizeof (struct lexed_string));
+}
+
+/**
+ * lexed_fixed_length:
+ *
+ * @lexed: lexed string.
+ *
+ * Returns: TRUE if every display of @lexed produces the same number
+ * of bytes.
+ **/
+int
+lexed_fixed_length (const struct lexed_string *lexed)
+{
+    size_t  i;
+
+    assert (lexed);
+
+    for (i = 0; i < lexed->count; i++) {
+        switch (lexed->tokens[i].type) {
+            case TOKEN_LITERAL:
+            case TOKEN_CHAR:
+            case TOKEN_RANGE:
+            case TOKEN_SEQUENCE:
+            case TOKEN_COMPRESSIBLE:
+            case TOKEN_BYTES:
+                break;
+
+            default:
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * signal_handler:
+ *
+ * @signum: signal number passed to this function.
+ *
+ * Handle interrupt signal by simply returning.
+ **/
+void
+signal_handler (int signum)
+{
+    switch (signum)
+    {
+        case SIGINT:
+            return;
+            break;
+
+        default:
+            utfout_exit (EXIT_SUCCESS);
+            break;
+    }
+}
+
+/**
+ * requested_delay:
+ *
+ * @str: string representing an amount of time (see parse_delay()).
+ *
+ * Returns: nano-seconds represented by @str, or -1 to wait for a
+ * signal.
+ **/
+static int64_t
+requested_delay (const char *str)
+{
+    uint64_t  ns;
+
+    return parse_delay (str, &ns) < 0 ? -1 : (int64_t)ns;
+}
+
+/**
+ * parse_delay:
+ *
+ * @str: string representing an amount of time,
+ * @ns: nano-seconds represented by @str.
+ *
+ * Convert @str to nano-seconds. Recognised formats:
+ *
+ *     <num>ns : nano-seconds (1/1,000,000,000 second)
+ *     <num>us : micro-seconds (1/1,000,000 second)
+ *     <num>ms : milli-seconds (1/1,000 second)
+ *     <num>cs : centi-seconds (1/100 second)
+ *     <num>ds : deci-seconds (1/10 second)
+ *     <num>s  : seconds
+ *     <num>m  : minutes
+ *     <num>h  : hours
+ *     <num>h  : days
+ *     <num>   : seconds
+ *
+ * Returns: -1 if <num> is -1 (meaning "until a signal is received"),
+ * else 0.
+ **/
+int
+parse_delay (const char *str, uint64_t *ns)
+{
+    long              secs;
+    size_t            len;
+    unsigned int      multiplier = 0;
+    const char       *posn;
+
+    len = strlen (str);
+    secs = atol (str);
+
+    if (secs == -1)
+        return -1;
+
+    if (secs < 0)
+        secs = 0;
+
+    posn = len >= 2 ? &str[len-2] : str;
+
+    if (strstr (str, "cs") == posn) {
+        /* Centi-seconds:
+         *
+         * 10 ^ (-2)
+         *
+         * 1/100th of a second.
+         * (1 hundredth of a second).
+         */
+        if (secs > 99)
+            secs = 99;
+
+        *ns = (uint64_t)secs * 10000000;
+
+    } else if (strstr (str, "ds") == posn) {
+        /* Deci-seconds:
+         *
+         * 10 ^ (-1)
+         *
+         * 1/10th of a second.
+         * (1 tenth of a second).
+         */
+        if (secs > 9)
+            secs = 9;
+
+        *ns = (uint64_t)secs * 100000000;
+
+    } else if (strstr (str, "ms") == posn) {
+        /* Milli-seconds:
+         *
+         * 10 ^ (-3)
+         *
+         * 1/1000th of a second.
+         * (1 thousandth of a second).
+         */
+        if (secs > 999)
+            secs = 999;
+
+        *ns = (uint64_t)secs * 1000000;
+
+    } else if (strstr (str, "ns") == posn) {
+        /* Nano-seconds:
+         *
+         * 10 ^ (-9)
+         *
+         * 1/1,000,000,000 of a second
+         * (1 billionth of a second)
+         */
+        if (secs > 999999999)
+            secs = 999999999;
+
+        *ns = (uint64_t)secs;
+
+    } else if (strstr (str, "us") == posn) {
+        /* Micro-seconds:
+         *
+         * 10 ^ (-6)
+         *
+         * 1/1,000,000th of a second
+         * (1 millionth of a second).
+         */
+        if (secs > 999999)
+            secs = 999999;
+
+        *ns = (uint64_t)secs * 1000;
+
+    } else {
+        switch (len ? str[len-1] : '\0')
+        {
+            case 'd':
+                /* Days */
+                multiplier = (60 * 60 * 24);
+                break;
+
+            case 'h':
+                /* Hours */
+                multiplier = (60 * 60);
+                break;
+
+            case 'm':
+                /* Minutes */
+                multiplier = 60;
+                break;
+
+            case 's':
+                /* Seconds */
+                multiplier = 1;
+                break;
+
+            default:
+                /* No suffix, so must be seconds */
+                multiplier = 1;
+                break;
+        }
+
+        *ns = (uint64_t)secs * multiplier * 1000000000ULL;
+    }
+
+    return 0;
+}
+
+/**
+ * sleep_for:
+ *
+ * @requested: nano-seconds to sleep for, as returned by parse_delay().
+ *
+ * Sleep for @requested nano-seconds, or if @requested is -1, until
+ * any signal is received.
+ **/
+void
+sleep_for (int64_t requested)
+{
+    uint64_t          start;
+    uint64_t          actual;
+    struct timespec   ts;
+    struct timespec   rem;
+    int               ret;
+
+    /* ensure everything is displayed before we pause */
+    flush_output ();
+    flush_targets (0);
+
+    start = monotonic_ns ();
+
+    DTRACE_PROBE1 (utfout, sleep__start, requested);
+
+    if (requested < 0) {
+        wait_for_intr ();
+    } else {
+        ts.tv_sec = (time_t)(requested / 1000000000);
+        ts.tv_nsec = (long)(requested % 1000000000);
+
+        do {
+            ret = nanosleep (&ts, &rem);
+            if (ret) {
+                ts.tv_sec = rem.tv_sec;
+                ts.tv_nsec = rem.tv_nsec;
+
+                rem.tv_sec = 0;
+                rem.tv_nsec = 0;
+            }
+        } while (ret);
+    }
+
+    actual = monotonic_ns () - start;
+
+    DTRACE_PROBE2 (utfout, sleep__end, requested, actual);
+
+    if (requested >= 0)
+        record_delay ((uint64_t)requested, actual);
+}
+
+/**
+ * parse_rate:
+ *
+ * @str: rate, optionally followed by 'k', 'M' or 'G' (powers of 1000).
+ *
+ * Returns: displays per second represented by @str.
+ **/
+static double
+parse_rate (const char *str)
+{
+    double  rate;
+    char   *end;
+
+    errno = 0;
+    rate = strtod (str, &end);
+
+    if (end == str || errno || rate < 0)
+        die ("invalid rate '%s'", str);
+
+    switch (*end) {
+        case 'k':
+        case 'K':
+            rate *= 1e3;
+            end++;
+            break;
+
+        case 'M':
+            rate *= 1e6;
+            end++;
+            break;
+
+        case 'G':
+            rate *= 1e9;
+            end++;
+            break;
+    }
+
+    if (*end)
+        die ("invalid rate '%s'", str);
+
+    return rate;
+}
+
+/**
+ * parse_duration:
+ *
+ * @str: amount of time (see parse_delay()).
+ *
+ * Returns: seconds represented by @str.
+ **/
+static double
+parse_duration (const char *str)
+{
+    uint64_t  ns;
+
+    if (parse_delay (str, &ns) < 0 || ! ns)
+        die ("invalid duration '%s'", str);
+
+    return (double)ns / 1e9;
+}
+
+/**
+ * add_phase:
+ *
+ * @profile: profile,
+ * @shape: shape of phase,
+ * @duration: length of phase in seconds,
+ * @from: initial (or minimum) rate,
+ * @to: final (or maximum) rate.
+ *
+ * Returns: new phase appended to @profile.
+ **/
+static struct profile_phase *
+add_phase (struct profile      *profile,
+           enum profile_shape   shape,
+           double               duration,
+           double               from,
+           double               to)
+{
+    struct profile_phase  *phase;
+
+    phase = realloc (profile->phases,
+            (profile->count + 1) * sizeof (struct profile_phase));
+    if (! phase)
+        die ("failed to allocate space for profile");
+
+    profile->phases = phase;
+    phase += profile->count++;
+
+    memset (phase, 0, sizeof (struct profile_phase));
+    phase->shape = shape;
+    phase->start = profile->length;
+    phase->duration = duration;
+    phase->from = from;
+    phase->to = to;
+
+    profile->length += duration;
+
+    return phase;
+}
+
+/**
+ * load_timeline:
+ *
+ * @profile: profile,
+ * @path: path of file.
+ *
+ * Add phases to @profile from the CSV timeline at @path. Each line is
+ * 'SECONDS,RATE'; the rate changes linearly between lines and before
+ * the first line is that of the first line. Blank lines and lines
+ * starting with '#' are ignored.
+ **/
+static void
+load_timeline (struct profile *profile, const char *path)
+{
+    struct stat   st;
+    char         *line;
+    char         *next;
+    char         *rate;
+    char         *end;
+    double        when;
+    double        last_when = 0;
+    double        last_rate = 0;
+    size_t        points = 0;
+    size_t        len = 0;
+    ssize_t       ret;
+    int           fd;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        die ("failed to open profile '%s'", path);
+
+    if (fstat (fd, &st) < 0) {
+        close (fd);
+        die ("failed to read profile '%s'", path);
+    }
+
+    /* read whole so that nothing is left open should a line be invalid */
+    profile->text = malloc ((size_t)st.st_size + 1);
+    if (! profile->text) {
+        close (fd);
+        die ("failed to allocate space for profile");
+    }
+
+    while (len < (size_t)st.st_size) {
+        ret = read (fd, profile->text + len, (size_t)st.st_size - len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret < 0) {
+            close (fd);
+            die ("failed to read profile '%s'", path);
+        }
+
+        if (! ret)
+            break;
+
+        len += (size_t)ret;
+    }
+
+    close (fd);
+
+    profile->text[len] = '\0';
+
+    for (line = profile->text; line; line = next) {
+        next = strchr (line, '\n');
+        if (next)
+            *next++ = '\0';
+
+        line[strcspn (line, "\r")] = '\0';
+
+        if (! *line || *line == '#')
+            continue;
+
+        rate = strchr (line, ',');
+        if (! rate)
+            die ("invalid profile line '%s'", line);
+
+        *rate++ = '\0';
+
+        errno = 0;
+        when = strtod (line, &end);
+        if (end == line || *end || errno || when < last_when
+                || (points && when == last_when))
+            die ("invalid profile time '%s'", line);
+
+        while (*rate == ' ')
+            rate++;
+
+        if (! points) {
+            last_rate = parse_rate (rate);
+
+            if (when > 0)
+                add_phase (profile, PROFILE_HOLD, when, last_rate, last_rate);
+        } else {
+            add_phase (profile, PROFILE_RAMP, when - last_when, last_rate,
+                    parse_rate (rate));
+            last_rate = parse_rate (rate);
+        }
+
+        last_when = when;
+        points++;
+    }
+
+    if (points < 2)
+        die ("profile '%s' must contain at least two lines", path);
+}
+
+/**
+ * parse_profile:
+ *
+ * @spec: profile specification.
+ *
+ * Parse a traffic profile. @spec is either '@PATH' for a CSV timeline
+ * (see load_timeline()) or a comma-separated list of phases, each a
+ * colon-separated list of fields:
+ *
+ *     hold:[RATE:]DURATION          constant rate (default: the last)
+ *     ramp:FROM:TO:DURATION         linear change in rate
+ *     step:FROM:TO:STEPS:DURATION   rate changes in equal steps
+ *     sine:MIN:MAX:PERIOD:DURATION  rate oscillates, starting midway
+ *     burst:FACTOR:LENGTH:EVERY     multiply the rate by FACTOR for
+ *                                   LENGTH every EVERY (any position)
+ *
+ * Rates are displays per second.
+ *
+ * Returns: newly-allocated profile, or NULL if @spec is empty.
+ **/
+struct profile *
+parse_profile (const char *spec)
+{
+    struct profile        *new;
+    struct profile_phase  *phase;
+    char                  *item;
+    char                  *saveptr = NULL;
+    char                  *fields[6];
+    size_t                 count;
+    double                 last = 0;
+
+    assert (spec);
+
+    if (! *spec)
+        return NULL;
+
+    new = calloc (1, sizeof (struct profile));
+    if (! new)
+        die ("failed to allocate space for profile");
+
+    /* listed first so that it is freed however parsing ends */
+    new->next = profiles;
+    profiles = new;
+
+    if (*spec == '@') {
+        load_timeline (new, spec + 1);
+        return new;
+    }
+
+    new->text = strdup (spec);
+    if (! new->text)
+        die ("failed to allocate space for profile");
+
+    for (item = strtok_r (new->text, ",", &saveptr); item;
+            item = strtok_r (NULL, ",", &saveptr)) {
+
+        for (count = 0; item && count < sizeof (fields) / sizeof (fields[0]);
+                count++) {
+            fields[count] = item;
+            item = strchr (item, ':');
+            if (item)
+                *item++ = '\0';
+        }
+
+        if (item)
+            die ("too many fields in profile phase '%s'", fields[0]);
+
+        if (! strcmp (fields[0], "hold") && (count == 2 || count == 3)) {
+            if (count == 3)
+                last = parse_rate (fields[1]);
+            add_phase (new, PROFILE_HOLD, parse_duration (fields[count - 1]),
+                    last, last);
+        } else if (! strcmp (fields[0], "ramp") && count == 4) {
+            add_phase (new, PROFILE_RAMP, parse_duration (fields[3]),
+                    parse_rate (fields[1]), parse_rate (fields[2]));
+            last = parse_rate (fields[2]);
+        } else if (! strcmp (fields[0], "step") && count == 5) {
+            phase = add_phase (new, PROFILE_STEP, parse_duration (fields[4]),
+                    parse_rate (fields[1]), parse_rate (fields[2]));
+            phase->steps = atof (fields[3]);
+            if (phase->steps < 1 || phase->steps != (long)phase->steps)
+                die ("invalid number of steps '%s'", fields[3]);
+            last = phase->to;
+        } else if (! strcmp (fields[0], "sine") && count == 5) {
+            phase = add_phase (new, PROFILE_SINE, parse_duration (fields[4]),
+                    parse_rate (fields[1]), parse_rate (fields[2]));
+            phase->period = parse_duration (fields[3]);
+            last = (phase->from + phase->to) / 2;
+        } else if (! strcmp (fields[0], "burst") && count == 4) {
+            new->burst_factor = parse_rate (fields[1]);
+            new->burst_length = parse_duration (fields[2]);
+            new->burst_every = parse_duration (fields[3]);
+            if (new->burst_length >= new->burst_every)
+                die ("burst must be shorter than its interval");
+        } else
+            die ("invalid profile phase '%s'", fields[0]);
+    }
+
+    if (! new->count)
+        die ("profile '%s' has no phases", spec);
+
+    return new;
+}
+
+/**
+ * profile_rate:
+ *
+ * @profile: profile,
+ * @when: seconds since start of @profile.
+ *
+ * Returns: target displays per second at @when.
+ **/
+static double
+profile_rate (const struct profile *profile, double when)
+{
+    const struct profile_phase  *phase = profile->phases;
+    const struct profile_phase  *last = phase + profile->count - 1;
+    double                       offset;
+    double                       steps;
+    double                       rate;
+
+    while (phase < last && when >= phase->start + phase->duration)
+        phase++;
+
+    offset = (when - phase->start) / phase->duration;
+
+    switch (phase->shape) {
+        case PROFILE_RAMP:
+            rate = phase->from + (phase->to - phase->from) * offset;
+            break;
+
+        case PROFILE_STEP:
+            /* @steps changes of rate, so @steps + 1 levels */
+            steps = floor (offset * (phase->steps + 1));
+            if (steps > phase->steps)
+                steps = phase->steps;
+            rate = phase->from + (phase->to - phase->from) * steps / phase->steps;
+            break;
+
+        case PROFILE_SINE:
+            rate = (phase->from + phase->to) / 2
+                + (phase->to - phase->from) / 2
+                * sin (2 * M_PI * (when - phase->start) / phase->period);
+            break;
+
+        default:
+            rate = phase->from;
+            break;
+    }
+
+    if (profile->burst_factor && when >= profile->burst_every
+            && fmod (when, profile->burst_every) < profile->burst_length)
+        rate *= profile->burst_factor;
+
+    return rate;
+}
+
+/**
+ * start_shaper:
+ *
+ * @shaper: shaper to initialise,
+ * @profile: profile to follow.
+ **/
+void
+start_shaper (struct shaper *shaper, const struct profile *profile)
+{
+    assert (shaper);
+    assert (profile);
+
+    memset (shaper, 0, sizeof (struct shaper));
+
+    shaper->profile = profile;
+    shaper->start = monotonic_ns ();
+}
+
+/**
+ * shaper_report:
+ *
+ * @shaper: shaper.
+ *
+ * Write the target and achieved rates since the last report to
+ * standard error.
+ **/
+static void
+shaper_report (struct shaper *shaper)
+{
+    char      buffer[256];
+    double    seconds;
+    double    target;
+    double    achieved;
+    uint64_t  due;
+    uint64_t  now;
+    int       len;
+
+    seconds = (double)((shaper->tick - shaper->report_tick) * PROFILE_TICK)
+        / 1e9;
+    if (seconds <= 0)
+        return;
+
+    target = (shaper->target - shaper->report_target) / seconds;
+    achieved = (double)(shaper->emitted - shaper->report_emitted) / seconds;
+
+    due = shaper->start + shaper->tick * PROFILE_TICK;
+    now = monotonic_ns ();
+
+    len = snprintf (buffer, sizeof (buffer),
+            "profile %.3fs-%.3fs: target %.1f/s achieved %.1f/s"
+            " (%.1f%%) lag %.3fms\n",
+            (double)(shaper->report_tick * PROFILE_TICK) / 1e9,
+            (double)(shaper->tick * PROFILE_TICK) / 1e9,
+            target, achieved,
+            target > 0 ? 100.0 * achieved / target : 100.0,
+            now > due ? (double)(now - due) / 1e6 : 0.0);
+
+    if (len > 0 && write (STDERR_FILENO, buffer, (size_t)len) < 0)
+        return;
+
+    shaper->report_tick = shaper->tick;
+    shaper->report_target = shaper->target;
+    shaper->report_emitted = shaper->emitted;
+}
+
+/**
+ * shape_next:
+ *
+ * @shaper: shaper.
+ *
+ * Wait until the next display is due. Displays are allotted to ticks
+ * of PROFILE_TICK nano-seconds according to the profile's rate, and
+ * each tick starts at an absolute time so that delays in writing are
+ * made up rather than accumulating.
+ *
+ * Returns: FALSE if the profile has ended.
+ **/
+int
+shape_next (struct shaper *shaper)
+{
+    struct timespec  ts;
+    uint64_t         due;
+    double           when;
+
+    assert (shaper);
+
+    while ((double)shaper->emitted + 1 > shaper->target) {
+        when = (double)(shaper->tick * PROFILE_TICK) / 1e9;
+
+        if (profile_report
+                && (shaper->tick - shaper->report_tick) * PROFILE_TICK
+                >= profile_report)
+            shaper_report (shaper);
+
+        if (when >= shaper->profile->length) {
+            if (profile_report)
+                shaper_report (shaper);
+            return 0;
+        }
+
+        /* ensure everything due so far is displayed before waiting */
+        flush_output ();
+        flush_targets (0);
+
+        due = shaper->start + shaper->tick * PROFILE_TICK;
+        ts.tv_sec = (time_t)(due / 1000000000);
+        ts.tv_nsec = (long)(due % 1000000000);
+
+        while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                    NULL) == EINTR)
+            ;
+
+        shaper->target += profile_rate (shaper->profile,
+                when + (double)PROFILE_TICK / 2e9) * (double)PROFILE_TICK / 1e9;
+        shaper->tick++;
+    }
+
+    shaper->emitted++;
+
+    return 1;
+}
+
+/**
+ * wait_for_intr:
+ *
+ * Wait indefinately for an interrupt signal.
+ **/
+void
+wait_for_intr (void)
+{
+    int ret;
+
+    /* save any old signal handlers */
+    ret = sigaction (SIGINT, NULL, &oldact);
+
+    if (ret != 0)
+        die ("Unable to save old signal handler");
+
+    /* specify handler */
+    act.sa_handler = signal_handler;
+
+    /* register our own handler */
+    ret = sigaction (SIGINT, &act, NULL);
+    if (ret != 0)
+        die ("Unable to set new signal handler");
+
+    pause ();
+
+#ifdef UTFOUT_BUILTIN
+    /* the shell's handler */
+    (void)sigaction (SIGINT, &oldact, NULL);
+#endif
+}
+
+/**
+ * lex_range:
+ *
+ * @range: wide string starting with the '{' of a range escape,
+ * @len: number of characters available in @range,
+ * @start: first character of range,
+ * @end: last character of range,
+ * @error: offset into @range of the first unexpected character.
+ *
+ * Parse a range escape of one of the following forms:
+ *
+ *      L"{\UFFFFFFFF..\UFFFFFFFF}" (8 hex digits)
+ *      L"{\uFFFF..\uFFFF}"         (4 hex digits)
+ *      L"{\o777..\o777}"           (3 octal digits)
+ *      L"{\xFF..\xFF}"             (2 hex digits)
+ *      L"{?..?}"                   (2 literal characters)
+ *
+ * Both endpoints must use the same form. Characters following the
+ * closing brace are not considered.
+ *
+ * Returns: number of characters consumed, or 0 if @range is not a
+ * valid range (in which case @error is set).
+ **/
+size_t
+lex_range (const wchar_t  *range,
+           size_t          len,
+           wchar_t        *start,
+           wchar_t        *end,
+           size_t         *error)
+{
+    /* grammar of a range: each step either matches a specific
+     * character or an endpoint.
+     */
+    static const struct {
+        int      endpoint;
+        wchar_t  expect;
+    } steps[] = {
+        { 0, L'{' },
+        { 1, 0    },
+        { 0, L'.' },
+        { 0, L'.' },
+        { 1, 0    },
+        { 0, L'}' },
+    };
+
+    const struct escape_spec  *spec = NULL;
+    wchar_t                   *values[2];
+    int                        endpoint = 0;
+    size_t                     step;
+    size_t                     i = 0;
+
+    assert (range);
+    assert (start);
+    assert (end);
+    assert (error);
+
+    values[0] = start;
+    values[1] = end;
+
+    /* endpoints are numeric if the first one is introduced by a
+     * (literal) backslash and a numeric escape character.
+     */
+    if (len > 2 && range[1] == L'\\'
+            && get_escape_spec (range[2])->kind == ESCAPE_NUMERIC)
+        spec = get_escape_spec (range[2]);
+
+    for (step = 0; step < sizeof (steps) / sizeof (steps[0]); step++) {
+        unsigned long  tmp = 0;
+        int            digits;
+        int            d;
+
+        if (i >= len)
+            goto error;
+
+        if (! steps[step].endpoint) {
+            if (range[i] != steps[step].expect)
+                goto error;
+            i++;
+            continue;
+        }
+
+        if (! spec) {
+            /* literal character */
+            *values[endpoint++] = range[i++];
+            continue;
+        }
+
+        if (range[i] != L'\\')
+            goto error;
+        i++;
+
+        if (i >= len || get_escape_spec (range[i]) != spec)
+            goto error;
+        i++;
+
+        for (digits = 0; digits < spec->digits; digits++, i++) {
+            if (i >= len || (d = digit_value (range[i], spec->flags)) < 0)
+                goto error;
+            tmp = (tmp * spec->base) + d;
+        }
+
+        *values[endpoint++] = (wchar_t)tmp;
+    }
+
+    return i;
+
+error:
+    *error = i;
+    return 0;
+}
+
+/**
+ * lex_number:
+ *
+ * @str: wide string,
+ * @len: number of characters available in @str,
+ * @i: offset into @str (updated),
+ * @value: numeric value,
+ * @digits: number of digits consumed.
+ *
+ * Parse a decimal number of at most SEQUENCE_MAX_DIGITS digits.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+static int
+lex_number (const wchar_t       *str,
+            size_t               len,
+            size_t              *i,
+            unsigned long long  *value,
+            int                 *digits)
+{
+    int  d;
+
+    *value = 0;
+    *digits = 0;
+
+    while (*i < len && (d = digit_value (str[*i], CLASS_DEC)) >= 0) {
+        if (*digits == SEQUENCE_MAX_DIGITS)
+            return -1;
+        *value = (*value * 10) + d;
+        (*digits)++;
+        (*i)++;
+    }
+
+    return *digits ? 0 : -1;
+}
+
+/**
+ * lex_sequence:
+ *
+ * @range: wide string starting with the '{' of a range escape,
+ * @len: number of characters available in @range,
+ * @seq: sequence to fill in,
+ * @error: offset into @range of the first unexpected character.
+ *
+ * Parse a numeric sequence of the form:
+ *
+ *      L"{FIRST..LAST[..STEP][,SEP]}"
+ *
+ * If either FIRST or LAST has a leading zero, all values are
+ * zero-padded to the width of the longer of the two. SEP may contain
+ * simple (literal backslash) escapes such as '\n'.
+ *
+ * A range of two single digits with no step or separator is left
+ * for lex_range() to handle as a character range (the output is
+ * identical).
+ *
+ * Returns: number of characters consumed, or 0 if @range is not a
+ * valid sequence (in which case @error is set).
+ **/
+size_t
+lex_sequence (const wchar_t    *range,
+              size_t            len,
+              struct sequence  *seq,
+              size_t           *error)
+{
+    size_t  i = 0;
+    int     first_digits;
+    int     last_digits;
+    int     step_digits = 0;
+
+    assert (range);
+    assert (seq);
+    assert (error);
+
+    memset (seq, 0, sizeof (struct sequence));
+    seq->step = 1;
+
+    if (i >= len || range[i] != L'{')
+        goto error;
+    i++;
+
+    if (lex_number (range, len, &i, &seq->first, &first_digits) < 0)
+        goto error;
+
+    if (i + 1 >= len || range[i] != L'.' || range[i+1] != L'.')
+        goto error;
+    i += 2;
+
+    if (lex_number (range, len, &i, &seq->last, &last_digits) < 0)
+        goto error;
+
+    if (i + 1 < len && range[i] == L'.' && range[i+1] == L'.') {
+        i += 2;
+        if (lex_number (range, len, &i, &seq->step, &step_digits) < 0
+                || ! seq->step)
+            goto error;
+    }
+
+    if (i < len && range[i] == L',') {
+        seq->sep_specified = 1;
+        i++;
+
+        while (i < len && range[i] != L'}') {
+            wchar_t  c = range[i];
+
+            if (seq->sep_len == SEQUENCE_MAX_SEP)
+                goto error;
+
+            if (c == L'\\') {
+                const struct escape_spec *spec;
+
+                if (i + 1 >= len)
+                    goto error;
+
+                spec = get_escape_spec (range[i+1]);
+                if (spec->kind != ESCAPE_SIMPLE) {
+                    i++;
+                    goto error;
+                }
+
+                c = spec->value;
+                i++;
+            }
+
+            seq->sep[seq->sep_len++] = c;
+            i++;
+        }
+    }
+
+    if (i >= len || range[i] != L'}')
+        goto error;
+    i++;
+
+    /* leave simple single-character ranges to lex_range() */
+    if (first_digits == 1 && last_digits == 1
+            && ! step_digits && ! seq->sep_specified) {
+        *error = 0;
+        return 0;
+    }
+
+    if ((first_digits > 1 && range[1] == L'0')
+            || (last_digits > 1 && range[first_digits+3] == L'0'))
+        seq->width = first_digits > last_digits ? first_digits : last_digits;
+
+    return i;
+
+error:
+    *error = i;
+    return 0;
+}
+
+/**
+ * emit_sequence:
+ *
+ * @fd: file descriptor to write output to,
+ * @seq: sequence to display,
+ * @delay: nano-seconds to pause between each value (or NULL),
+ * @separator_specified: TRUE if a separator value has been specified,
+ * @separator: separator to use if @seq does not specify one.
+ *
+ * Display numeric sequence @seq. Values are held as ASCII digits
+ * which are incremented (or decremented) in place rather than being
+ * formatted from scratch for each value.
+ **/
+void
+emit_sequence (int                     fd,
+               const struct sequence  *seq,
+               const int64_t          *delay,
+               int                     separator_specified,
+               int                     separator)
+{
+    /* Each value is immediately followed by the separator such that
+     * a record can be copied to the output buffer in one go. Digits
+     * are right-aligned, ending at @end, with room for a carry digit.
+     * Space is also left for a fixed-size copy of short records.
+     */
+    char                record[SEQUENCE_MAX_DIGITS + 1 + (SEQUENCE_MAX_SEP * 8)
+                               + SEQUENCE_RECORD_COPY];
+    char               *end = record + SEQUENCE_MAX_DIGITS + 1;
+    char               *start;
+    char               *p;
+    size_t              sep_len = 0;
+    size_t              len;
+    unsigned long long  count;
+    int                 up;
+    int                 ret;
+    size_t              i;
+
+    assert (seq);
+
+    memset (record, 0, sizeof (record));
+
+    up = seq->first <= seq->last;
+
+    count = (up ? seq->last - seq->first : seq->first - seq->last) / seq->step;
+
+    /* convert separator to multi-byte form once */
+    if (seq->sep_specified) {
+        for (i = 0; i < seq->sep_len; i++) {
+            len = wcrtomb (end + sep_len, seq->sep[i], NULL);
+            if (len != (size_t)-1)
+                sep_len += len;
+        }
+    } else if (separator_specified) {
+        len = wcrtomb (end, separator, NULL);
+        if (len != (size_t)-1)
+            sep_len = len;
+    }
+
+    /* format initial value */
+    {
+        char  tmp[SEQUENCE_MAX_DIGITS + 2];
+
+        ret = snprintf (tmp, sizeof (tmp), "%0*llu", seq->width, seq->first);
+        assert (ret > 0 && ret <= SEQUENCE_MAX_DIGITS + 1);
+
+        start = end - ret;
+        memcpy (start, tmp, ret);
+    }
+
+    while (1) {
+        if (! delay && up && seq->step == 1) {
+            /* Fast path: fill the output buffer with as many whole
+             * records as will fit without further checks.
+             */
+            char  *limit;
+            int    digit;
+
+            len = (end - start) + sep_len;
+
+            if (output.fd != fd || output.len + SEQUENCE_RECORD_COPY
+                    + (SEQUENCE_MAX_DIGITS + 1) + sep_len >= OUTPUT_BUFSIZE) {
+                flush_output ();
+                output.fd = fd;
+            }
+
+            /* flushing may have changed the output buffer */
+            limit = output.data + OUTPUT_BUFSIZE - SEQUENCE_RECORD_COPY
+                - (SEQUENCE_MAX_DIGITS + 1) - sep_len;
+            p = output.data + output.len;
+
+            /* The final digit is written separately such that the
+             * record is only modified every tenth value (modifying it
+             * before every copy would stall the copy).
+             */
+            digit = end[-1] - '0';
+
+            while (count && p < limit && len <= SEQUENCE_RECORD_COPY) {
+                memcpy (p, start, SEQUENCE_RECORD_COPY);
+                p[(end - start) - 1] = '0' + digit;
+                p += len;
+                count--;
+
+                if (++digit < 10)
+                    continue;
+
+                /* carry */
+                digit = 0;
+                start[-1] = '0';
+
+                for (i = 2; end[-i] == '9'; i++)
+                    end[-i] = '0';
+
+                end[-i]++;
+
+                if (end - i < start) {
+                    start = end - i;
+                    len++;
+                }
+            }
+
+            end[-1] = '0' + digit;
+
+            output.len = p - output.data;
+
+            if (count && len <= SEQUENCE_RECORD_COPY)
+                continue;
+        }
+
+        len = (end - start) + (count ? sep_len : 0);
+
+        if (output.fd != fd
+                || (OUTPUT_BUFSIZE - output.len) < len + SEQUENCE_RECORD_COPY) {
+            flush_output ();
+            output.fd = fd;
+        }
+
+        p = output.data + output.len;
+
+        /* a fixed-size copy is significantly faster */
+        if (len <= SEQUENCE_RECORD_COPY)
+            memcpy (p, start, SEQUENCE_RECORD_COPY);
+        else
+            memcpy (p, start, len);
+
+        output.len += len;
+
+        if (delay)
+            sleep_for (*delay);
+
+        if (! count)
+            break;
+
+        count--;
+
+        if (up && seq->step == 1) {
+            /* fast path */
+            if (end[-1] != '9') {
+                end[-1]++;
+                continue;
+            }
+
+            for (p = end - 1; p >= start && *p == '9'; p--)
+                *p = '0';
+
+            if (p < start)
+                *--start = '1';
+            else
+                (*p)++;
+        } else if (up) {
+            unsigned long long  carry = seq->step;
+
+            for (p = end - 1; carry; p--) {
+                int  d;
+
+                if (p < start)
+                    *--start = '0';
+
+                d = (*p - '0') + (int)(carry % 10);
+                carry /= 10;
+
+                if (d > 9) {
+                    d -= 10;
+                    carry++;
+                }
+
+                *p = '0' + d;
+            }
+        } else {
+            unsigned long long  borrow = seq->step;
+
+            for (p = end - 1; borrow; p--) {
+                int  d;
+
+                d = (*p - '0') - (int)(borrow % 10);
+                borrow /= 10;
+
+                if (d < 0) {
+                    d += 10;
+                    borrow++;
+                }
+
+                *p = '0' + d;
+            }
+
+            /* remove leading zeros not required for padding */
+            while (*start == '0' && (end - start) > 1
+                    && (end - start) > seq->width)
+                start++;
+        }
+    }
+}
+
+/**
+ * add_time_piece:
+ *
+ * @tf: time format,
+ * @type: type of piece,
+ * @format: strftime(3) format (or NULL),
+ * @len: length of @format,
+ * @digits: number of fractional digits.
+ *
+ * Returns: 0 on success, -1 if @tf is full.
+ **/
+static int
+add_time_piece (struct time_format    *tf,
+                enum time_piece_type   type,
+                const char            *format,
+                size_t                 len,
+                int                    digits)
+{
+    struct time_piece  *piece;
+
+    if (tf->count == TIME_MAX_PIECES)
+        return -1;
+
+    piece = &tf->pieces[tf->count++];
+
+    piece->type = type;
+    piece->digits = digits;
+    piece->offset = 0;
+    piece->format = NULL;
+
+    if (format) {
+        piece->format = strndup (format, len);
+        if (! piece->format)
+            die ("failed to allocate space for time format");
+    }
+
+    return 0;
+}
+
+/**
+ * lex_time:
+ *
+ * @str: wide string following a '\T' or '\M' escape,
+ * @len: number of characters available in @str,
+ * @elapsed: TRUE for '\M',
+ * @tf: time format to fill in,
+ * @error: offset into @str of the first unexpected character.
+ *
+ * Parse a time escape of the form L"{FORMAT}". For '\T', FORMAT is
+ * either a strftime(3) format (where '%N', '%3N', '%6N' and '%9N'
+ * additionally specify fractional seconds) or one of the units 's',
+ * 'ms', 'us' or 'ns' to show the time since the Epoch. For '\M', FORMAT
+ * must be one of those units and the time elapsed since startup is
+ * shown.
+ *
+ * Returns: number of characters consumed, or 0 if @str is not a
+ * valid time escape (in which case @error is set).
+ **/
+size_t
+lex_time (const wchar_t       *str,
+          size_t               len,
+          int                  elapsed,
+          struct time_format  *tf,
+          size_t              *error)
+{
+    static const struct {
+        const wchar_t  *name;
+        int             digits;
+    } units[] = {
+        { L"s",  0 },
+        { L"ms", 3 },
+        { L"us", 6 },
+        { L"ns", 9 },
+    };
+
+    wchar_t   wformat[TIME_MAX_FORMAT + 1];
+    char      format[(TIME_MAX_FORMAT * 8) + 1];
+    size_t    i = 0;
+    size_t    n = 0;
+    size_t    u;
+    size_t    ret;
+    char     *p;
+    char     *piece;
+
+    assert (str);
+    assert (tf);
+    assert (error);
+
+    memset (tf, 0, sizeof (struct time_format));
+    tf->clock = elapsed ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+    tf->cached_sec = -1;
+
+    if (i >= len || str[i] != L'{')
+        goto error;
+    i++;
+
+    while (i < len && str[i] != L'}') {
+        if (n == TIME_MAX_FORMAT)
+            goto error;
+        wformat[n++] = str[i++];
+    }
+
+    if (i >= len || ! n)
+        goto error;
+
+    wformat[n] = L'\0';
+    i++;
+
+    for (u = 0; u < sizeof (units) / sizeof (units[0]); u++) {
+        if (wcscmp (wformat, units[u].name))
+            continue;
+
+        if (elapsed)
+            add_time_piece (tf, TIME_PIECE_SECONDS, NULL, 0, 0);
+        else
+            add_time_piece (tf, TIME_PIECE_STRFTIME, "%s", 2, 0);
+
+        if (units[u].digits)
+            add_time_piece (tf, TIME_PIECE_FRACTION, NULL, 0,
+                    units[u].digits);
+
+        return i;
+    }
+
+    if (elapsed) {
+        /* report the start of the format */
+        i = 1;
+        goto error;
+    }
+
+    ret = wcstombs (format, wformat, sizeof (format));
+    if (ret == (size_t)-1 || ret == sizeof (format))
+        goto error;
+
+    /* split format at fractional second specifiers */
+    for (p = piece = format; *p; p++) {
+        int  digits = 9;
+
+        if (*p != '%')
+            continue;
+
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+
+        if ((p[1] == '3' || p[1] == '6' || p[1] == '9') && p[2] == 'N')
+            digits = p[1] - '0';
+        else if (p[1] != 'N')
+            continue;
+
+        if (p > piece
+                && add_time_piece (tf, TIME_PIECE_STRFTIME, piece,
+                    p - piece, 0) < 0)
+            goto piece_error;
+
+        if (add_time_piece (tf, TIME_PIECE_FRACTION, NULL, 0, digits) < 0)
+            goto piece_error;
+
+        p += (digits == 9 && p[1] == 'N') ? 1 : 2;
+        piece = p + 1;
+    }
+
+    if (p > piece
+            && add_time_piece (tf, TIME_PIECE_STRFTIME, piece,
+                p - piece, 0) < 0)
+        goto piece_error;
+
+    return i;
+
+piece_error:
+    for (u = 0; u < tf->count; u++)
+        free (tf->pieces[u].format);
+    i = 1;
+
+error:
+    *error = i;
+    return 0;
+}
+
+/**
+ * get_clock:
+ *
+ * @clock: clock to read.
+ *
+ * Read @clock, unless it has already been read and may be reused
+ * according to the clock update policy.
+ *
+ * Returns: time of @clock (for CLOCK_MONOTONIC, time elapsed since
+ * startup).
+ **/
+static struct timespec
+get_clock (clockid_t clock)
+{
+    struct timespec  *ts;
+    int              *valid;
+    struct timespec   elapsed;
+
+    if (clock == CLOCK_MONOTONIC) {
+        ts = &clocks.monotonic;
+        valid = &clocks.monotonic_valid;
+    } else {
+        ts = &clocks.realtime;
+        valid = &clocks.realtime_valid;
+    }
+
+    if (! *valid || clock_update == CLOCK_UPDATE_ALWAYS) {
+        if (clock_gettime (clock, ts) < 0)
+            die ("failed to read clock");
+        *valid = 1;
+    }
+
+    if (clock != CLOCK_MONOTONIC)
+        return *ts;
+
+    elapsed.tv_sec = ts->tv_sec - clocks.start.tv_sec;
+    elapsed.tv_nsec = ts->tv_nsec - clocks.start.tv_nsec;
+
+    if (elapsed.tv_nsec < 0) {
+        elapsed.tv_sec--;
+        elapsed.tv_nsec += 1000000000L;
+    }
+
+    return elapsed;
+}
+
+/**
+ * emit_time:
+ *
+ * @fd: file descriptor to write output to,
+ * @tf: time format.
+ *
+ * Display the current time formatted according to @tf.
+ **/
+void
+emit_time (int fd, struct time_format *tf)
+{
+    struct timespec     ts;
+    struct time_piece  *piece;
+    size_t              i;
+
+    assert (tf);
+
+    ts = get_clock (tf->clock);
+
+    if (ts.tv_sec != tf->cached_sec) {
+        struct tm  tm;
+        size_t     room;
+        int        ret;
+
+        if (tf->clock == CLOCK_REALTIME && ! localtime_r (&ts.tv_sec, &tm))
+            die ("failed to convert time");
+
+        tf->cache_len = 0;
+
+        for (i = 0; i < tf->count; i++) {
+            piece = &tf->pieces[i];
+            room = sizeof (tf->cache) - tf->cache_len;
+
+            switch (piece->type) {
+
+                case TIME_PIECE_STRFTIME:
+                    tf->cache_len += strftime (tf->cache + tf->cache_len,
+                            room, piece->format, &tm);
+                    break;
+
+                case TIME_PIECE_SECONDS:
+                    ret = snprintf (tf->cache + tf->cache_len, room,
+                            "%lld", (long long)ts.tv_sec);
+                    if (ret > 0 && (size_t)ret < room)
+                        tf->cache_len += ret;
+                    break;
+
+                case TIME_PIECE_FRACTION:
+                    if ((size_t)piece->digits > room)
+                        break;
+                    piece->offset = tf->cache_len;
+                    tf->cache_len += piece->digits;
+                    break;
+            }
+        }
+
+        tf->cached_sec = ts.tv_sec;
+    }
+
+    /* patch fractional seconds in place */
+    for (i = 0; i < tf->count; i++) {
+        long  nsec = ts.tv_nsec;
+        int   d;
+
+        piece = &tf->pieces[i];
+
+        if (piece->type != TIME_PIECE_FRACTION)
+            continue;
+
+        for (d = piece->digits; d < 9; d++)
+            nsec /= 10;
+
+        for (d = piece->digits - 1; d >= 0; d--) {
+            tf->cache[piece->offset + d] = '0' + (nsec % 10);
+            nsec /= 10;
+        }
+    }
+
+    if (tf->clock == CLOCK_MONOTONIC && ! ts.tv_sec) {
+        /* don't display leading zeros of elapsed time */
+        for (i = 0; i + 1 < tf->cache_len && tf->cache[i] == '0'; i++)
+            ;
+
+        write_output (fd, tf->cache + i, tf->cache_len - i);
+        return;
+    }
+
+    write_output (fd, tf->cache, tf->cache_len);
+}
+
+/**
+ * free_time_format:
+ *
+ * @tf: time format.
+ *
+ * Free memory associated with @tf.
+ **/
+void
+free_time_format (struct time_format *tf)
+{
+    size_t  i;
+
+    assert (tf);
+
+    for (i = 0; i < tf->count; i++)
+        free (tf->pieces[i].format);
+
+    free (tf);
+}
+
+/**
+ * load_corpus:
+ *
+ * @path: path to newline-separated file.
+ *
+ * Map the file at @path into memory and index its (non-empty)
+ * entries. Files that have already been loaded are reused.
+ *
+ * Returns: corpus.
+ **/
+struct corpus *
+load_corpus (const char *path)
+{
+    struct corpus  *corpus;
+    struct stat     st;
+    size_t          size = 0;
+    char           *p;
+    char           *end;
+    char           *nl;
+    int             fd;
+
+    assert (path);
+
+    for (corpus = corpora; corpus; corpus = corpus->next) {
+        if (! strcmp (corpus->path, path))
+            return corpus;
     }
 
-    /* include space for terminator */
-    wstr = calloc (len + 1, sizeof (wchar_t));
-    if (! wstr) {
-        fwprintf (stderr,
-                L"%s: %s: %s\n",
-                L"ERROR",
-                L"Failed to allocate space for wide string",
-                str);
-        exit (EXIT_FAILURE);
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        die ("failed to open corpus '%s': %s", path, strerror (errno));
+
+    if (fstat (fd, &st) < 0 || ! st.st_size) {
+        close (fd);
+        die ("corpus '%s' is empty", path);
     }
 
-    p = str;
+    corpus = calloc (1, sizeof (struct corpus));
+    if (! corpus) {
+        close (fd);
+        die ("failed to allocate space for corpus");
+    }
 
-    /* mbsrtowcs () doesn't include the terminator
-     * in the return value
+    corpus->map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+
+    if (corpus->map == MAP_FAILED) {
+        free (corpus);
+        die ("failed to map corpus '%s': %s", path, strerror (errno));
+    }
+
+    corpus->size = st.st_size;
+
+    /* listed before indexing so that it is freed however that ends */
+    corpus->next = corpora;
+    corpora = corpus;
+
+    corpus->path = strdup (path);
+    if (! corpus->path)
+        die ("failed to allocate space for corpus");
+
+    (void)madvise (corpus->map, corpus->size, MADV_RANDOM);
+
+    /* build index */
+    end = corpus->map + corpus->size;
+
+    for (p = corpus->map; p < end; p = nl + 1) {
+        size_t  length;
+
+        nl = memchr (p, '\n', end - p);
+        if (! nl)
+            nl = end;
+
+        length = nl - p;
+
+        /* CRLF line endings */
+        if (length && p[length - 1] == '\r')
+            length--;
+
+        if (! length)
+            continue;
+
+        if (corpus->count == size) {
+            size = size ? size * 2 : 1024;
+
+            corpus->entries = realloc (corpus->entries,
+                    size * sizeof (corpus->entries[0]));
+            if (! corpus->entries)
+                die ("failed to allocate space for corpus index");
+        }
+
+        corpus->entries[corpus->count].offset = p - corpus->map;
+        corpus->entries[corpus->count].length = length;
+        corpus->count++;
+    }
+
+    if (! corpus->count)
+        die ("corpus '%s' is empty", path);
+
+    return corpus;
+}
+
+/*
+ * Helper functions for the rejection-inversion Zipf sampler.
+ *
+ * See: Hörmann, W. and Derflinger, G. "Rejection-inversion to generate
+ * variates from monotone discrete distributions", ACM TOMACS 6.3 (1996).
+ */
+
+static inline double
+zipf_helper1 (double x)
+{
+    return fabs (x) > 1e-8 ? log1p (x) / x
+        : 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+}
+
+static inline double
+zipf_helper2 (double x)
+{
+    return fabs (x) > 1e-8 ? expm1 (x) / x
+        : 1.0 + x * 0.5 * (1.0 + x * (1.0 / 3.0) * (1.0 + 0.25 * x));
+}
+
+static inline double
+zipf_h (double exponent, double x)
+{
+    return exp (-exponent * log (x));
+}
+
+static inline double
+zipf_h_integral (double exponent, double x)
+{
+    double  log_x = log (x);
+
+    return zipf_helper2 ((1.0 - exponent) * log_x) * log_x;
+}
+
+static inline double
+zipf_h_integral_inverse (double exponent, double x)
+{
+    double  t = x * (1.0 - exponent);
+
+    if (t < -1.0)
+        t = -1.0;
+
+    return exp (zipf_helper1 (t) * x);
+}
+
+/**
+ * sample_word:
+ *
+ * @ws: word source.
+ *
+ * Returns: index of a randomly-selected entry from the corpus of @ws.
+ **/
+static size_t
+sample_word (const struct word_source *ws)
+{
+    double  exponent = ws->exponent;
+    double  n = ws->corpus->count;
+
+    if (! ws->zipf) {
+        /* multiply rather than divide to scale to range */
+        return ((unsigned __int128)get_random_u64 () * ws->corpus->count) >> 64;
+    }
+
+    while (1) {
+        double  u;
+        double  x;
+        double  r;
+
+        r = (get_random_u64 () >> 11) * 0x1.0p-53;
+        u = ws->h_integral_n + r * (ws->h_integral_x1 - ws->h_integral_n);
+        x = zipf_h_integral_inverse (exponent, u);
+
+        r = floor (x + 0.5);
+        if (r < 1.0)
+            r = 1.0;
+        else if (r > n)
+            r = n;
+
+        if (r - x <= ws->s
+                || u >= zipf_h_integral (exponent, r + 0.5)
+                - zipf_h (exponent, r))
+            return (size_t)r - 1;
+    }
+}
+
+/**
+ * lex_word:
+ *
+ * @str: wide string following a '\w' escape,
+ * @len: number of characters available in @str,
+ * @ws: word source to fill in,
+ * @error: offset into @str of the first unexpected character.
+ *
+ * Parse a word escape of the form L"{PATH[,zipf[=EXPONENT]]}" and load
+ * the corpus at PATH. Entries are selected uniformly unless 'zipf' is
+ * specified, in which case the first entry is the most likely (as for a
+ * list of words ordered by frequency). The default exponent is 1.
+ *
+ * Returns: number of characters consumed, or 0 if @str is not a
+ * valid word escape (in which case @error is set).
+ **/
+size_t
+lex_word (const wchar_t       *str,
+          size_t               len,
+          struct word_source  *ws,
+          size_t              *error)
+{
+    wchar_t   wpath[PATH_MAX];
+    char      path[PATH_MAX * 4];
+    wchar_t  *option;
+    size_t    i = 0;
+    size_t    n = 0;
+    size_t    ret;
+
+    assert (str);
+    assert (ws);
+    assert (error);
+
+    memset (ws, 0, sizeof (struct word_source));
+
+    if (i >= len || str[i] != L'{')
+        goto error;
+    i++;
+
+    while (i < len && str[i] != L'}') {
+        if (n == PATH_MAX - 1)
+            goto error;
+        wpath[n++] = str[i++];
+    }
+
+    if (i >= len || ! n)
+        goto error;
+
+    wpath[n] = L'\0';
+    i++;
+
+    option = wcsrchr (wpath, L',');
+    if (option && ! wcsncmp (option, L",zipf", 5)) {
+        ws->zipf = 1;
+        ws->exponent = 1.0;
+
+        if (option[5] == L'=') {
+            wchar_t  *endptr;
+
+            errno = 0;
+            ws->exponent = wcstod (option + 6, &endptr);
+            if (errno || *endptr || ws->exponent <= 0.0) {
+                i = 1 + (option - wpath) + 6;
+                goto error;
+            }
+        } else if (option[5]) {
+            i = 1 + (option - wpath) + 5;
+            goto error;
+        }
+
+        *option = L'\0';
+    }
+
+    ret = wcstombs (path, wpath, sizeof (path));
+    if (ret == (size_t)-1 || ret == sizeof (path)) {
+        i = 1;
+        goto error;
+    }
+
+    ws->corpus = load_corpus (path);
+
+    if (ws->zipf) {
+        double  exponent = ws->exponent;
+
+        ws->h_integral_x1 = zipf_h_integral (exponent, 1.5) - 1.0;
+        ws->h_integral_n = zipf_h_integral (exponent,
+                ws->corpus->count + 0.5);
+        ws->s = 2.0 - zipf_h_integral_inverse (exponent,
+                zipf_h_integral (exponent, 2.5) - zipf_h (exponent, 2.0));
+    }
+
+    ws->next[0] = sample_word (ws);
+    ws->next[1] = sample_word (ws);
+
+    return i;
+
+error:
+    *error = i;
+    return 0;
+}
+
+/**
+ * emit_word:
+ *
+ * @fd: file descriptor to write output to,
+ * @ws: word source.
+ *
+ * Display a randomly-selected entry from the corpus of @ws. The entry
+ * is copied directly from the mapped file.
+ *
+ * Entries are selected two calls ahead of being displayed so that
+ * their index and then their data can be prefetched, hiding the
+ * memory latency of random access to a large corpus.
+ **/
+void
+emit_word (int fd, struct word_source *ws)
+{
+    const struct corpus  *corpus;
+    size_t                k;
+
+    assert (ws);
+
+    corpus = ws->corpus;
+
+    k = ws->next[0];
+    ws->next[0] = ws->next[1];
+    ws->next[1] = sample_word (ws);
+
+    __builtin_prefetch (&corpus->entries[ws->next[1]]);
+    __builtin_prefetch (corpus->map + corpus->entries[ws->next[0]].offset);
+
+    write_output (fd, corpus->map + corpus->entries[k].offset,
+            corpus->entries[k].length);
+}
+
+/**
+ * lex_malformed:
+ *
+ * @str: wide string following a '\G' escape,
+ * @len: number of characters available in @str,
+ * @m: malformed escape to fill in,
+ * @error: offset into @str of the first unexpected character.
+ *
+ * Parse a malformed UTF-8 escape of the form L"{KIND[=WEIGHT],...}"
+ * where KIND is one of the names in malformed_names or 'any' (meaning
+ * all kinds, equally weighted). WEIGHT defaults to 1.
+ *
+ * Returns: number of characters consumed, or 0 if @str is not a
+ * valid malformed escape (in which case @error is set).
+ **/
+size_t
+lex_malformed (const wchar_t     *str,
+               size_t             len,
+               struct malformed  *m,
+               size_t            *error)
+{
+    size_t  i = 0;
+    size_t  k;
+
+    assert (str);
+    assert (m);
+    assert (error);
+
+    memset (m, 0, sizeof (struct malformed));
+
+    if (i >= len || str[i] != L'{')
+        goto error;
+    i++;
+
+    while (1) {
+        char           name[16];
+        size_t         n = 0;
+        unsigned long  weight = 1;
+
+        while (i < len && n < sizeof (name) - 1
+                && iswalpha (str[i]) && (unsigned int)str[i] < 128)
+            name[n++] = (char)str[i++];
+
+        name[n] = '\0';
+
+        if (i < len && str[i] == L'=') {
+            unsigned long long  value;
+            int                 digits;
+
+            i++;
+            if (lex_number (str, len, &i, &value, &digits) < 0
+                    || value > 1000000)
+                goto error;
+            weight = value;
+        }
+
+        if (! strcmp (name, "any")) {
+            for (k = 0; k < MALFORMED_KINDS; k++)
+                m->weights[k] += weight;
+        } else {
+            for (k = 0; k < MALFORMED_KINDS; k++) {
+                if (! strcmp (name, malformed_names[k]))
+                    break;
+            }
+
+            if (k == MALFORMED_KINDS) {
+                /* report the start of the name */
+                i -= n;
+                goto error;
+            }
+
+            m->weights[k] += weight;
+        }
+
+        if (i < len && str[i] == L',') {
+            i++;
+            continue;
+        }
+
+        break;
+    }
+
+    if (i >= len || str[i] != L'}')
+        goto error;
+    i++;
+
+    for (k = 0; k < MALFORMED_KINDS; k++)
+        m->total += m->weights[k];
+
+    if (! m->total)
+        goto error;
+
+    return i;
+
+error:
+    *error = i;
+    return 0;
+}
+
+/**
+ * emit_malformed:
+ *
+ * @fd: file descriptor to write output to,
+ * @m: malformed escape.
+ *
+ * Display a randomly-generated malformed UTF-8 sequence of a kind
+ * chosen according to the weights in @m. Bytes are written directly
+ * to the output buffer, bypassing the usual multi-byte conversion.
+ **/
+void
+emit_malformed (int fd, const struct malformed *m)
+{
+    unsigned char  bytes[6];
+    size_t         n = 0;
+    uint64_t       r;
+    unsigned int   pick;
+    int            kind;
+
+    assert (m);
+
+    r = get_random_u64 ();
+
+    pick = (unsigned int)(r % m->total);
+    r >>= 24;
+
+    for (kind = 0; pick >= m->weights[kind]; kind++)
+        pick -= m->weights[kind];
+
+/* next random continuation byte (10xxxxxx) */
+#define CONT() (0x80 | (unsigned char)((r >>= 6), r & 0x3f))
+
+    switch (kind) {
+
+        case MALFORMED_OVERLONG:
+            switch (r++ % 3) {
+                case 0: /* 2 byte form of U+0000 - U+007F */
+                    bytes[n++] = 0xc0 | ((r >> 2) & 0x01);
+                    bytes[n++] = CONT ();
+                    break;
+
+                case 1: /* 3 byte form of U+0000 - U+07FF */
+                    bytes[n++] = 0xe0;
+                    bytes[n++] = 0x80 | ((r >> 2) & 0x1f);
+                    bytes[n++] = CONT ();
+                    break;
+
+                default: /* 4 byte form of U+0000 - U+FFFF */
+                    bytes[n++] = 0xf0;
+                    bytes[n++] = 0x80 | ((r >> 2) & 0x0f);
+                    bytes[n++] = CONT ();
+                    bytes[n++] = CONT ();
+                    break;
+            }
+            break;
+
+        case MALFORMED_SURROGATE:
+            bytes[n++] = 0xed;
+            bytes[n++] = 0xa0 | (r & 0x1f);
+            bytes[n++] = CONT ();
+            break;
+
+        case MALFORMED_TRUNCATED:
+            {
+                /* length of complete sequence (2-4) */
+                size_t  full = 2 + (r % 3);
+
+                r >>= 2;
+
+                switch (full) {
+                    case 2:
+                        bytes[n++] = 0xc2 + (r % 30);
+                        break;
+                    case 3:
+                        bytes[n++] = 0xe1 + (r % 12);
+                        break;
+                    default:
+                        bytes[n++] = 0xf1 + (r % 3);
+                        break;
+                }
+
+                r >>= 5;
+
+                /* keep between 0 and full-2 continuation bytes */
+                for (pick = (unsigned int)(r % (full - 1)); pick; pick--)
+                    bytes[n++] = CONT ();
+            }
+            break;
+
+        case MALFORMED_CONTINUATION:
+            for (pick = 1 + (unsigned int)(r % 3); pick; pick--)
+                bytes[n++] = CONT ();
+            break;
+
+        case MALFORMED_TOO_LARGE:
+            switch (r++ % 3) {
+                case 0: /* U+110000 - U+13FFFF */
+                    bytes[n++] = 0xf4;
+                    bytes[n++] = 0x90 | ((r >> 2) & 0x2f);
+                    break;
+
+                case 1: /* U+140000 - U+1FFFFF */
+                    bytes[n++] = 0xf5 + ((r >> 2) % 3);
+                    bytes[n++] = CONT ();
+                    break;
+
+                default: /* obsolete 5 byte form */
+                    bytes[n++] = 0xf8 | ((r >> 2) & 0x03);
+                    bytes[n++] = CONT ();
+                    bytes[n++] = CONT ();
+                    break;
+            }
+            bytes[n++] = CONT ();
+            bytes[n++] = CONT ();
+            break;
+    }
+
+#undef CONT
+
+    memcpy (reserve_output (fd, n), bytes, n);
+}
+
+/**
+ * lex_compressible:
+ *
+ * @str: wide string following a '\z' escape,
+ * @len: number of characters available in @str,
+ * @z: compressible data escape to fill in,
+ * @error: offset into @str of the first unexpected character.
+ *
+ * Parse a compressible data escape of the form L"{RATIO[,SIZE[K]]}"
+ * where RATIO is the compression ratio (at least 1) the data should
+ * achieve and SIZE is the number of bytes to display (default
+ * COMPRESSIBLE_DEFAULT_SIZE, at most OUTPUT_BUFSIZE).
+ *
+ * Returns: number of characters consumed, or 0 if @str is not a
+ * valid compressible data escape (in which case @error is set).
+ **/
+size_t
+lex_compressible (const wchar_t        *str,
+                  size_t                len,
+                  struct compressible  *z,
+                  size_t               *error)
+{
+    wchar_t   number[32];
+    wchar_t  *endptr;
+    size_t    i = 0;
+    size_t    n = 0;
+    size_t    segments;
+    double    literal;
+
+    assert (str);
+    assert (z);
+    assert (error);
+
+    memset (z, 0, sizeof (struct compressible));
+    z->size = COMPRESSIBLE_DEFAULT_SIZE;
+
+    if (i >= len || str[i] != L'{')
+        goto error;
+    i++;
+
+    while (i < len && n < 31 && (iswdigit (str[i]) || str[i] == L'.'))
+        number[n++] = str[i++];
+
+    number[n] = L'\0';
+
+    errno = 0;
+    z->ratio = wcstod (number, &endptr);
+    if (! n || errno || *endptr
+            || z->ratio < 1.0 || z->ratio > COMPRESSIBLE_MAX_RATIO) {
+        i -= n;
+        goto error;
+    }
+
+    if (i < len && str[i] == L',') {
+        unsigned long long  value;
+        int                 digits;
+
+        i++;
+        if (lex_number (str, len, &i, &value, &digits) < 0)
+            goto error;
+
+        if (i < len && (str[i] == L'K' || str[i] == L'k')) {
+            value *= 1024;
+            i++;
+        }
+
+        if (! value || value > OUTPUT_BUFSIZE)
+            goto error;
+
+        z->size = (size_t)value;
+    }
+
+    if (i >= len || str[i] != L'}')
+        goto error;
+    i++;
+
+    /* Longer segments mean fewer back-references, so less of the
+     * output is spent on encoding them at high ratios.
+     */
+    z->period = (size_t)(COMPRESSIBLE_LITERAL_RUN * z->ratio);
+    if (z->period < COMPRESSIBLE_MIN_PERIOD)
+        z->period = COMPRESSIBLE_MIN_PERIOD;
+    if (z->period > COMPRESSIBLE_MAX_PERIOD)
+        z->period = COMPRESSIBLE_MAX_PERIOD;
+
+    if (z->period > z->size)
+        z->period = z->size;
+
+    /* spread the bytes the compressed form may use, less the cost of
+     * encoding each back-reference, evenly over the segments.
      */
-    assert (mbsrtowcs (wstr, &p, len, NULL) == len);
+    segments = (z->size + z->period - 1) / z->period;
+
+    if (z->ratio == 1.0) {
+        literal = (double)z->period;
+    } else {
+        literal = ((double)z->size / z->ratio
+                - COMPRESSIBLE_MATCH_COST * (double)segments)
+            / (double)segments;
+        if (literal < 0.0)
+            literal = 0.0;
+    }
+
+    z->literal = (uint64_t)(literal * 65536.0);
+
+    return i;
+
+error:
+    *error = i;
+    return 0;
+}
+
+/**
+ * fill_random:
+ *
+ * @out: buffer to fill,
+ * @len: number of bytes to write to @out,
+ * @seed: random value.
+ *
+ * Fill @out with incompressible bytes derived from @seed. Each word
+ * is an independent SplitMix64 hash of its position so the loop
+ * carries no dependency and vectorises.
+ **/
+static void
+fill_random (unsigned char *out, size_t len, uint64_t seed)
+{
+    uint64_t  z;
+    size_t    i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        z = seed + (i + 8) * 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        memcpy (out + i, &z, 8);
+    }
 
-    if (len == (size_t)-1) {
-        fwprintf (stderr,
-                L"%s: %s\n",
-                L"ERROR",
-                L"Failed to convert string to wide string",
-                str);
-        exit (EXIT_FAILURE);
+    if (i < len) {
+        z = seed + (i + 8) * 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        memcpy (out + i, &z, len - i);
     }
+}
 
-    /* ensure it's terminated */
-    wstr[len] = L'\0';
+/**
+ * emit_compressible:
+ *
+ * @fd: file descriptor to write output to,
+ * @z: compressible data escape.
+ *
+ * Display @z->size bytes that compress by approximately @z->ratio.
+ *
+ * The data is built from segments, each being a run of random bytes
+ * followed by a back-reference: a copy of earlier data from the same
+ * display, exactly what an LZ77-style compressor (gzip, zstd, lz4)
+ * finds and encodes cheaply. The proportion of random bytes therefore
+ * sets the ratio. Bytes are written directly to the output buffer,
+ * bypassing the usual multi-byte conversion.
+ **/
+void
+emit_compressible (int fd, const struct compressible *z)
+{
+    unsigned char  *out;
+    size_t          pos = 0;
+    size_t          literal;
+    size_t          match;
+    size_t          distance;
+    size_t          n;
+    uint64_t        r;
 
-    for (i=0; i < len; ++i) {
+    assert (z);
 
-        c = wstr[i];
+    out = (unsigned char *)reserve_output (fd, z->size);
 
-        if (disable_escapes)
-            goto out;
+    while (pos < z->size) {
+        r = get_random_u64 ();
 
-        if (c == escape_prefix) {
-            /* Record position of escape character.
-             *
-             * This will collapse any number of contiguous escape chars
-             * into a single one.
-             */
-            escape = i;
-            continue;
-        }
+        /* dither the fractional part so the mean is exact */
+        literal = (size_t)((z->literal + (r & 0xffff)) >> 16);
+        if (! pos && ! literal)
+            literal = 1;
 
-        /* Consider the next character after the escape character */
-        if (escape != -1 && (escape+1) == i) {
-            switch (c) {
+        if (literal > z->size - pos)
+            literal = z->size - pos;
 
-                case L'o': /* 1-3 byte octal value */
-                    {
-                        wchar_t  buffer[3+1];
-                        size_t   offset = i+1;
+        match = z->period - literal;
+        if (match > z->size - pos - literal)
+            match = z->size - pos - literal;
 
-                        consumed = 0;
+        fill_random (out + pos, literal, get_random_u64 ());
+        pos += literal;
 
-                        wmemset (buffer, L'\0', sizeof (buffer) / sizeof (wchar_t));
+        if (! match)
+            continue;
 
-                        /* handle 1st octal char */
-                        if (is_octal (wstr[offset])) {
-                            buffer[0] = wstr[offset];
-                            consumed++;
-                            offset++;
-                        }
+        n = pos < COMPRESSIBLE_WINDOW ? pos : COMPRESSIBLE_WINDOW;
+        distance = 1 + (size_t)((r >> 16) % n);
 
-                        /* handle optional 2nd octal char */
-                        if (is_octal (wstr[offset])) {
-                            buffer[1] = wstr[offset];
-                            consumed++;
-                            offset++;
-                        }
+        /* an overlapping copy repeats the last @distance bytes; each
+         * copy doubles the length of the repeating region.
+         */
+        while (match) {
+            n = distance < match ? distance : match;
+            memcpy (out + pos, out + pos - distance, n);
+            pos += n;
+            match -= n;
+            distance += n;
+        }
+    }
+}
 
-                        /* handle optional 3rd octal char */
-                        if (is_octal (wstr[offset])) {
-                            buffer[2] = wstr[offset];
-                            consumed++;
-                            offset++;
-                        }
+/**
+ * lex_bytes:
+ *
+ * @str: wide string following a '\X' escape,
+ * @len: number of characters available in @str,
+ * @out: buffer to write bytes to (at least @len / 2 bytes),
+ * @n: number of bytes written to @out,
+ * @error: offset into @str of the first unexpected character.
+ *
+ * Parse a raw bytes escape of the form L"{HEX}" where HEX is an even
+ * number of hexadecimal digits, two per byte.
+ *
+ * Returns: number of characters consumed, or 0 if @str is not a
+ * valid bytes escape (in which case @error is set).
+ **/
+size_t
+lex_bytes (const wchar_t  *str,
+           size_t          len,
+           char           *out,
+           size_t         *n,
+           size_t         *error)
+{
+    size_t  i = 0;
+    size_t  count = 0;
+    int     hi;
+    int     lo;
 
-                        if (get_oct_char (buffer, &c) < 0) {
-                            escape = -1;
-                            goto not_an_escape;
-                        }
+    assert (str);
+    assert (out);
+    assert (n);
+    assert (error);
 
-                        i += consumed;
+    if (i >= len || str[i] != L'{')
+        goto error;
+    i++;
 
-                        escape = -1;
-                    }
-                    break;
+    while (i + 1 < len
+            && (hi = digit_value (str[i], CLASS_HEX)) >= 0
+            && (lo = digit_value (str[i+1], CLASS_HEX)) >= 0) {
+        out[count++] = (char)((hi << 4) | lo);
+        i += 2;
+    }
 
-                case L'u': /* 2-byte unicode/UTF-8 character */
-                case L'U': /* 4-byte unicode/UTF-8 character */
-                    {
-                        wchar_t  buffer[8+1];
-                        size_t   offset = i+1;
-                        int      b;
+    /* report the missing second digit of an incomplete byte */
+    if (i < len && digit_value (str[i], CLASS_HEX) >= 0) {
+        i++;
+        goto error;
+    }
 
-                        consumed = 0;
+    if (! count || i >= len || str[i] != L'}')
+        goto error;
+    i++;
 
-                        wmemset (buffer, L'\0', sizeof (buffer) / sizeof (wchar_t));
+    *n = count;
 
-                        for (b = 0; b < 8; b++) {
-                            if (is_hex (wstr[offset])) {
-                                buffer[b] = wstr[offset];
-                                consumed++;
-                                offset++;
-                                if (c == L'u' && b == 3)
-                                    break;
-                            } else
-                                break;
+    return i;
 
-                        }
+error:
+    *error = i;
+    return 0;
+}
 
-                        if (get_hex_char (buffer, &c) < 0) {
-                            escape = -1;
-                            goto not_an_escape;
-                        }
+/* units a stream delay may have (none meaning seconds) */
+static const char *stream_delay_suffixes[] = {
+    "", "d", "h", "m", "s", "ds", "cs", "ms", "us", "ns", NULL
+};
 
-                        i += consumed;
+/**
+ * add_stream:
+ *
+ * @spec: stream specification,
+ * @separator_specified: TRUE if a separator value has been specified,
+ * @separator: separator to use.
+ *
+ * Add the stream described by @spec to the group of streams that
+ * will be run by the next call to run_streams(). @spec has the form:
+ *
+ *     FD,DELAY[,COUNT]:STRING
+ *
+ * STRING is displayed on FD every DELAY (see parse_delay()), COUNT
+ * times (-1, the default, for no limit).
+ **/
+void
+add_stream (const char  *spec,
+            int          separator_specified,
+            int          separator)
+{
+    struct stream   *stream;
+    struct stream  **new;
+    const char      *p;
+    const char      *str;
+    char             delay[32];
+    const char      *suffix;
+    size_t           i;
+    char            *end;
+    long             value;
+    size_t           len;
+
+    assert (spec);
+
+    str = strchr (spec, ':');
+    if (! str)
+        die ("invalid stream '%s'", spec);
+    str++;
+
+    stream = calloc (1, sizeof (struct stream));
+    if (! stream)
+        die ("failed to allocate space for stream");
+
+    new = realloc (streams, (stream_count + 1) * sizeof (struct stream *));
+    if (! new) {
+        free (stream);
+        die ("failed to allocate space for stream");
+    }
 
-                        escape = -1;
-                    }
+    /* added before parsing so that it is freed if that fails */
+    stream->id = stream_count;
 
-                    break;
+    streams = new;
+    streams[stream_count++] = stream;
 
-                case L'x': /* 1 or 2-byte hexadecimal value */
-                    {
-                        wchar_t  buffer[2+1];
-                        size_t   offset = i+1;
+    errno = 0;
+    value = strtol (spec, &end, 10);
+    if (end == spec || *end != ',' || value < 0 || value > INT_MAX || errno)
+        die ("invalid stream descriptor in '%s'", spec);
+    stream->fd = (int)value;
+
+    p = end + 1;
+    len = strcspn (p, ",:");
+    if (! len || len >= sizeof (delay))
+        die ("invalid stream delay in '%s'", spec);
+    memcpy (delay, p, len);
+    delay[len] = '\0';
+
+    /* parse_delay() ignores anything it does not recognise */
+    suffix = delay + strspn (delay, "0123456789");
+    for (i = 0; stream_delay_suffixes[i]; i++) {
+        if (! strcmp (suffix, stream_delay_suffixes[i]))
+            break;
+    }
 
-                        consumed = 0;
+    if (suffix == delay || ! stream_delay_suffixes[i]
+            || parse_delay (delay, &stream->interval) < 0)
+        die ("invalid stream delay in '%s'", spec);
 
-                        wmemset (buffer, L'\0', sizeof (buffer) / sizeof (wchar_t));
+    p += len;
+    stream->repeat = -1;
 
-                        /* handle first hex char */
-                        if (is_hex (wstr[offset])) {
-                            buffer[0] = wstr[offset];
-                            consumed++;
-                            offset++;
-                        }
+    if (*p == ',') {
+        p++;
+        errno = 0;
+        value = strtol (p, &end, 10);
+        if (end == p || *end != ':' || errno || ! value || value < -1)
+            die ("invalid stream count in '%s'", spec);
+        stream->repeat = value;
+    }
 
-                        /* handle optional 2nd hex char */
-                        if (is_hex (wstr[offset])) {
-                            buffer[1] = wstr[offset];
-                            consumed++;
-                            offset++;
-                        }
+    stream->separator_specified = separator_specified;
+    stream->separator = separator;
 
-                        if (get_hex_char (buffer, &c) < 0) {
-                            escape = -1;
-                            goto not_an_escape;
-                        }
+    lex_string (str, &stream->lexed);
+}
 
-                        i += consumed;
+/**
+ * free_streams:
+ *
+ * Free the group of streams added by add_stream() along with the
+ * event loop used to run them.
+ **/
+void
+free_streams (void)
+{
+    size_t  i;
 
-                        escape = -1;
-                    }
-                    break;
+    if (stream_timer_fd >= 0)
+        close (stream_timer_fd);
 
-                case L'{': /* range */
-                    {
-                        wchar_t  *expanded_range;
-                        size_t    expanded_len;
+    if (stream_epoll_fd >= 0)
+        close (stream_epoll_fd);
 
-                        if (generate_chars (wstr+i, &expanded_range,
-                                    &expanded_len, &consumed) < 0)
-                            goto not_an_escape;
+    stream_timer_fd = stream_epoll_fd = -1;
 
-                        wc = expanded_range;
-                        while (expanded_len) {
-                            OUT_WCHAR (fd, *wc, delay);
-                            if (separator_specified && expanded_len > 1)
-                                OUT_WCHAR (fd, separator, 0);
-                            wc++;
-                            expanded_len--;
-                        }
-                        free (expanded_range);
+    for (i = 0; i < stream_count; i++) {
+        free_lexed_string (&streams[i]->lexed);
+        free (streams[i]);
+    }
 
-                        escape = -1;
+    free (streams);
+    streams = NULL;
+    stream_count = 0;
+}
 
-                        /* jump over the already-handled pattern */
-                        i += (consumed - 1);
+#ifdef HAVE_STREAMS
 
-                        /* don't output any chars - we've already
-                         * handled that!
-                         */
-                        continue;
-                    }
-                    break;
+/**
+ * wheel_due_tick:
+ *
+ * @wheel: timer wheel,
+ * @stream: stream.
+ *
+ * Returns: tick at which @stream should next be displayed.
+ **/
+static inline uint64_t
+wheel_due_tick (const struct timer_wheel *wheel, const struct stream *stream)
+{
+    uint64_t  tick = stream->due / WHEEL_TICK;
 
-not_an_escape:
-                default:
-                    {
-                        int tmp;
+    return tick < wheel->tick ? wheel->tick : tick;
+}
 
-                        tmp = simple_escape_to_literal (c);
+/**
+ * wheel_insert:
+ *
+ * @wheel: timer wheel,
+ * @stream: stream to schedule.
+ *
+ * Add @stream to @wheel, in the slot for the tick it is next due.
+ **/
+static void
+wheel_insert (struct timer_wheel *wheel, struct stream *stream)
+{
+    struct stream  **slot;
 
-                        if (tmp == -1) {
-                            /* invalid escape, so display escape (and
-                             * subsequent char) uninterpreted.
-                             */
-                            OUT_WCHAR (fd, escape_prefix, delay);
-                        } else {
-                            c = tmp;
+    slot = &wheel->slots[wheel_due_tick (wheel, stream) & (WHEEL_SLOTS - 1)];
 
-                            escape = -1;
-                            break;
-                        }
+    stream->next = *slot;
+    *slot = stream;
+    wheel->count++;
+}
 
-                        if (c != escape_prefix) {
-                            OUT_WCHAR (fd, c, delay);
-                        }
-                    }
-            }
+/**
+ * wheel_next_tick:
+ *
+ * @wheel: non-empty timer wheel.
+ *
+ * Returns: earliest tick at which a stream in @wheel is due.
+ **/
+static uint64_t
+wheel_next_tick (const struct timer_wheel *wheel)
+{
+    const struct stream  *stream;
+    uint64_t              next = UINT64_MAX;
+    uint64_t              tick;
+    size_t                i;
+
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        stream = wheel->slots[(wheel->tick + i) & (WHEEL_SLOTS - 1)];
+
+        for (; stream; stream = stream->next) {
+            tick = wheel_due_tick (wheel, stream);
+            if (tick < next)
+                next = tick;
         }
 
-out:
-        OUT_WCHAR(fd, c, delay);
-        if (separator_specified && len > 1)
-            OUT_WCHAR (fd, separator, 0);
+        /* nothing in a later slot can be due sooner */
+        if (next == wheel->tick + i)
+            break;
     }
 
-    if (wstr)
-        free (wstr);
+    return next;
 }
 
-
 /**
- * signal_handler:
+ * wheel_expire:
  *
- * @signum: signal number passed to this function.
+ * @wheel: timer wheel,
+ * @now: current tick.
  *
- * Handle interrupt signal by simply returning.
+ * Remove all streams due at or before @now from @wheel.
+ *
+ * Returns: list of expired streams, ordered by the time they were due
+ * and then by their position on the command-line.
  **/
-void
-signal_handler (int signum)
+static struct stream *
+wheel_expire (struct timer_wheel *wheel, uint64_t now)
 {
-    switch (signum)
-    {
-        case SIGINT:
-            return;
-            break;
+    struct stream   *ready = NULL;
+    struct stream  **link;
+    struct stream  **pos;
+    struct stream   *stream;
+    uint64_t         ticks;
+    size_t           i;
+
+    ticks = now - wheel->tick + 1;
+    if (ticks > WHEEL_SLOTS)
+        ticks = WHEEL_SLOTS;
+
+    for (i = 0; i < ticks; i++) {
+        link = &wheel->slots[(wheel->tick + i) & (WHEEL_SLOTS - 1)];
+
+        while ((stream = *link)) {
+            if (wheel_due_tick (wheel, stream) > now) {
+                link = &stream->next;
+                continue;
+            }
 
-        default:
-            exit (EXIT_SUCCESS);
-            break;
+            *link = stream->next;
+            wheel->count--;
+
+            for (pos = &ready; *pos; pos = &(*pos)->next) {
+                if ((*pos)->due > stream->due
+                        || ((*pos)->due == stream->due
+                            && (*pos)->id > stream->id))
+                    break;
+            }
+
+            stream->next = *pos;
+            *pos = stream;
+        }
     }
+
+    /* streams still behind schedule are re-inserted at @now */
+    wheel->tick = now;
+
+    return ready;
 }
 
 /**
- * handle_sleep:
- *
- * @str: string representing time to sleep for.
- *
- * Sleep for time specified by @str.
- *
- * Recognised formats:
- *
- *     <num>ns : nano-seconds (1/1,000,000,000 second)
- *     <num>us : micro-seconds (1/1,000,000 second)
- *     <num>ms : milli-seconds (1/1,000 second)
- *     <num>cs : centi-seconds (1/100 second)
- *     <num>ds : deci-seconds (1/10 second)
- *     <num>s  : seconds
- *     <num>m  : minutes
- *     <num>h  : hours
- *     <num>h  : days
- *     <num>   : seconds
+ * run_streams:
  *
- * if <num> is -1, sleep until any signal is received.
+ * Display all streams added by add_stream() concurrently, each at its
+ * own pace, until every stream has been displayed the required number
+ * of times. Streams are scheduled using a timer wheel driven by a
+ * single timerfd, so any number of streams can be run by one thread.
  **/
 void
-handle_sleep (const char *str)
+run_streams (void)
 {
-    long              secs;
-    unsigned int      sleep_time;
-    size_t            len;
-    unsigned int      multiplier = 0;
-    struct timespec   ts;
-    struct timespec   rem;
-    int               ret;
-    const char       *posn;
+    struct timer_wheel   wheel;
+    struct epoll_event   event;
+    struct itimerspec    its;
+    struct stream       *ready;
+    struct stream       *stream;
+    uint64_t             now;
+    uint64_t             next;
+    uint64_t             expirations;
+    int                  ret;
+    size_t               i;
+    size_t               burst;
+
+    if (! stream_count)
+        return;
 
-    len = strlen (str);
-    secs = atol (str);
+    /* global so that they are closed should a display exit */
+    stream_epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (stream_epoll_fd < 0)
+        die ("failed to create event loop");
 
-    posn = &str[len-2];
+    stream_timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (stream_timer_fd < 0)
+        die ("failed to create timer");
 
-    if (strstr (str, "cs") == posn) {
-        /* Centi-seconds:
-         *
-         * 10 ^ (-2)
-         *
-         * 1/100th of a second.
-         * (1 hundredth of a second).
-         */
-        if (secs > 99)
-            secs = 99;
+    memset (&event, 0, sizeof (event));
+    event.events = EPOLLIN;
+    event.data.fd = stream_timer_fd;
 
-        ts.tv_nsec = secs * 10000000;
+    if (epoll_ctl (stream_epoll_fd, EPOLL_CTL_ADD, stream_timer_fd,
+                &event) < 0)
+        die ("failed to add timer to event loop");
 
-    } else if (strstr (str, "ds") == posn) {
-        /* Deci-seconds:
-         *
-         * 10 ^ (-1)
-         *
-         * 1/10th of a second.
-         * (1 tenth of a second).
-         */
-        if (secs > 9)
-            secs = 9;
+    memset (&wheel, 0, sizeof (wheel));
+    memset (&its, 0, sizeof (its));
 
-        ts.tv_nsec = secs * 100000000;
+    now = monotonic_ns ();
+    wheel.tick = now / WHEEL_TICK;
 
-    } else if (strstr (str, "ms") == posn) {
-        /* Milli-seconds:
-         *
-         * 10 ^ (-3)
-         *
-         * 1/1000th of a second.
-         * (1 thousandth of a second).
-         */
-        if (secs > 999)
-            secs = 999;
+    for (i = 0; i < stream_count; i++) {
+        streams[i]->due = now;
+        wheel_insert (&wheel, streams[i]);
+    }
 
-        ts.tv_nsec = secs * 1000000;
+    while (wheel.count) {
+        next = wheel_next_tick (&wheel);
 
-    } else if (strstr (str, "ns") == posn) {
-        /* Nano-seconds:
-         *
-         * 10 ^ (-9)
-         *
-         * 1/1,000,000,000 of a second
-         * (1 billionth of a second)
-         */
-        if (secs > 999999999)
-            secs = 999999999;
-        ts.tv_nsec = secs;
+        if (next > now / WHEEL_TICK) {
+            its.it_value.tv_sec = (time_t)((next * WHEEL_TICK) / 1000000000);
+            its.it_value.tv_nsec = (long)((next * WHEEL_TICK) % 1000000000);
 
-    } else if (strstr (str, "us") == posn) {
-        /* Micro-seconds:
-         *
-         * 10 ^ (-6)
-         *
-         * 1/1,000,000th of a second
-         * (1 millionth of a second).
-         */
-        if (secs > 999999)
-            secs = 999999;
+            if (timerfd_settime (stream_timer_fd, TFD_TIMER_ABSTIME,
+                        &its, NULL) < 0)
+                die ("failed to set timer");
 
-        ts.tv_nsec = secs * 1000;
+            do {
+                ret = epoll_wait (stream_epoll_fd, &event, 1, -1);
+            } while (ret < 0 && errno == EINTR);
 
-    } else {
-        switch (str[len-1])
-        {
-            case 'd':
-                /* Days */
-                multiplier = (60 * 60 * 24);
-                break;
+            if (ret < 0)
+                die ("failed to wait for events");
 
-            case 'h':
-                /* Hours */
-                multiplier = (60 * 60);
-                break;
+            if (read (stream_timer_fd, &expirations, sizeof (expirations)) < 0
+                    && errno != EAGAIN)
+                die ("failed to read timer");
 
-            case 'm':
-                /* Minutes */
-                multiplier = 60;
-                break;
+            now = monotonic_ns ();
+        }
 
-            case 's':
-                /* Seconds */
-                multiplier = 1;
-                break;
+        ready = wheel_expire (&wheel, now / WHEEL_TICK);
 
-            default:
-                /* No suffix, so must be seconds */
-                multiplier = 1;
-                break;
+        while ((stream = ready)) {
+            ready = stream->next;
+
+            for (burst = 0;
+                    burst < STREAM_MAX_BURST && stream->repeat
+                    && stream->due <= now;
+                    burst++) {
+                emit_tokens (stream->fd, &stream->lexed, NULL,
+                        stream->separator_specified, stream->separator);
+
+                stream->due += stream->interval;
+
+                if (stream->repeat > 0)
+                    stream->repeat--;
+            }
+
+            if (stream->repeat)
+                wheel_insert (&wheel, stream);
         }
-    }
 
-    if (secs == -1) {
-        wait_for_intr ();
-        return;
-    }
+        flush_output ();
 
-    if (multiplier) {
-        sleep_time = (unsigned int)secs * multiplier;
-        sleep (sleep_time);
-        return;
+        now = monotonic_ns ();
     }
 
-    ts.tv_sec = 0;
+    free_streams ();
+}
 
-    do {
-        ret = nanosleep (&ts, &rem);
-        if (ret) {
-            ts.tv_sec = rem.tv_sec;
-            ts.tv_nsec = rem.tv_nsec;
+#else /* ! HAVE_STREAMS */
 
-            rem.tv_sec = 0;
-            rem.tv_nsec = 0;
-        }
-    } while (ret);
+void
+run_streams (void)
+{
+    if (stream_count)
+        die ("streams are not supported on this platform");
 }
 
+#endif /* HAVE_STREAMS */
+
 /**
- * wait_for_intr:
+ * simple_escape_to_literal:
  *
- * Wait indefinately for an interrupt signal.
+ * @value: value to check.
+ *
+ * Convert specified character @value (which is assumed to have
+ * already been parsed as part of an escape sequence) into
+ * its literal value.
+ *
+ * Returns: literal value, or -1 on error (denoting @value is not
+ * actually a valid escape character).
  **/
-void
-wait_for_intr (void)
+int
+simple_escape_to_literal (int value)
 {
-    int ret;
+    const struct escape_spec *spec = get_escape_spec (value);
 
-    /* save any old signal handlers */
-    ret = sigaction (SIGINT, NULL, &oldact);
+    switch (spec->kind) {
 
-    if (ret != 0) {
-        fwprintf (stderr,
-                L"%s: %s\n",
-                L"ERROR",
-                L"Unable to save old signal handler");
-        exit (EXIT_FAILURE);
-    }
+        case ESCAPE_SIMPLE:
+            return spec->value;
 
-    /* specify handler */
-    act.sa_handler = signal_handler;
+        case ESCAPE_RANDOM: /* generate a random char */
+            return (int)get_random_char ();
 
-    /* register our own handler */
-    ret = sigaction (SIGINT, &act, NULL);
-    if (ret != 0) {
-        fwprintf (stderr,
-                L"%s: %s\n",
-                L"ERROR",
-                L"Unable to set new signal handler");
-        exit (EXIT_FAILURE);
+        case ESCAPE_STOP: /* no further output */
+            finish_output ();
+            utfout_exit (EXIT_SUCCESS);
+            break;
+
+        default:
+            break;
     }
 
-    pause ();
+    return -1;
 }
 
+#ifdef UTFOUT_BUILTIN
+
+/* where utfout_exit() returns to the shell from */
+static jmp_buf  builtin_exit;
+static int      builtin_status;
+
+/**
+ * struct builtin_global:
+ *
+ * @addr: address of global variable,
+ * @size: size of variable,
+ * @initial: copy of the variable's value when the builtin was loaded.
+ **/
+struct builtin_global {
+    void    *addr;
+    size_t   size;
+    void    *initial;
+};
+
+#define BUILTIN_GLOBAL(var) { &(var), sizeof (var), NULL }
+
+/* state that is reset before each run of the builtin */
+static struct builtin_global builtin_globals[] = {
+    BUILTIN_GLOBAL (escape_prefix),
+    BUILTIN_GLOBAL (tty_fd),
+    BUILTIN_GLOBAL (last_str),
+    BUILTIN_GLOBAL (disable_escapes),
+    BUILTIN_GLOBAL (strict),
+    BUILTIN_GLOBAL (bytes_mode),
+    BUILTIN_GLOBAL (exit_handler_count),
+    BUILTIN_GLOBAL (clocks),
+    BUILTIN_GLOBAL (clock_update),
+    BUILTIN_GLOBAL (corpora),
+    BUILTIN_GLOBAL (profile),
+    BUILTIN_GLOBAL (profiles),
+    BUILTIN_GLOBAL (profile_report),
+    BUILTIN_GLOBAL (last_block),
+    BUILTIN_GLOBAL (open_block),
+    BUILTIN_GLOBAL (pending_insn),
+    BUILTIN_GLOBAL (output),
+    BUILTIN_GLOBAL (frame),
+    BUILTIN_GLOBAL (output_encoding),
+    BUILTIN_GLOBAL (output_bom),
+    BUILTIN_GLOBAL (bom_fds),
+    BUILTIN_GLOBAL (bom_fd_count),
+    BUILTIN_GLOBAL (write_stats),
+    BUILTIN_GLOBAL (delay_stats),
+    BUILTIN_GLOBAL (stats_format),
+    BUILTIN_GLOBAL (checksum_type),
+    BUILTIN_GLOBAL (checksum_fd),
+    BUILTIN_GLOBAL (checksums),
+    BUILTIN_GLOBAL (checksum_count),
+    BUILTIN_GLOBAL (random_state),
+    BUILTIN_GLOBAL (window),
+    BUILTIN_GLOBAL (skip_repeats),
+    BUILTIN_GLOBAL (shards),
+    BUILTIN_GLOBAL (datagrams),
+    BUILTIN_GLOBAL (file_options),
+    BUILTIN_GLOBAL (files),
+    BUILTIN_GLOBAL (pipeline),
+    BUILTIN_GLOBAL (shm),
+    BUILTIN_GLOBAL (streams),
+    BUILTIN_GLOBAL (stream_count),
+    BUILTIN_GLOBAL (stream_epoll_fd),
+    BUILTIN_GLOBAL (stream_timer_fd),
+    BUILTIN_GLOBAL (term_saved_fd),
+};
+
+#define BUILTIN_GLOBALS \
+    (sizeof (builtin_globals) / sizeof (builtin_globals[0]))
+
 /**
- * generate_chars:
+ * utfout_builtin_init:
  *
- * @range: range of characters to generate,
- * @expanded: newly-allocated expanded range of wide characters,
- * @len: length of @expanded,
- * @consumed: number of wide chars in range that have been processed by
- * this call.
+ * Record the initial value of the state that each run of the builtin
+ * modifies.
  *
- * Returns: 0 on success, else -1.
+ * Returns: 0 on success, or -1 on failure.
  **/
 int
-generate_chars (const wchar_t  *range,
-        wchar_t       **expanded,
-        size_t         *len,
-        size_t         *consumed)
-{
-    wchar_t   start;
-    wchar_t   end;
-    wchar_t   initial_value;
-    size_t    l;
-    int       direction;
-    wchar_t  *wc;
-
-    assert (range);
-    assert (expanded);
-    assert (len);
-    assert (consumed);
+utfout_builtin_init (void)
+{
+    size_t  i;
 
-    wctype_t digit;
-    wctype_t xdigit;
+    for (i = 0; i < BUILTIN_GLOBALS; i++) {
+        builtin_globals[i].initial = malloc (builtin_globals[i].size);
+        if (! builtin_globals[i].initial)
+            return -1;
 
-    /* large enough to hold 'FFFFFFFF'-style pattern, without leading '\U',
-     * but with a terminator.
-     */
-#define WCHAR_BUFSIZE (8+1)
-
-    wchar_t  buffer[WCHAR_BUFSIZE];
-
-    digit  = wctype ("digit");
-    xdigit = wctype ("xdigit");
-
-    /* range must _start_ with one of the following patterns:
-     *
-     *      L"{\uFFFFFFFF..\uFFFFFFFF}" (4 unicode characters)
-     *      L"{\uFFFF..\uFFFF}"         (2 unicode characters)
-     *      L"{\o777..\o777}"           (3 octal characters)
-     *      L"{\xFF..\xFF}"             (2 hex characters)
-     *      L"{?..?}"                   (2 literal characters)
-     *
-     * ...but note that it may contain further characters
-     * that will be handled by other parts of the code.
-     */
-    if ((wcslen (range) >= 24
-                && range[0] == L'{'
-                && range[1] == L'\\'
-                && range[2] == L'U'
-                && iswctype (range[3], xdigit)
-                && iswctype (range[4], xdigit)
-                && iswctype (range[5], xdigit)
-                && iswctype (range[6], xdigit)
-                && iswctype (range[7], xdigit)
-                && iswctype (range[8], xdigit)
-                && iswctype (range[9], xdigit)
-                && iswctype (range[10], xdigit)
-                && range[11] == L'.'
-                && range[12] == L'.'
-                && range[13] == L'\\'
-                && range[14] == L'U'
-                && iswctype (range[15], xdigit)
-                && iswctype (range[16], xdigit)
-                && iswctype (range[17], xdigit)
-                && iswctype (range[18], xdigit)
-                && iswctype (range[19], xdigit)
-                && iswctype (range[20], xdigit)
-                && iswctype (range[21], xdigit)
-                && iswctype (range[22], xdigit)
-                && range[23] == L'}')) {
-
-                    /* 4 unicode characters */
-
-                    buffer[0] = range[3];
-                    buffer[1] = range[4];
-                    buffer[2] = range[5];
-                    buffer[3] = range[6];
-                    buffer[4] = range[7];
-                    buffer[5] = range[8];
-                    buffer[6] = range[9];
-                    buffer[7] = range[10];
-                    buffer[8] = L'\0';
-
-                    if (get_hex_char (buffer, &start) < 0)
-                        goto error;
-
-                    buffer[0] = range[15];
-                    buffer[1] = range[16];
-                    buffer[2] = range[17];
-                    buffer[3] = range[18];
-                    buffer[4] = range[19];
-                    buffer[5] = range[20];
-                    buffer[6] = range[21];
-                    buffer[7] = range[22];
-                    buffer[8] = L'\0';
-
-                    if (get_hex_char (buffer, &end) < 0)
-                        goto error;
-
-                    *consumed = 24;
-                } else if ((wcslen (range) >= 16
-                            && range[0] == L'{'
-                            && range[1] == L'\\'
-                            && range[2] == L'u'
-                            && iswctype (range[3], xdigit)
-                            && iswctype (range[4], xdigit)
-                            && iswctype (range[5], xdigit)
-                            && iswctype (range[6], xdigit)
-                            && range[7] == L'.'
-                            && range[8] == L'.'
-                            && range[9] == L'\\'
-                            && range[10] == L'u'
-                            && iswctype (range[11], xdigit)
-                            && iswctype (range[12], xdigit)
-                            && iswctype (range[13], xdigit)
-                            && iswctype (range[14], xdigit)
-                            && range[15] == L'}')) {
-
-                    /* 2 unicode characters */
-
-                    buffer[0] = range[3];
-                    buffer[1] = range[4];
-                    buffer[2] = range[5];
-                    buffer[3] = range[6];
-                    buffer[4] = L'\0';
-
-                    if (get_hex_char (buffer, &start) < 0)
-                        goto error;
-
-                    buffer[0] = range[11];
-                    buffer[1] = range[12];
-                    buffer[2] = range[13];
-                    buffer[3] = range[14];
-                    buffer[4] = L'\0';
-
-                    if (get_hex_char (buffer, &end) < 0)
-                        goto error;
-
-                    *consumed = 16;
-
-                } else if ((wcslen (range) >= 14
-                            && range[0] == L'{'
-                            && range[1] == L'\\'
-                            && range[2] == L'o'
-                            && iswctype (range[3], digit)
-                            && iswctype (range[4], digit)
-                            && iswctype (range[5], digit)
-                            && range[6] == L'.'
-                            && range[7] == L'.'
-                            && range[8] == L'\\'
-                            && range[9] == L'o'
-                            && iswctype (range[10], digit)
-                            && iswctype (range[11], digit)
-                            && iswctype (range[12], digit)
-                            && range[13] == L'}')) {
-
-                    /* 2 octal characters */
-
-                    buffer[0] = range[3];
-                    buffer[1] = range[4];
-                    buffer[2] = range[5];
-                    buffer[3] = L'\0';
-
-                    if (get_oct_char (buffer, &start) < 0)
-                        goto error;
-
-                    buffer[0] = range[10];
-                    buffer[1] = range[11];
-                    buffer[2] = range[12];
-                    buffer[3] = L'\0';
-
-                    if (get_oct_char (buffer, &end) < 0)
-                        goto error;
-
-                    *consumed = 14;
-
-                } else if ((wcslen (range) >= 12
-                            && range[0] == L'{'
-                            && range[1] == L'\\'
-                            && range[2] == L'x'
-                            && iswctype (range[3], xdigit)
-                            && iswctype (range[4], xdigit)
-                            && range[5] == L'.'
-                            && range[6] == L'.'
-                            && range[7] == L'\\'
-                            && range[8] == L'x'
-                            && iswctype (range[9], xdigit)
-                            && iswctype (range[10], xdigit)
-                            && range[11] == L'}')) {
-
-                    /* 2 hex characters */
-
-                    buffer[0] = range[3];
-                    buffer[1] = range[4];
-                    buffer[2] = L'\0';
-
-                    if (get_hex_char (buffer, &start) < 0)
-                        goto error;
-
-                    buffer[0] = range[9];
-                    buffer[1] = range[10];
-                    buffer[2] = L'\0';
-
-                    if (get_hex_char (buffer, &end) < 0)
-                        goto error;
-
-                    *consumed = 12;
-
-                } else if ((wcslen (range) >= 6
-                            && range[0] == L'{'
-                            && range[2] == L'.'
-                            && range[3] == L'.'
-                            && range[5] == L'}')) {
-
-                    /* 2 literal characters */
-
-                    start = range[1];
-                    end   = range[4];
-                    *consumed = 6;
-
-                } else {
-                    goto error;
-                }
+        memcpy (builtin_globals[i].initial, builtin_globals[i].addr,
+                builtin_globals[i].size);
+    }
 
-    initial_value = start;
+    return 0;
+}
 
-    direction = (start < end) ? +1 : -1;
+/**
+ * builtin_release:
+ *
+ * Free the memory and close the file descriptors that a run of the
+ * builtin leaves for exit() to release.
+ **/
+static void
+builtin_release (void)
+{
+    struct corpus       *corpus;
+    struct file_target  *file;
+    struct program      *program;
+    struct profile      *parsed;
+    size_t               i;
 
-    /* calculate number of characters in sequence */
-    l = (start < end) ? end - start : start - end;
+    if (tty_fd >= 0)
+        close (tty_fd);
 
-    /* include space for terminator */
-    l++;
+    free (last_str);
 
-    *expanded = calloc (l, sizeof (wchar_t));
-    if (! *expanded)
-        goto error;
+    /* left by an exit part way through compiling or running */
+    if (pending_insn)
+        free_instruction (pending_insn);
 
-    wc = *expanded;
+    while ((program = open_block)) {
+        open_block = program->parent;
+        release_program (program);
+    }
 
-    while (1) {
-        *wc = initial_value;
-        wc++;
+    release_program (last_block);
 
-        if (initial_value == end)
-            break;
+    free_streams ();
 
-        initial_value += direction;
+    while ((parsed = profiles)) {
+        profiles = parsed->next;
+        free (parsed->phases);
+        free (parsed->text);
+        free (parsed);
     }
 
-    *len = l;
+    while ((corpus = corpora)) {
+        corpora = corpus->next;
+        munmap (corpus->map, corpus->size);
+        free (corpus->entries);
+        free (corpus->path);
+        free (corpus);
+    }
 
-    return 0;
+    while ((file = files)) {
+        files = file->next;
+        close (file->fd);
+        free (file->data);
+        free (file->path);
+        free (file);
+    }
 
-error:
-    *len = 0;
-    *consumed = 0;
-    return -1;
+    for (i = 0; i < shards.count; i++)
+        free (shards.shards[i].data);
+
+    free (shards.shards);
+    free (shards.record);
+    free (shards.pfds);
+    free (datagrams.data);
+    free (datagrams.iov);
+    free (frame.framed);
+    free (frame.record);
+    free (frame.partial);
+    free (bom_fds);
+    free (checksums);
+
+#ifdef HAVE_SHM_RING
+    if (shm.ring) {
+        shm_ring_unmap (shm.data, shm.size);
+        munmap (shm.ring, (size_t)shm.ring->data);
+        close (shm.fd);
+    }
+#endif
 }
 
-
 /**
- * simple_escape_to_literal:
+ * utfout_builtin_run:
  *
- * @value: value to check.
+ * @argc: number of arguments,
+ * @argv: arguments (@argv[0] being the command name).
  *
- * Convert specified character @value (which is assumed to have
- * already been parsed as part of an escape sequence) into
- * its literal value.
+ * Run utfout within the calling process. Earlier runs have no effect
+ * on later ones, and rather than exiting, the exit status is returned.
  *
- * Returns: literal value, or -1 on error (denoting @value is not
- * actually a valid escape character).
+ * Returns: exit status.
  **/
 int
-simple_escape_to_literal (int value)
+utfout_builtin_run (int argc, char *argv[])
 {
-    int c = -1;
+    size_t  i;
 
-    switch (value) {
+    for (i = 0; i < BUILTIN_GLOBALS; i++)
+        memcpy (builtin_globals[i].addr, builtin_globals[i].initial,
+                builtin_globals[i].size);
 
-        case L'0': /* nul */
-            c = L'\0';
-            break;
+    /* reinitialise getopt_long() */
+    optind = 0;
 
-        case L'a': /* alert (BEL) */
-            c = L'\a';
-            break;
+    builtin_status = EXIT_SUCCESS;
 
-        case L'b': /* backspace */
-            c = L'\b';
-            break;
+    /* main() always ends with utfout_exit() */
+    if (! setjmp (builtin_exit))
+        main (argc, argv);
 
-        case L'c': /* no further output */
-            exit (EXIT_SUCCESS);
-            break;
+    builtin_release ();
 
-        case L'e': /* emit escape character */
-            c = ESCAPE_CHAR;
-            break;
+    return builtin_status;
+}
 
-        case L'f': /* formfeed */
-            c = L'\f';
-            break;
+#endif /* UTFOUT_BUILTIN */
 
-        case L'g': /* generate a random char */
-            c = (int)get_random_char ();
-            break;
+/**
+ * utfout_atexit:
+ *
+ * @handler: function to call on exit.
+ *
+ * Arrange for @handler to be called on exit, once however many times
+ * it is registered.
+ *
+ * Returns: 0 on success, or non-zero on failure.
+ **/
+int
+utfout_atexit (void (*handler) (void))
+{
+    size_t  i;
 
-        case L'n': /* newline */
-            c = L'\n';
-            break;
+    for (i = 0; i < exit_handler_count; i++) {
+        if (exit_handlers[i] == handler)
+            return 0;
+    }
 
-        case L'r': /* carriage return */
-            c = L'\r';
-            break;
+    if (exit_handler_count == EXIT_HANDLERS)
+        return -1;
 
-        case 't': /* horizontal tab */
-            c = L'\t';
-            break;
+    exit_handlers[exit_handler_count++] = handler;
 
-        case L'v': /* vertical tab */
-            c = L'\v';
-            break;
-    }
+#ifdef UTFOUT_BUILTIN
+    return 0;
+#else
+    return atexit (handler);
+#endif
+}
+
+/**
+ * utfout_exit:
+ *
+ * @status: exit status.
+ *
+ * Exit with @status or, for the shell builtin, call the functions
+ * registered with utfout_atexit() and return @status to the shell.
+ **/
+void
+utfout_exit (int status)
+{
+#ifdef UTFOUT_BUILTIN
+    /* in reverse order of registration, as exit() would */
+    while (exit_handler_count)
+        exit_handlers[--exit_handler_count] ();
+
+    fflush (stdout);
+    fflush (stderr);
+
+    builtin_status = status;
+    longjmp (builtin_exit, 1);
+#else
+    exit (status);
+#endif
+}
+
+/**
+ * block_option:
+ *
+ * @option: option returned by getopt_long().
+ *
+ * Returns: TRUE if @option may be used between '--begin' and '--end'.
+ * Only options that produce output or affect how later strings are
+ * compiled are allowed; options that act on the output so far are not.
+ **/
+static int
+block_option (int option)
+{
+    switch (option) {
+        case 1:
+        case 'a':
+        case 'b':
+        case 'B':
+        case 'e':
+        case 'h':
+        case 'i':
+        case 'l':
+        case 'o':
+        case 'p':
+        case 'r':
+        case 's':
+        case 't':
+        case 'u':
+        case 'v':
+        case 'x':
+        case OPTION_STRICT:
+        case OPTION_BEGIN:
+        case OPTION_END:
+        case OPTION_PROFILE:
+            return 1;
 
-    return c;
+        default:
+            return 0;
+    }
 }
 
 int
 main (int argc, char *argv[])
 {
-    int    last_fd = STDOUT_FILENO;
-    int    option;
-    int    long_index;
-    int    repeat = 0;
-    char  *intra_char_delay = NULL;
-    int    separator = '\0';
-    int    separator_specified = 0;
-
+    int                  last_fd = STDOUT_FILENO;
+    int                  option;
+    int                  long_index;
+    int64_t              intra_char_delay = 0;
+    const int64_t       *delay = NULL;
+    int                  separator = '\0';
+    int                  separator_specified = 0;
+    struct program      *new;
+    struct instruction   insn;
+
+#ifndef UTFOUT_BUILTIN
+    /* a shell builtin uses the shell's locale */
     if (! setlocale (LC_ALL, ""))
         die ("Could not set locale");
+#endif
+
+    if (clock_gettime (CLOCK_MONOTONIC, &clocks.start) < 0)
+        die ("failed to read clock");
+
+    locale_utf8 = ! strcmp (nl_langinfo (CODESET), "UTF-8");
 
     struct option long_options[] = {
+        {"begin"           , no_argument       , 0, OPTION_BEGIN},
+        {"bom"             , no_argument       , 0, OPTION_BOM},
+        {"bytes"           , no_argument       , 0, 'B'},
+        {"checksum"        , required_argument , 0, OPTION_CHECKSUM},
+        {"clock-update"    , required_argument , 0, OPTION_CLOCK_UPDATE},
+        {"datagram"        , required_argument , 0, OPTION_DATAGRAM},
+        {"encoding"        , required_argument , 0, OPTION_ENCODING},
+        {"end"             , no_argument       , 0, OPTION_END},
         {"exit"            , required_argument , 0, 'x'},
+        {"file"            , required_argument , 0, OPTION_FILE},
         {"file-descriptor" , required_argument , 0, 'u'},
+        {"file-options"    , required_argument , 0, OPTION_FILE_OPTIONS},
+        {"frame"           , required_argument , 0, OPTION_FRAME},
         {"help"            , no_argument       , 0, 'h'},
         {"interpret"       , required_argument , 0, 'i'},
         {"intra-char"      , required_argument , 0, 'a'},
         {"intra-pause"     , required_argument , 0, 'b'},
         {"literal"         , no_argument       , 0, 'l'},
+        {"pipeline"        , optional_argument , 0, OPTION_PIPELINE},
         {"prefix"          , required_argument , 0, 'p'},
+        {"profile"         , required_argument , 0, OPTION_PROFILE},
+        {"profile-report"  , required_argument , 0, OPTION_PROFILE_REPORT},
+        {"range"           , required_argument , 0, OPTION_RANGE},
         {"repeat"          , required_argument , 0, 'r'},
+        {"seed"            , required_argument , 0, OPTION_SEED},
+        {"shard"           , required_argument , 0, OPTION_SHARD},
+        {"shm"             , required_argument , 0, OPTION_SHM},
+        {"skip"            , required_argument , 0, OPTION_SKIP},
+        {"skip-repeats"    , required_argument , 0, OPTION_SKIP_REPEATS},
         {"sleep"           , required_argument , 0, 's'},
+        {"stats"           , optional_argument , 0, OPTION_STATS},
         {"stderr"          , required_argument , 0, 'e'},
         {"stdout"          , required_argument , 0, 'o'},
+        {"stream"          , required_argument , 0, OPTION_STREAM},
+        {"strict"          , no_argument       , 0, OPTION_STRICT},
+        {"term-bench"      , optional_argument , 0, OPTION_TERM_BENCH},
         {"terminal"        , no_argument       , 0, 't'},
         {"version"         , no_argument       , 0, 'v'},
 
@@ -1270,8 +9392,17 @@ main (int argc, char *argv[])
     };
 
     while ((option = getopt_long (argc, argv,
-                    "-a:b:ehilop:r:s:tu:U:x:",
+                    "-a:b:Behilop:r:s:tu:U:x:",
                     long_options, &long_index)) != -1) {
+
+        /* a group of streams ends at the first other argument */
+        if (stream_count && option != OPTION_STREAM)
+            run_streams ();
+
+        if (open_block && ! block_option (option))
+            die ("'%s' cannot be used between '--begin' and '--end'",
+                    argv[optind - 1]);
+
         switch (option)
         {
             /* a non-option, in other words a string */
@@ -1279,8 +9410,15 @@ main (int argc, char *argv[])
                 if (last_str)
                     free (last_str);
                 last_str = strdup (optarg);
-                handle_string (last_fd, last_str, intra_char_delay,
+                if (! last_str)
+                    die ("failed to allocate space for string");
+
+                release_program (last_block);
+                last_block = NULL;
+
+                compile_string (&insn, last_fd, last_str, 1, delay,
                         separator_specified, separator);
+                add_instruction (open_block, &insn);
                 break;
 
             case 'a':
@@ -1307,7 +9445,12 @@ main (int argc, char *argv[])
                 break;
 
             case 'b':
-                intra_char_delay = optarg;
+                intra_char_delay = requested_delay (optarg);
+                delay = &intra_char_delay;
+                break;
+
+            case 'B':
+                bytes_mode = 1;
                 break;
 
             case 'e':
@@ -1316,7 +9459,7 @@ main (int argc, char *argv[])
 
             case 'h':
                 usage ();
-                exit (EXIT_SUCCESS);
+                utfout_exit (EXIT_SUCCESS);
 
             case 'i':
                 disable_escapes = 0;
@@ -1335,25 +9478,32 @@ main (int argc, char *argv[])
                 break;
 
             case 'r':
-                if (! last_str)
+                if (last_block) {
+                    /* repeat the whole block */
+                    memset (&insn, 0, sizeof (insn));
+                    insn.op = OP_BLOCK;
+                    insn.count = atoi (optarg);
+                    if (insn.count < 0)
+                        insn.count = -1;
+                    insn.block = last_block;
+                    last_block->refs++;
+                } else if (last_str) {
+                    /* tokenize once, display many times */
+                    compile_string (&insn, last_fd, last_str, atoi (optarg),
+                            delay, separator_specified, separator);
+                } else
                     break;
 
-                repeat = atoi (optarg);
-
-                while (1) {
-                    handle_string (last_fd, last_str, intra_char_delay,
-                            separator_specified, separator);
-
-                    if (repeat != -1) {
-                        repeat--;
-                        if (! repeat)
-                            break;
-                    }
-                }
+                insn.profile = profile;
+                add_instruction (open_block, &insn);
                 break;
 
             case 's':
-                handle_sleep (optarg);
+                memset (&insn, 0, sizeof (insn));
+                insn.op = OP_SLEEP;
+                insn.count = 1;
+                insn.delay = requested_delay (optarg);
+                add_instruction (open_block, &insn);
                 break;
 
             case 't':
@@ -1368,22 +9518,403 @@ main (int argc, char *argv[])
                 break;
 
             case 'v':
-                wprintf (L"%s %s: %s\n", PACKAGE_NAME, _("version"), PACKAGE_VERSION);
-                wprintf (L"%s: %s\n", _("License"), PROGRAM_LICENSE);
-                wprintf (L"%s: %s\n", _("Written by"), PROGRAM_AUTHORS);
-                exit (EXIT_SUCCESS);
+                printf ("%s %s: %s\n", PACKAGE_NAME, _("version"), PACKAGE_VERSION);
+                printf ("%s: %s\n", _("License"), PROGRAM_LICENSE);
+                printf ("%s: %s\n", _("Written by"), PROGRAM_AUTHORS);
+                utfout_exit (EXIT_SUCCESS);
                 break;
 
             case 'x':
-                exit (atoi (optarg));
+                memset (&insn, 0, sizeof (insn));
+                insn.op = OP_EXIT;
+                insn.count = 1;
+                insn.status = atoi (optarg);
+                add_instruction (open_block, &insn);
+                break;
+
+            case OPTION_BEGIN:
+                new = calloc (1, sizeof (struct program));
+                if (! new)
+                    die ("failed to allocate space for block");
+
+                new->refs = 1;
+                new->parent = open_block;
+                open_block = new;
+                break;
+
+            case OPTION_END:
+                if (! open_block)
+                    die ("'--end' without '--begin'");
+
+                new = open_block;
+                open_block = new->parent;
+                new->parent = NULL;
+
+                /* the block is now what '-r' repeats */
+                release_program (last_block);
+                last_block = new;
+
+                memset (&insn, 0, sizeof (insn));
+                insn.op = OP_BLOCK;
+                insn.count = 1;
+                insn.block = new;
+                new->refs++;
+                add_instruction (open_block, &insn);
+                break;
+
+            case OPTION_STRICT:
+                strict = 1;
+                break;
+
+            case OPTION_ENCODING:
+                {
+                    const struct encoding  *encoding;
+
+                    /* previous output was in the previous encoding */
+                    flush_output ();
+
+                    for (encoding = encodings; encoding->name; encoding++) {
+                        if (! strcasecmp (encoding->name, optarg))
+                            break;
+                    }
+
+                    if (! encoding->name)
+                        die ("invalid encoding '%s'", optarg);
+
+                    output_encoding = encoding;
+                }
+                break;
+
+            case OPTION_BOM:
+                output_bom = 1;
+                break;
+
+            case OPTION_STREAM:
+                add_stream (optarg, separator_specified, separator);
+                break;
+
+            case OPTION_SEED:
+                {
+                    char  *end;
+
+                    errno = 0;
+                    random_state.seed = strtoull (optarg, &end, 0);
+                    if (end == optarg || *end || errno)
+                        die ("invalid seed '%s'", optarg);
+
+                    random_state.seeded = 1;
+                }
+                break;
+
+            case OPTION_SKIP:
+                window.start = parse_size (optarg);
+                break;
+
+            case OPTION_SKIP_REPEATS:
+                {
+                    char  *end;
+
+                    errno = 0;
+                    skip_repeats = strtoull (optarg, &end, 10);
+                    if (end == optarg || *end || *optarg == '-' || errno)
+                        die ("invalid number of repeats '%s'", optarg);
+                }
+                break;
+
+            case OPTION_RANGE:
+                {
+                    char  *end = strchr (optarg, ':');
+
+                    if (! end)
+                        die ("invalid range '%s'", optarg);
+
+                    *end++ = '\0';
+
+                    window.start = *optarg ? parse_size (optarg) : 0;
+                    window.end = *end ? parse_size (end) : 0;
+
+                    if (window.end && window.end <= window.start)
+                        die ("invalid range '%s:%s'", optarg, end);
+                }
+                break;
+
+            case OPTION_DATAGRAM:
+                /* earlier output is sent using the earlier options */
+                flush_output ();
+                flush_datagrams (1);
+
+                parse_datagram_spec (optarg);
+                break;
+
+            case OPTION_FILE:
+                last_fd = open_file (optarg);
+                break;
+
+            case OPTION_SHM:
+                last_fd = open_shm (optarg);
+                break;
+
+            case OPTION_FILE_OPTIONS:
+                parse_file_options (optarg);
+                break;
+
+            case OPTION_PIPELINE:
+#ifdef UTFOUT_BUILTIN
+                die ("'--pipeline' is not supported by the shell builtin");
+#endif
+                start_pipeline (optarg);
+                break;
+
+            case OPTION_PROFILE:
+                profile = parse_profile (optarg);
+                break;
+
+            case OPTION_TERM_BENCH:
+                run_term_bench (optarg);
+                break;
+
+            case OPTION_FRAME:
+                /* a partial line is a record in the earlier format */
+                flush_output ();
+                flush_frames ();
+
+                parse_frame_spec (optarg);
+                break;
+
+            case OPTION_PROFILE_REPORT:
+                {
+                    uint64_t  ns;
+
+                    if (parse_delay (optarg, &ns) < 0 || ! ns)
+                        die ("invalid report interval '%s'", optarg);
+
+                    profile_report = ns;
+                }
+                break;
+
+            case OPTION_SHARD:
+                add_shards (optarg);
+                last_fd = SHARD_FD;
+                break;
+
+            case OPTION_CHECKSUM:
+                {
+                    char                *fd = strchr (optarg, ':');
+                    enum checksum_type   type;
+
+                    if (fd) {
+                        *fd++ = '\0';
+                        checksum_fd = atoi (fd);
+                    }
+
+                    type = checksum_type_from_name (optarg);
+                    if (type == CHECKSUM_NONE)
+                        die ("invalid checksum '%s'", optarg);
+
+                    /* output so far was not checksummed */
+                    flush_output ();
+
+                    if (! checksum_type && utfout_atexit (display_checksums))
+                        die ("failed to register checksum handler");
+
+                    if (checksum_type && type != checksum_type)
+                        die ("only one checksum algorithm may be specified");
+
+                    checksum_type = type;
+                }
+                break;
+
+            case OPTION_STATS:
+                if (! stats_format && utfout_atexit (display_stats))
+                    die ("failed to register statistics handler");
+
+                if (! optarg || ! strcmp (optarg, "text"))
+                    stats_format = STATS_TEXT;
+                else if (! strcmp (optarg, "json"))
+                    stats_format = STATS_JSON;
+                else {
+                    stats_format = STATS_NONE;
+                    die ("invalid statistics format '%s'", optarg);
+                }
+                break;
+
+            case OPTION_CLOCK_UPDATE:
+                if (! strcmp (optarg, "buffer"))
+                    clock_update = CLOCK_UPDATE_BUFFER;
+                else if (! strcmp (optarg, "string"))
+                    clock_update = CLOCK_UPDATE_STRING;
+                else if (! strcmp (optarg, "always"))
+                    clock_update = CLOCK_UPDATE_ALWAYS;
+                else
+                    die ("invalid clock update value '%s'", optarg);
                 break;
         }
     }
 
+    if (open_block)
+        die ("'--begin' without '--end'");
+
+    run_streams ();
+
     if (last_str)
         free (last_str);
+    last_str = NULL;
+
+    release_program (last_block);
+    last_block = NULL;
 
-    exit (EXIT_SUCCESS);
+    finish_output ();
+
+    utfout_exit (EXIT_SUCCESS);
+}
+
+/**
+ * parse_size:
+ *
+ * @str: string representing a number of bytes, optionally followed by
+ * 'K', 'M', 'G' or 'T' (powers of 1024).
+ *
+ * Returns: number of bytes represented by @str.
+ **/
+uint64_t
+parse_size (const char *str)
+{
+    unsigned long long  value;
+    char               *end;
+    const char         *suffixes = "KMGT";
+    const char         *suffix;
+
+    assert (str);
+
+    errno = 0;
+    value = strtoull (str, &end, 10);
+    if (end == str || errno || *str == '-')
+        die ("invalid size '%s'", str);
+
+    if (*end) {
+        suffix = strchr (suffixes, toupper ((unsigned char)*end));
+        if (! suffix || end[1])
+            die ("invalid size '%s'", str);
+
+        value <<= 10 * (suffix - suffixes + 1);
+    }
+
+    return (uint64_t)value;
+}
+
+/**
+ * copy_options:
+ *
+ * @copy: buffer of OPTIONS_MAX bytes,
+ * @spec: comma-separated options,
+ * @what: description of @spec for errors.
+ *
+ * Copy @spec to @copy for parsing. Options are parsed from a copy on
+ * the stack, which is not leaked should one of them be invalid.
+ **/
+void
+copy_options (char *copy, const char *spec, const char *what)
+{
+    assert (copy);
+    assert (spec);
+
+    if (strlen (spec) >= OPTIONS_MAX)
+        die ("%s '%s' too long (maximum %d bytes)", what, spec,
+                OPTIONS_MAX - 1);
+
+    strcpy (copy, spec);
+}
+
+/**
+ * get_random_seed:
+ *
+ * Returns: seed for pseudo-random number generators.
+ **/
+static unsigned int
+get_random_seed (void)
+{
+    struct timeval  tv;
+
+    gettimeofday (&tv, NULL);
+
+    /* courtesy of bash */
+    return (tv.tv_sec ^ tv.tv_usec ^ getpid ());
+}
+
+/**
+ * philox:
+ *
+ * @ctr: counter (updated in place with the result),
+ * @key: key.
+ *
+ * Philox4x32-10 counter-based pseudo-random number generator.
+ **/
+static void
+philox (uint32_t ctr[4], const uint32_t key[2])
+{
+    uint32_t  k0 = key[0];
+    uint32_t  k1 = key[1];
+    uint64_t  p0;
+    uint64_t  p1;
+    int       round;
+
+    for (round = 0; round < 10; round++) {
+        p0 = (uint64_t)0xD2511F53 * ctr[0];
+        p1 = (uint64_t)0xCD9E8D57 * ctr[2];
+
+        ctr[0] = (uint32_t)(p1 >> 32) ^ ctr[1] ^ k0;
+        ctr[1] = (uint32_t)p1;
+        ctr[2] = (uint32_t)(p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[3] = (uint32_t)p0;
+
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+}
+
+/**
+ * get_random_u64:
+ *
+ * Generate a 64-bit pseudo-random number from the seed, the number of
+ * strings displayed so far and the number of values already drawn for
+ * the current string.
+ *
+ * Returns: generated number.
+ **/
+uint64_t
+get_random_u64 (void)
+{
+    uint32_t  ctr[4];
+    uint32_t  key[2];
+    uint64_t  block;
+
+    if (! random_state.seeded) {
+        random_state.seed = get_random_seed ();
+        random_state.seeded = 1;
+    }
+
+    /* each block provides two values */
+    if (random_state.draw & 1) {
+        random_state.draw++;
+        return random_state.cache;
+    }
+
+    block = random_state.draw / 2;
+
+    ctr[0] = (uint32_t)block;
+    ctr[1] = (uint32_t)(block >> 32);
+    ctr[2] = (uint32_t)random_state.emission;
+    ctr[3] = (uint32_t)(random_state.emission >> 32);
+
+    key[0] = (uint32_t)random_state.seed;
+    key[1] = (uint32_t)(random_state.seed >> 32);
+
+    philox (ctr, key);
+
+    random_state.cache = ((uint64_t)ctr[3] << 32) | ctr[2];
+    random_state.draw++;
+
+    return ((uint64_t)ctr[1] << 32) | ctr[0];
 }
 
 /**
@@ -1397,23 +9928,9 @@ wchar_t
 get_random_char (void)
 {
     wchar_t    wc;
-    static int seeded = 0;
-
-    if (! seeded) {
-        struct timeval  tv;
-        unsigned int    seed;
-
-        gettimeofday (&tv, NULL);
-
-        /* courtesy of bash */
-        seed = (tv.tv_sec ^ tv.tv_usec ^ getpid ());
-
-        srand (seed);
-        seeded = 1;
-    }
 
     while (1) {
-        wc = (wchar_t)rand ();
+        wc = (wchar_t)(get_random_u64 () >> 33);
 
         /* If the random character is not printable, bit-shift in the
          * home that the result might be.